@@ -4,16 +4,26 @@
 LRUCache* init_lru_cache(int capacity) {
     LRUCache* cache = (LRUCache*)malloc(sizeof(LRUCache));
     cache->capacity = capacity;
-    cache->size = 0;
-    cache->head = NULL;
-    cache->tail = NULL;
-    
-    // Initialize hash table
-    memset(cache->hash, 0, sizeof(CacheNode*) * CACHE_SIZE);
-    
-    // Initialize mutex
-    pthread_mutex_init(&cache->lock, NULL);
-    
+    cache->generation = 0;
+
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        CacheShard* shard = &cache->shards[i];
+        shard->capacity = (capacity + CACHE_SHARDS - 1) / CACHE_SHARDS;
+        shard->size = 0;
+        shard->head = NULL;
+        shard->tail = NULL;
+        shard->hits = 0;
+        shard->misses = 0;
+        shard->invalidations = 0;
+        shard->stale_hits = 0;
+
+        // Initialize hash table
+        memset(shard->hash, 0, sizeof(CacheNode*) * CACHE_BUCKETS);
+
+        // Initialize mutex
+        pthread_mutex_init(&shard->lock, NULL);
+    }
+
     return cache;
 }
 
@@ -23,15 +33,52 @@ unsigned int cache_hash(const char* path) {
     while (*path) {
         hash = (hash * 31) + *path++;
     }
-    return hash % CACHE_SIZE;
+    // Mix so both the shard and the bucket index see well spread bits
+    hash ^= hash >> 16;
+    hash *= 0x45d9f3b;
+    hash ^= hash >> 16;
+    return hash;
+}
+
+// Pick the shard for a hash; the bucket comes from the remaining bits
+static CacheShard* shard_for(LRUCache* cache, unsigned int hash) {
+    return &cache->shards[hash % CACHE_SHARDS];
+}
+
+static unsigned int bucket_for(unsigned int hash) {
+    return (hash / CACHE_SHARDS) % CACHE_BUCKETS;
+}
+
+// Find a node in its bucket chain, caller holds the shard lock
+static CacheNode* find_node(CacheShard* shard, const char* path, unsigned int hash) {
+    CacheNode* node = shard->hash[bucket_for(hash)];
+    while (node) {
+        if (node->hash == hash && strcmp(node->path, path) == 0) {
+            return node;
+        }
+        node = node->chain_next;
+    }
+    return NULL;
+}
+
+// Unlink a node from its bucket chain, caller holds the shard lock
+static void unchain_node(CacheShard* shard, CacheNode* node) {
+    CacheNode** link = &shard->hash[bucket_for(node->hash)];
+    while (*link) {
+        if (*link == node) {
+            *link = node->chain_next;
+            return;
+        }
+        link = &(*link)->chain_next;
+    }
 }
 
 // Move node to front (most recently used)
-void move_to_front(LRUCache* cache, CacheNode* node) {
-    if (node == cache->head) {
+void move_to_front(CacheShard* shard, CacheNode* node) {
+    if (node == shard->head) {
         return; // Already at front
     }
-    
+
     // Remove from current position
     if (node->prev) {
         node->prev->next = node->next;
@@ -39,128 +86,381 @@ void move_to_front(LRUCache* cache, CacheNode* node) {
     if (node->next) {
         node->next->prev = node->prev;
     }
-    if (node == cache->tail) {
-        cache->tail = node->prev;
+    if (node == shard->tail) {
+        shard->tail = node->prev;
     }
-    
+
     // Move to front
-    node->next = cache->head;
+    node->next = shard->head;
     node->prev = NULL;
-    if (cache->head) {
-        cache->head->prev = node;
+    if (shard->head) {
+        shard->head->prev = node;
     }
-    cache->head = node;
-    if (!cache->tail) {
-        cache->tail = node;
+    shard->head = node;
+    if (!shard->tail) {
+        shard->tail = node;
     }
 }
 
+// Unlink and free a node, caller holds the shard lock
+static void remove_node(CacheShard* shard, CacheNode* node) {
+    unchain_node(shard, node);
+    if (node->prev) {
+        node->prev->next = node->next;
+    } else {
+        shard->head = node->next;
+    }
+    if (node->next) {
+        node->next->prev = node->prev;
+    } else {
+        shard->tail = node->prev;
+    }
+    free(node);
+    shard->size--;
+}
+
 // Create new cache node
-CacheNode* create_node(const char* path, const char* ss_ip, int ss_port) {
+CacheNode* create_node(const char* path, const char* ss_ip, int ss_port, int ss_id) {
     CacheNode* node = (CacheNode*)malloc(sizeof(CacheNode));
     strncpy(node->path, path, sizeof(node->path) - 1);
+    node->path[sizeof(node->path) - 1] = '\0';
     strncpy(node->ss_ip, ss_ip, sizeof(node->ss_ip) - 1);
+    node->ss_ip[sizeof(node->ss_ip) - 1] = '\0';
     node->ss_port = ss_port;
+    node->ss_id = ss_id;
+    node->hash = cache_hash(node->path);
     node->prev = NULL;
     node->next = NULL;
+    node->chain_next = NULL;
     return node;
 }
 
-// Add or update entry in cache
-void cache_put(LRUCache* cache, const char* path, const char* ss_ip, int ss_port) {
-    pthread_mutex_lock(&cache->lock);
-    
+// Read before resolving a path, and passed back to cache_put
+unsigned long cache_generation(LRUCache* cache) {
+    return __atomic_load_n(&cache->generation, __ATOMIC_ACQUIRE);
+}
+
+// Add or update entry in cache. Skipped if an invalidation ran since generation
+// was read, so a lookup racing a DELETE never caches the old owner.
+void cache_put(LRUCache* cache, const char* path, const char* ss_ip, int ss_port, int ss_id,
+               unsigned long generation) {
     unsigned int hash_key = cache_hash(path);
-    CacheNode* existing = cache->hash[hash_key];
-    
+    CacheShard* shard = shard_for(cache, hash_key);
+    pthread_mutex_lock(&shard->lock);
+
+    if (cache_generation(cache) != generation) {
+        // Resolved against a namespace that has changed since
+        pthread_mutex_unlock(&shard->lock);
+        return;
+    }
+
+    CacheNode* existing = find_node(shard, path, hash_key);
+
     if (existing) {
         // Update existing entry
         strncpy(existing->ss_ip, ss_ip, sizeof(existing->ss_ip) - 1);
         existing->ss_port = ss_port;
-        move_to_front(cache, existing);
+        existing->ss_id = ss_id;
+        move_to_front(shard, existing);
     } else {
         // Create new entry
-        CacheNode* new_node = create_node(path, ss_ip, ss_port);
-        
-        // If cache is full, remove least recently used
-        if (cache->size >= cache->capacity) {
-            CacheNode* lru = cache->tail;
-            unsigned int lru_hash = cache_hash(lru->path);
-            cache->hash[lru_hash] = NULL;
-            
-            cache->tail = lru->prev;
-            if (cache->tail) {
-                cache->tail->next = NULL;
-            }
-            free(lru);
-            cache->size--;
+        CacheNode* new_node = create_node(path, ss_ip, ss_port, ss_id);
+
+        // If the shard is full, remove its least recently used entry
+        if (shard->size >= shard->capacity) {
+            remove_node(shard, shard->tail);
         }
-        
+
         // Add new node to front
-        new_node->next = cache->head;
-        if (cache->head) {
-            cache->head->prev = new_node;
+        new_node->next = shard->head;
+        if (shard->head) {
+            shard->head->prev = new_node;
         }
-        cache->head = new_node;
-        if (!cache->tail) {
-            cache->tail = new_node;
+        shard->head = new_node;
+        if (!shard->tail) {
+            shard->tail = new_node;
         }
-        
-        cache->hash[hash_key] = new_node;
-        cache->size++;
+
+        unsigned int bucket = bucket_for(hash_key);
+        new_node->chain_next = shard->hash[bucket];
+        shard->hash[bucket] = new_node;
+        shard->size++;
     }
-    
-    pthread_mutex_unlock(&cache->lock);
+
+    pthread_mutex_unlock(&shard->lock);
 }
 
 // Get entry from cache
-bool cache_get(LRUCache* cache, const char* path, char* ss_ip, int* ss_port) {
-    pthread_mutex_lock(&cache->lock);
-    
+bool cache_get(LRUCache* cache, const char* path, char* ss_ip, int* ss_port, int* ss_id) {
     unsigned int hash_key = cache_hash(path);
-    CacheNode* node = cache->hash[hash_key];
-    
-    if (node && strcmp(node->path, path) == 0) {
+    CacheShard* shard = shard_for(cache, hash_key);
+    pthread_mutex_lock(&shard->lock);
+
+    CacheNode* node = find_node(shard, path, hash_key);
+
+    if (node) {
         // Cache hit
         strncpy(ss_ip, node->ss_ip, INET_ADDRSTRLEN);
         *ss_port = node->ss_port;
-        move_to_front(cache, node);
-        pthread_mutex_unlock(&cache->lock);
+        *ss_id = node->ss_id;
+        move_to_front(shard, node);
+        shard->hits++;
+        pthread_mutex_unlock(&shard->lock);
         return true;
     }
-    
-    pthread_mutex_unlock(&cache->lock);
+
+    shard->misses++;
+    pthread_mutex_unlock(&shard->lock);
     return false;
 }
 
-// Clean up cache
-void free_lru_cache(LRUCache* cache) {
-    pthread_mutex_lock(&cache->lock);
-    
-    CacheNode* current = cache->head;
+// Drop every node of a shard matching a predicate, returns how many went
+static int remove_matching(CacheShard* shard, bool (*matches)(const CacheNode*, const void*),
+                           const void* arg) {
+    int removed = 0;
+    pthread_mutex_lock(&shard->lock);
+    CacheNode* current = shard->head;
     while (current) {
         CacheNode* next = current->next;
-        free(current);
+        if (matches(current, arg)) {
+            remove_node(shard, current);
+            removed++;
+        }
         current = next;
     }
-    
-    pthread_mutex_unlock(&cache->lock);
-    pthread_mutex_destroy(&cache->lock);
+    shard->invalidations += removed;
+    pthread_mutex_unlock(&shard->lock);
+    return removed;
+}
+
+// Invalidate one path, returns whether it was cached
+bool cache_remove(LRUCache* cache, const char* path) {
+    unsigned int hash_key = cache_hash(path);
+    CacheShard* shard = shard_for(cache, hash_key);
+    __atomic_add_fetch(&cache->generation, 1, __ATOMIC_RELEASE);
+    pthread_mutex_lock(&shard->lock);
+
+    CacheNode* node = find_node(shard, path, hash_key);
+    if (node) {
+        remove_node(shard, node);
+        shard->invalidations++;
+    }
+
+    pthread_mutex_unlock(&shard->lock);
+    return node != NULL;
+}
+
+// Whether path is prefix itself or lies below it
+static bool path_under(const char* path, const char* prefix) {
+    size_t len = strlen(prefix);
+    while (len > 1 && prefix[len - 1] == '/') {
+        len--; // "/a/" covers the same entries as "/a"
+    }
+    return strncmp(path, prefix, len) == 0 &&
+           (path[len] == '\0' || path[len] == '/');
+}
+
+static bool under_prefix(const CacheNode* node, const void* arg) {
+    return path_under(node->path, (const char*)arg);
+}
+
+// Invalidate a path and everything below it, returns the number of entries dropped
+int cache_remove_prefix(LRUCache* cache, const char* prefix) {
+    int removed = 0;
+    __atomic_add_fetch(&cache->generation, 1, __ATOMIC_RELEASE);
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        removed += remove_matching(&cache->shards[i], under_prefix, prefix);
+    }
+    return removed;
+}
+
+static bool on_server(const CacheNode* node, const void* arg) {
+    return node->ss_id == *(const int*)arg;
+}
+
+// Invalidate every entry pointing at a storage server, returns the number dropped
+int cache_remove_server(LRUCache* cache, int ss_id) {
+    int removed = 0;
+    __atomic_add_fetch(&cache->generation, 1, __ATOMIC_RELEASE);
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        removed += remove_matching(&cache->shards[i], on_server, &ss_id);
+    }
+    return removed;
+}
+
+// Drop an entry whose hit turned out to point at a departed server
+void cache_drop_stale(LRUCache* cache, const char* path) {
+    unsigned int hash_key = cache_hash(path);
+    CacheShard* shard = shard_for(cache, hash_key);
+    pthread_mutex_lock(&shard->lock);
+
+    CacheNode* node = find_node(shard, path, hash_key);
+    if (node) {
+        remove_node(shard, node);
+    }
+    shard->stale_hits++;
+
+    pthread_mutex_unlock(&shard->lock);
+}
+
+// Sum the counters over all shards
+void cache_get_stats(LRUCache* cache, CacheStats* stats) {
+    memset(stats, 0, sizeof(CacheStats));
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        pthread_mutex_lock(&cache->shards[i].lock);
+        stats->hits += cache->shards[i].hits;
+        stats->misses += cache->shards[i].misses;
+        stats->invalidations += cache->shards[i].invalidations;
+        stats->stale_hits += cache->shards[i].stale_hits;
+        pthread_mutex_unlock(&cache->shards[i].lock);
+    }
+}
+
+// Clean up cache
+void free_lru_cache(LRUCache* cache) {
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        CacheShard* shard = &cache->shards[i];
+        pthread_mutex_lock(&shard->lock);
+
+        CacheNode* current = shard->head;
+        while (current) {
+            CacheNode* next = current->next;
+            free(current);
+            current = next;
+        }
+
+        pthread_mutex_unlock(&shard->lock);
+        pthread_mutex_destroy(&shard->lock);
+    }
     free(cache);
 }
 
 // Print cache contents (for debugging)
 void print_cache_contents(LRUCache* cache) {
-    pthread_mutex_lock(&cache->lock);
-    
-    printf("\nCache Contents (Most Recent First):\n");
-    CacheNode* current = cache->head;
-    while (current) {
-        printf("Path: %s -> SS: %s:%d\n", 
-               current->path, current->ss_ip, current->ss_port);
-        current = current->next;
-    }
-    printf("Cache size: %d/%d\n", cache->size, cache->capacity);
-    
-    pthread_mutex_unlock(&cache->lock);
-}
\ No newline at end of file
+    int size = 0;
+    unsigned long hits = 0;
+    unsigned long misses = 0;
+
+    printf("\nCache Contents (Most Recent First, per shard):\n");
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        CacheShard* shard = &cache->shards[i];
+        pthread_mutex_lock(&shard->lock);
+
+        CacheNode* current = shard->head;
+        while (current) {
+            printf("Path: %s -> SS: %s:%d\n",
+                   current->path, current->ss_ip, current->ss_port);
+            current = current->next;
+        }
+        size += shard->size;
+        hits += shard->hits;
+        misses += shard->misses;
+
+        pthread_mutex_unlock(&shard->lock);
+    }
+    printf("Cache size: %d/%d, hits: %lu, misses: %lu\n", size, cache->capacity, hits, misses);
+}
+
+static long now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+// Initialize the negative cache
+NegativeCache* init_negative_cache(int ttl_ms) {
+    NegativeCache* nc = (NegativeCache*)calloc(1, sizeof(NegativeCache));
+    nc->ttl_ms = ttl_ms;
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        pthread_mutex_init(&nc->locks[i], NULL);
+    }
+    return nc;
+}
+
+// Read before resolving a path, and passed back to neg_cache_put
+unsigned long neg_cache_generation(NegativeCache* nc) {
+    return __atomic_load_n(&nc->generation, __ATOMIC_ACQUIRE);
+}
+
+// Remember that path resolved to nothing. Skipped if an invalidation ran
+// since generation was read, so a concurrent CREATE is never masked.
+void neg_cache_put(NegativeCache* nc, const char* path, unsigned long generation) {
+    unsigned int hash_key = cache_hash(path) | 1; // Never 0, that marks an empty slot
+    unsigned int slot = hash_key % NEG_CACHE_SLOTS;
+    pthread_mutex_t* lock = &nc->locks[slot % CACHE_SHARDS];
+
+    pthread_mutex_lock(lock);
+    if (neg_cache_generation(nc) == generation) {
+        NegativeEntry* entry = &nc->slots[slot];
+        strncpy(entry->path, path, sizeof(entry->path) - 1);
+        entry->path[sizeof(entry->path) - 1] = '\0';
+        entry->hash = hash_key;
+        entry->expires_ms = now_ms() + nc->ttl_ms;
+        __atomic_add_fetch(&nc->inserts, 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(lock);
+}
+
+// Whether path was recently found not to exist
+bool neg_cache_contains(NegativeCache* nc, const char* path) {
+    unsigned int hash_key = cache_hash(path) | 1;
+    unsigned int slot = hash_key % NEG_CACHE_SLOTS;
+    pthread_mutex_t* lock = &nc->locks[slot % CACHE_SHARDS];
+    bool found = false;
+
+    pthread_mutex_lock(lock);
+    NegativeEntry* entry = &nc->slots[slot];
+    if (entry->hash == hash_key && strcmp(entry->path, path) == 0) {
+        if (entry->expires_ms > now_ms()) {
+            found = true;
+            __atomic_add_fetch(&nc->hits, 1, __ATOMIC_RELAXED);
+        } else {
+            entry->hash = 0; // Expired
+        }
+    }
+    pthread_mutex_unlock(lock);
+    return found;
+}
+
+// Forget path and every path below it, returns the number of slots cleared
+int neg_cache_remove_prefix(NegativeCache* nc, const char* prefix) {
+    int removed = 0;
+    __atomic_add_fetch(&nc->generation, 1, __ATOMIC_RELEASE);
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        pthread_mutex_lock(&nc->locks[i]);
+        for (int slot = i; slot < NEG_CACHE_SLOTS; slot += CACHE_SHARDS) {
+            NegativeEntry* entry = &nc->slots[slot];
+            if (entry->hash != 0 && path_under(entry->path, prefix)) {
+                entry->hash = 0;
+                removed++;
+            }
+        }
+        pthread_mutex_unlock(&nc->locks[i]);
+    }
+    return removed;
+}
+
+// Forget everything, used when a storage server brings a new set of paths
+void neg_cache_clear(NegativeCache* nc) {
+    __atomic_add_fetch(&nc->generation, 1, __ATOMIC_RELEASE);
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        pthread_mutex_lock(&nc->locks[i]);
+        for (int slot = i; slot < NEG_CACHE_SLOTS; slot += CACHE_SHARDS) {
+            nc->slots[slot].hash = 0;
+        }
+        pthread_mutex_unlock(&nc->locks[i]);
+    }
+}
+
+void neg_cache_get_stats(NegativeCache* nc, unsigned long* hits, unsigned long* inserts) {
+    *hits = __atomic_load_n(&nc->hits, __ATOMIC_RELAXED);
+    *inserts = __atomic_load_n(&nc->inserts, __ATOMIC_RELAXED);
+}
+
+// Clean up the negative cache
+void free_negative_cache(NegativeCache* nc) {
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        pthread_mutex_destroy(&nc->locks[i]);
+    }
+    free(nc);
+}
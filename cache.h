@@ -3,32 +3,93 @@
 #include <stdio.h>
 #include <pthread.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
 #define CACHE_SIZE 1000  // Maximum number of entries in the cache
+#define CACHE_SHARDS 16  // Independently locked shards, so workers rarely contend
+#define CACHE_BUCKETS 128  // Hash chains per shard
+#define NEG_CACHE_SLOTS 1024  // Direct-mapped slots for paths known not to exist
+#define NEG_CACHE_TTL_MS 2000  // How long a "Path not found" answer is reused
 #define INET_ADDRSTRLEN 16        // Length of the string for IP address- IPv4
 
 typedef struct CacheNode {
     char path[256];              // File/folder path
     char ss_ip[INET_ADDRSTRLEN]; // Storage server IP
     int ss_port;                 // Storage server port
+    int ss_id;                   // Index of the storage server in storage_servers[]
+    unsigned int hash;           // Full hash of path
     struct CacheNode* prev;      // Previous node in DLL
     struct CacheNode* next;      // Next node in DLL
+    struct CacheNode* chain_next; // Next node in the same hash bucket
 } CacheNode;
 
+// One lock-striped slice of the cache with its own LRU order
 typedef struct {
     CacheNode* head;            // Most recently used
     CacheNode* tail;            // Least recently used
     int size;                   // Current number of entries
     int capacity;               // Maximum capacity
     pthread_mutex_t lock;       // Mutex for thread safety
-    CacheNode* hash[CACHE_SIZE]; // Hash table for O(1) lookup
+    CacheNode* hash[CACHE_BUCKETS]; // Chained hash table for O(1) lookup
+    unsigned long hits;         // cache_get calls that found the path
+    unsigned long misses;       // cache_get calls that did not
+    unsigned long invalidations; // Entries dropped because the namespace changed
+    unsigned long stale_hits;   // Hits discarded because their server had left
+} __attribute__((aligned(64))) CacheShard;
+
+// Counters summed over all shards
+typedef struct {
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long invalidations;
+    unsigned long stale_hits;
+} CacheStats;
+
+typedef struct {
+    CacheShard shards[CACHE_SHARDS];
+    int capacity;               // Maximum capacity across all shards
+    unsigned long generation;   // Bumped by every invalidation
 } LRUCache;
 
+// Slot of the negative cache, a newer miss simply overwrites an older one
+typedef struct {
+    char path[256];
+    unsigned int hash;           // 0 marks an empty slot
+    long expires_ms;             // Monotonic time after which the slot is ignored
+} NegativeEntry;
+
+// Bounded cache of paths that resolved to no storage server
+typedef struct {
+    NegativeEntry slots[NEG_CACHE_SLOTS];
+    pthread_mutex_t locks[CACHE_SHARDS]; // Slot i is guarded by locks[i % CACHE_SHARDS]
+    int ttl_ms;
+    unsigned long generation;    // Bumped by every invalidation
+    unsigned long hits;          // Updated atomically, slots are striped over several locks
+    unsigned long inserts;
+} NegativeCache;
+
 LRUCache* init_lru_cache(int capacity);
 unsigned int cache_hash(const char* path);
-void move_to_front(LRUCache* cache, CacheNode* node) ;
-CacheNode* create_node(const char* path, const char* ss_ip, int ss_port);
-void cache_put(LRUCache* cache, const char* path, const char* ss_ip, int ss_port);
-bool cache_get(LRUCache* cache, const char* path, char* ss_ip, int* ss_port);
+void move_to_front(CacheShard* shard, CacheNode* node) ;
+CacheNode* create_node(const char* path, const char* ss_ip, int ss_port, int ss_id);
+unsigned long cache_generation(LRUCache* cache);
+void cache_put(LRUCache* cache, const char* path, const char* ss_ip, int ss_port, int ss_id,
+               unsigned long generation);
+bool cache_get(LRUCache* cache, const char* path, char* ss_ip, int* ss_port, int* ss_id);
+bool cache_remove(LRUCache* cache, const char* path);
+int cache_remove_prefix(LRUCache* cache, const char* prefix);
+int cache_remove_server(LRUCache* cache, int ss_id);
+void cache_drop_stale(LRUCache* cache, const char* path);
+void cache_get_stats(LRUCache* cache, CacheStats* stats);
 void free_lru_cache(LRUCache* cache) ;
-void print_cache_contents(LRUCache* cache);
\ No newline at end of file
+void print_cache_contents(LRUCache* cache);
+
+NegativeCache* init_negative_cache(int ttl_ms);
+unsigned long neg_cache_generation(NegativeCache* nc);
+void neg_cache_put(NegativeCache* nc, const char* path, unsigned long generation);
+bool neg_cache_contains(NegativeCache* nc, const char* path);
+int neg_cache_remove_prefix(NegativeCache* nc, const char* prefix);
+void neg_cache_clear(NegativeCache* nc);
+void neg_cache_get_stats(NegativeCache* nc, unsigned long* hits, unsigned long* inserts);
+void free_negative_cache(NegativeCache* nc);
@@ -89,49 +89,196 @@ int connect_to_storage_server(const char *server_ip, int server_port) {
     return sock;
 }
 
-void handle_read_response(int sock) {
-    char buffer[BUFFER_SIZE];
-    memset(buffer, 0, sizeof(buffer));
+StorageSession storage_sessions[MAX_STORAGE_SESSIONS];
+int storage_sessions_ready = 0;
+
+// Connection to the storage server at ip:port. An open one is reused, otherwise a new
+// one is made and its banner consumed, so the handshake happens once per server.
+int get_storage_session(const char *ip, int port) {
+    StorageSession *slot = NULL;
+    if (!storage_sessions_ready) {
+        for (int i = 0; i < MAX_STORAGE_SESSIONS; i++) {
+            storage_sessions[i].socket = -1;
+        }
+        storage_sessions_ready = 1;
+    }
+
+    for (int i = 0; i < MAX_STORAGE_SESSIONS; i++) {
+        StorageSession *session = &storage_sessions[i];
+        if (session->socket >= 0 && session->port == port && strcmp(session->ip, ip) == 0) {
+            // Nothing should be waiting on an idle connection, anything readable
+            // means the server closed it or a reply was left half read
+            char byte;
+            if (recv(session->socket, &byte, 1, MSG_PEEK | MSG_DONTWAIT) < 0 &&
+                (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                session->last_used = time(NULL);
+                return session->socket;
+            }
+            drop_storage_session(session->socket);
+            slot = session;
+            break;
+        }
+    }
+
+    if (!slot) {
+        // Take a free slot, or close the least recently used connection
+        for (int i = 0; i < MAX_STORAGE_SESSIONS; i++) {
+            StorageSession *session = &storage_sessions[i];
+            if (session->socket < 0) {
+                slot = session;
+                break;
+            }
+            if (!slot || session->last_used < slot->last_used) {
+                slot = session;
+            }
+        }
+        if (slot->socket >= 0) {
+            drop_storage_session(slot->socket);
+        }
+    }
+
+    int sock = connect_to_storage_server(ip, port);
+    if (sock < 0) {
+        return -1;
+    }
+    if (proto_expect_banner(sock) < 0) {
+        printf("socket receive error (ERROR CODE %d)\n",ERR_SOCK_RECEIVE);
+        close(sock);
+        return -1;
+    }
+    snprintf(slot->ip, sizeof(slot->ip), "%s", ip);
+    slot->port = port;
+    slot->socket = sock;
+    slot->last_used = time(NULL);
+    return sock;
+}
+
+// Close a storage server connection that can no longer be reused
+void drop_storage_session(int sock) {
+    for (int i = 0; i < MAX_STORAGE_SESSIONS; i++) {
+        if (storage_sessions[i].socket == sock) {
+            storage_sessions[i].socket = -1;
+        }
+    }
+    close(sock);
+}
+
+void close_storage_sessions() {
+    for (int i = 0; i < MAX_STORAGE_SESSIONS && storage_sessions_ready; i++) {
+        if (storage_sessions[i].socket >= 0) {
+            drop_storage_session(storage_sessions[i].socket);
+        }
+    }
+}
+
+// Receive one OP_RESULT frame into text. Returns its status, or -1 if none arrived.
+int recv_result(int sock, char *text, size_t size, uint8_t *flags) {
+    char payload[REPLY_SIZE];
+    FrameHeader header;
+    int len = proto_recv_frame(sock, &header, payload, sizeof(payload) - 1);
+    if (len < 0 || header.opcode != OP_RESULT) {
+        return -1;
+    }
+    ProtoReader reader;
+    proto_reader_init(&reader, payload, len);
+    int status = proto_get_u16(&reader);
+    proto_get_rest(&reader, text, size);
+    if (flags) {
+        *flags = header.flags;
+    }
+    return reader.error ? -1 : status;
+}
+
+// Receive the naming server's reply to a command. An async write completion that
+// arrives first is printed and skipped, frames make it impossible to mistake for the reply.
+int recv_ns_reply(int sock, FrameHeader *header, char *payload, size_t capacity) {
+    while (1) {
+        int len = proto_recv_frame(sock, header, payload, capacity - 1);
+        if (len < 0 || header->opcode != OP_ASYNC_COMPLETE) {
+            return len;
+        }
+        print_completion(header, payload);
+    }
+}
+
+// Returns -1 if the reply could not be read to its end
+int handle_read_response(int sock) {
+    char buffer[REPLY_SIZE];
+    FrameHeader header;
     int bytes_received;
 
+    // A file arrives as an OP_FILE header and its raw bytes, a directory listing
+    // as OP_DATA frames; OP_END closes the reply
     printf("Storage Server Response:\n");
-    while ((bytes_received = recv(sock, buffer, sizeof(buffer) - 1, 0)) > 0) {
-        buffer[bytes_received] = '\0';
-        printf("%s", buffer);  // Print received data
-        memset(buffer, 0, sizeof(buffer));
+    while ((bytes_received = proto_recv_frame(sock, &header, buffer, sizeof(buffer) - 1)) >= 0) {
+        if (header.opcode == OP_FILE) {
+            ProtoReader reader;
+            proto_reader_init(&reader, buffer, bytes_received);
+            unsigned long long remaining = proto_get_u64(&reader);
+            unsigned long long offset = proto_get_u64(&reader);
+            unsigned long long file_size = proto_get_u64(&reader);
+            if (!reader.error && remaining < file_size) {
+                // READ <path> <offset> <length> asked for part of the file
+                printf("Bytes %llu-%llu of %llu:\n", offset, offset + remaining, file_size);
+            }
+            while (remaining > 0) {
+                size_t chunk = remaining < sizeof(buffer) ? remaining : sizeof(buffer);
+                ssize_t got = recv(sock, buffer, chunk, 0);
+                if (got <= 0) {
+                    bytes_received = -1;
+                    break;
+                }
+                fwrite(buffer, 1, got, stdout);
+                remaining -= got;
+            }
+            if (bytes_received < 0) {
+                break;
+            }
+            continue;
+        }
+        if (header.opcode == OP_END) {
+            ProtoReader reader;
+            proto_reader_init(&reader, buffer, bytes_received);
+            if (proto_get_u16(&reader) != PROTO_STATUS_OK) {
+                char text[BUFFER_SIZE];
+                proto_get_rest(&reader, text, sizeof(text));
+                printf("%s", text);
+            }
+            break;
+        }
+        fwrite(buffer, 1, bytes_received, stdout);  // Print received data
     }
 
     if (bytes_received < 0) {
         perror("Error receiving response");
     }
     printf("\n");
+    return bytes_received < 0 ? -1 : 0;
 }
 
-// Function to receive response for WRITE command
-void handle_write_response(int sock) {
+// Function to receive response for WRITE command. Returns the reply's flags, or -1.
+int handle_write_response(int sock) {
     // printf("hello======\n");
     char buffer[BUFFER_SIZE];
+    uint8_t flags = 0;
     memset(buffer, 0, sizeof(buffer));
 
-    int bytes_received = recv(sock, buffer, sizeof(buffer) - 1, 0);
-    if (bytes_received > 0) {
-        buffer[bytes_received] = '\0';
+    if (recv_result(sock, buffer, sizeof(buffer), &flags) >= 0) {
         printf("Write Response: %s\n", buffer);  // Display success or error message
-    } else if (bytes_received < 0) {
+    } else {
         perror("Error receiving write response");
+        return -1;
     }
-
+    return flags;
 }
 void handle_create_response(int sock) {
     // printf("hello======\n");
     char buffer[BUFFER_SIZE];
     memset(buffer, 0, sizeof(buffer));
 
-    int bytes_received = recv(sock, buffer, sizeof(buffer) - 1, 0);
-    if (bytes_received > 0) {
-        buffer[bytes_received] = '\0';
+    if (recv_result(sock, buffer, sizeof(buffer), NULL) >= 0) {
         printf("CREATE Response: %s\n", buffer);  // Display success or error message
-    } else if (bytes_received < 0) {
+    } else {
         perror("Error receiving write response");
     }
 
@@ -141,41 +288,38 @@ void handle_delete_response(int sock) {
     char buffer[BUFFER_SIZE];
     memset(buffer, 0, sizeof(buffer));
 
-    int bytes_received = recv(sock, buffer, sizeof(buffer) - 1, 0);
-    if (bytes_received > 0) {
-        buffer[bytes_received] = '\0';
+    if (recv_result(sock, buffer, sizeof(buffer), NULL) >= 0) {
         printf("DELETE Response: %s\n", buffer);  // Display success or error message
-    } else if (bytes_received < 0) {
+    } else {
         perror("Error receiving write response");
     }
 
 }
-void handle_append_response(int sock) {
+int handle_append_response(int sock) {
     // printf("hello======\n");
     char buffer[BUFFER_SIZE];
     memset(buffer, 0, sizeof(buffer));
 
-    int bytes_received = recv(sock, buffer, sizeof(buffer) - 1, 0);
-    if (bytes_received > 0) {
-        buffer[bytes_received] = '\0';
+    if (recv_result(sock, buffer, sizeof(buffer), NULL) >= 0) {
         printf("Write Response: %s\n", buffer);  // Display success or error message
-    } else if (bytes_received < 0) {
+    } else {
         perror("Error receiving write response");
+        return -1;
     }
+    return 0;
 }
 
-void handle_info_response(int sock) {
+int handle_info_response(int sock) {
     char buffer[BUFFER_SIZE];
     memset(buffer, 0, sizeof(buffer));
 
-    int bytes_received = recv(sock, buffer, sizeof(buffer) - 1, 0);
-    if (bytes_received > 0) {
-        buffer[bytes_received] = '\0';
+    if (recv_result(sock, buffer, sizeof(buffer), NULL) >= 0) {
         printf("%s\n", buffer);  // Display file information
-    } else if (bytes_received < 0) {
+    } else {
         perror("Error receiving info response");
+        return -1;
     }
-
+    return 0;
 }
 
 int main(int argc, char *argv[]) {
@@ -219,7 +363,7 @@ int main(int argc, char *argv[]) {
     printf("Connected to server at %s:%d\n", server_ip, server_port);
 
     // Send the initial character to the server
-    if (send(client_socket, &c, sizeof(c), 0) < 0) {
+    if (proto_send_frame(client_socket, OP_HELLO, 0, 0, &c, sizeof(c)) < 0) {
         printf("socket send error (ERROR CODE %d)\n",ERR_SOCK_SEND);
         perror("Error sending character");
         close(client_socket);
@@ -229,22 +373,25 @@ int main(int argc, char *argv[]) {
 
     // Receive ACK number
     char ack_buffer[50];
-    memset(ack_buffer, 0, sizeof(ack_buffer));
-    if (recv(client_socket, ack_buffer, sizeof(ack_buffer), 0) < 0) {
+    FrameHeader header;
+    if (proto_recv_frame(client_socket, &header, ack_buffer, sizeof(ack_buffer)) < 0 || header.opcode != OP_ACK) {
         perror("Error receiving ACK");
         close(client_socket);
         return EXIT_FAILURE;
     }
     
-    int ack_number;
-    sscanf(ack_buffer, "ACK:%d", &ack_number);
-    printf("Received acknowledgment number: %d\n", ack_number);
+    ProtoReader reader;
+    proto_reader_init(&reader, ack_buffer, header.length);
+    unsigned long long ack_number = proto_get_u64(&reader);
+    printf("Received acknowledgment number: %llu\n", ack_number);
 
     // Loop to continuously send commands
     char command[BUFFER_SIZE];
     while (1) {
         printf("Enter command (or type 'STOP' to quit): ");
-        fgets(command, sizeof(command), stdin);
+        if (!fgets(command, sizeof(command), stdin)) {
+            break;
+        }
         if(command[0] == '\n'){
             printf("Empty input try again (Error code %d)\n",ERR_INVALID_COMMAND);
             continue;
@@ -260,137 +407,249 @@ int main(int argc, char *argv[]) {
             printf("Exiting...\n");
             break;
         }
+        int durability_flag = take_durability_option(command);
+        if (durability_flag < 0) {
+            printf("Unknown durability, use none, fdatasync or group (ERROR CODE %d)\n", ERR_INVALID_COMMAND);
+            continue;
+        }
+        char upload_command[BUFFER_SIZE + 16];
+        off_t upload_length = 0;
+        int upload_fd = open_upload(command, upload_command, sizeof(upload_command), &upload_length);
+        if (upload_fd == -2) {
+            continue;
+        }
         // Send command to the server
-        if (send(client_socket, command, strlen(command), 0) < 0) {
+        if (proto_send_frame(client_socket, OP_COMMAND, 0, 0, command, strlen(command)) < 0) {
             printf("socket send error (ERROR CODE %d)\n",ERR_SOCK_SEND);
             perror("Error sending command");
             break;
         }
         printf("Command '%s' sent to server\n", command);
-        if (strncmp(command, "CREATE", 6) == 0 || strncmp(command, "DELETE", 6) == 0) {
-            // Expect response directly from the Naming Server
-            char response[BUFFER_SIZE];
-            memset(response, 0, sizeof(response));
-            
-            // if (recv(client_socket, response, sizeof(response), 0) < 0) {
-            //     perror("Error receiving response for CREATE/DELETE");
-            //     break;
-            // }
-            
-            //printf("Response from Naming Server: %s\n", response);
-            sleep(3);
-            printf("Operation successful");
-    
-        }else{
-        char  message_about_ss[BUFFER_SIZE];
-        recv(client_socket, message_about_ss, sizeof(message_about_ss), 0);
-        printf("Received message from server: %s\n", message_about_ss);
-        if (strstr(message_about_ss, "Path not given") != NULL) {
-            printf("Given path is invalid/Path is not given.\n");
+
+        // The naming server either answers itself or says which storage server to ask
+        char reply[REPLY_SIZE];
+        if (recv_ns_reply(client_socket, &header, reply, sizeof(reply)) < 0) {
+            perror("Error receiving response from Naming Server");
+            if (upload_fd >= 0) {
+                close(upload_fd);
+            }
+            break;
+        }
+        if (upload_fd >= 0 && header.opcode != OP_SS_LOCATION) {
+            close(upload_fd);
+            upload_fd = -1;
+        }
+        if (header.opcode == OP_RESULT) {
+            // CREATE, DELETE, COPY, LIST, STATS and errors such as an unknown path
+            ProtoReader result;
+            char text[BUFFER_SIZE];
+            proto_reader_init(&result, reply, header.length);
+            proto_get_u16(&result);
+            proto_get_rest(&result, text, sizeof(text));
+            if (strncmp(command, "CREATE", 6) == 0) {
+                printf("CREATE Response: %s\n", text);
+            } else if (strncmp(command, "DELETE", 6) == 0) {
+                printf("DELETE Response: %s\n", text);
+            } else {
+                printf("%s\n", text);
+            }
+            continue;
+        }
+        if (header.opcode != OP_SS_LOCATION) {
+            printf("INVALID \n");
             continue;
         }
         char server_ip[50];
         int server_port;
-        int res =  parse_storage_server_info(message_about_ss, server_ip, &server_port);
-        if(res == -1){
+        proto_reader_init(&reader, reply, header.length);
+        proto_get_str(&reader, server_ip, sizeof(server_ip));
+        server_port = proto_get_u16(&reader);
+        if (reader.error) {
                 printf("INVALID \n");
+                if (upload_fd >= 0) {
+                    close(upload_fd);
+                }
                 continue;
         }
-        int storage_sock_fd = connect_to_storage_server(server_ip, server_port);
-        char handle_msg[50];
-        recv(storage_sock_fd, handle_msg, sizeof(handle_msg), 0);
-        while(1){
-            if(strncmp(handle_msg, "Handling client request", 24) == 0){
-                break;
+        printf("Received message from server: Storage Server IP: %s, Port: %d\n", server_ip, server_port);
+        // Kept open across commands, the banner is only read when it is first made
+        int storage_sock_fd = get_storage_session(server_ip, server_port);
+        if (storage_sock_fd < 0) {
+            if (upload_fd >= 0) {
+                close(upload_fd);
             }
+            continue;
+        }
+        int reusable = 1;
+        if (upload_fd >= 0) {
+            // Streamed WRITE/APPEND, always answered once the data is on disk
+            reusable = send_upload(storage_sock_fd, header.request_id, durability_flag, upload_command,
+                                   upload_fd, upload_length) == 0 &&
+                       handle_write_response(storage_sock_fd) >= 0;
+            close(upload_fd);
+            if (!reusable) {
+                drop_storage_session(storage_sock_fd);
+            }
+            continue;
         }
-        //printf("Received message from storage server: %s\n", handle_msg);
         //printf("The command is: %s\n", command);
+        // Pass on the naming server's request ID so both servers' logs agree
+        send_to_storage_server(storage_sock_fd, header.request_id, durability_flag, command);
         if(strncmp(command, "STREAM", 6) == 0){
-            send(storage_sock_fd, command, strlen(command), 0);
             char * inst = strtok(command, " ");
             char * filename = strtok(NULL, " ");
             request_audio_stream(storage_sock_fd, filename);
+            reusable = 0;  // Raw audio bytes, the server closes the connection after it
         }
         else if (strncmp(command, "READ", 4) == 0) {
-            send(storage_sock_fd, command, strlen(command), 0);
-            handle_read_response(storage_sock_fd);
+            reusable = handle_read_response(storage_sock_fd) == 0;
             // printf("..\n");
         } else if (strncmp(command, "WRITE", 5) == 0) {
-            // Extract filename and data
-            // printf("here1\n");
-            char buff[BUFFER_SIZE];
-            strcpy(buff,command);
-            char *data = strchr(buff, ' ') + 1;  // Move to the filename part
-            char *filename = data;
-            data = strchr(data, ' ');
-            
-            if (data) {
-                *data = '\0';           // Null-terminate the filename
-                data = data + 1;        // Move to the data part
-            }
-            int fg = 0;
-            // Check if data is provided
-            if (data && strlen(data) > 0) {
-                int sync_flag = 1;
-                int data_size = strlen(data);
-                // printf("%d\n",data_size);
-                if(data_size > ASYNC_THRESHOLD){
-                    fg = 1;
-                }
-            }
-            send(storage_sock_fd, command, strlen(command), 0);
-            handle_write_response(storage_sock_fd);
-            if(fg){
+            // Large writes are accepted at once, the naming server reports when they finish
+            int flags = handle_write_response(storage_sock_fd);
+            reusable = flags >= 0;
+            if (flags >= 0 && (flags & PROTO_FLAG_ASYNC)) {
                 write_completion(client_socket);
             }
             
         } else if (strncmp(command, "INFO", 4) == 0) {
-            send(storage_sock_fd, command, strlen(command), 0);
-            handle_info_response(storage_sock_fd);
+            reusable = handle_info_response(storage_sock_fd) == 0;
         }
         else if (strncmp(command, "APPEND", 6) == 0) {
-            send(storage_sock_fd, command, strlen(command), 0);
-            handle_append_response(storage_sock_fd);
+            reusable = handle_append_response(storage_sock_fd) == 0;
         }
         else{
             printf("Invalid command try again (Error code %d)\n",ERR_INVALID_COMMAND);
+            reusable = 0;  // Its reply is never read
         }
-        // Check if the command is CREATE or DELETE
         
-        close(storage_sock_fd);
-    }
+        if (!reusable) {
+            drop_storage_session(storage_sock_fd);
+        }
     }
     // Close the socket
+    close_storage_sessions();
     close(client_socket);
     return 0;
 }
 
+// WRITE/APPEND <path> --DURABILITY <none|fdatasync|group> ... asks the storage server to
+// sync the data that far before it answers. Removes the option from command and returns
+// the frame flag for it, 0 when there is none, -1 when the mode is unknown.
+int take_durability_option(char *command) {
+    if (strncmp(command, "WRITE ", 6) != 0 && strncmp(command, "APPEND ", 7) != 0) {
+        return 0;
+    }
+    char *option = strchr(strchr(command, ' ') + 1, ' ');
+    if (!option || strncmp(option, " --DURABILITY ", 14) != 0) {
+        return 0;
+    }
+    char *mode = option + 14;
+    size_t mode_len = strcspn(mode, " ");
+    int flag;
+    if (mode_len == 4 && strncmp(mode, "none", 4) == 0) {
+        flag = PROTO_FLAG_NO_SYNC;
+    } else if (mode_len == 9 && strncmp(mode, "fdatasync", 9) == 0) {
+        flag = PROTO_FLAG_FDATASYNC;
+    } else if (mode_len == 5 && strncmp(mode, "group", 5) == 0) {
+        flag = PROTO_FLAG_GROUP_COMMIT;
+    } else {
+        return -1;
+    }
+    // Keep the space in front of whatever followed the mode
+    memmove(option, mode + mode_len, strlen(mode + mode_len) + 1);
+    return flag;
+}
+
+// WRITE/APPEND <path> --FILE <localfile> streams a local file instead of inline data.
+// Opens it and fills upload_command with "<WRITE|APPEND> <path>". Returns the descriptor,
+// -1 when the command is not an upload, -2 when the local file cannot be used.
+int open_upload(const char *command, char *upload_command, size_t size, off_t *length) {
+    char inst[16], path[BUFFER_SIZE], option[16], local[BUFFER_SIZE];
+    if ((strncmp(command, "WRITE", 5) != 0 && strncmp(command, "APPEND", 6) != 0) ||
+        sscanf(command, "%15s %4095s %15s %4095s", inst, path, option, local) != 4 ||
+        strcmp(option, "--FILE") != 0) {
+        return -1;
+    }
 
-int parse_storage_server_info(const char *input, char *ss_ip, int *ss_port) {
-    // Parse the input string using sscanf to extract the IP and port
-    int result = sscanf(input, "Storage Server IP: %[^,], Port: %d", ss_ip, ss_port);
-    
-    // Check if parsing was successful (result should be 2)
-    if (result != 2) {
-        fprintf(stderr, "Error: Failed to parse storage server info\n");
+    int fd = open(local, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        printf("Cannot upload %s (ERROR CODE %d)\n", local, ERR_OPENING);
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -2;
+    }
+    snprintf(upload_command, size, "%s %s", inst, path);
+    *length = st.st_size;
+    return fd;
+}
+
+// Send an OP_UPLOAD header followed by the file's bytes, straight from the page cache
+int send_upload(int sock, unsigned long long request_id, uint8_t flags, const char *upload_command,
+                int fd, off_t length) {
+    char header[BUFFER_SIZE + 16];
+    ProtoWriter writer;
+    proto_writer_init(&writer, header, sizeof(header));
+    proto_put_str(&writer, upload_command);
+    proto_put_u64(&writer, length);
+    if (proto_send_frame(sock, OP_UPLOAD, flags, request_id, writer.data, writer.len) < 0) {
+        printf("socket send error (ERROR CODE %d)\n",ERR_SOCK_SEND);
+        perror("Error sending upload");
         return -1;
     }
+
+    off_t offset = 0;
+    while (offset < length) {
+        ssize_t sent = sendfile(sock, fd, &offset, length - offset);
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent <= 0) {
+            // The server expects exactly length bytes, this connection is done for
+            printf("socket send error (ERROR CODE %d)\n",ERR_SOCK_SEND);
+            perror("Error sending file data");
+            return -1;
+        }
+    }
     return 0;
 }
 
+void send_to_storage_server(int sock, unsigned long long request_id, uint8_t flags, const char *command) {
+    if (proto_send_frame(sock, OP_COMMAND, flags, request_id, command, strlen(command)) < 0) {
+        printf("socket send error (ERROR CODE %d)\n",ERR_SOCK_SEND);
+        perror("Error sending command to storage server");
+    }
+}
+
+void print_completion(const FrameHeader *header, const char *payload) {
+    ProtoReader reader;
+    char filename[256];
+    char result[BUFFER_SIZE];
+    proto_reader_init(&reader, payload, header->length);
+    int status = proto_get_u16(&reader);
+    proto_get_str(&reader, filename, sizeof(filename));
+    proto_get_rest(&reader, result, sizeof(result));
+    if (status == PROTO_STATUS_OK) {
+        printf("Async Completion Message: Async write completed for file: %s\n", filename);
+    } else {
+        printf("Async Completion Message: Async write failed for file: %s (ERROR CODE %d) %s\n", filename, status, result);
+    }
+}
+
 void write_completion(int sock) {
-    char completion_buffer[BUFFER_SIZE];
+    char completion_buffer[REPLY_SIZE];
+    FrameHeader header;
     memset(completion_buffer, 0, sizeof(completion_buffer));
-    int bytes_received = recv(sock, completion_buffer, sizeof(completion_buffer) - 1, 0);
+    int bytes_received = proto_recv_frame(sock, &header, completion_buffer, sizeof(completion_buffer) - 1);
     // printf("buffr %s\n",completion_buffer);
-    if (bytes_received > 0) {
-        completion_buffer[bytes_received] = '\0';
-        printf("Async Completion Message: %s\n", completion_buffer);
+    if (bytes_received >= 0 && header.opcode == OP_ASYNC_COMPLETE) {
+        print_completion(&header, completion_buffer);
     } else if (bytes_received < 0) {
         perror("Error receiving async completion response");
     } else {
         printf("No completion message received.\n");
     }
     // memset(completion_buffer, 0, sizeof(completion_buffer));
-}
\ No newline at end of file
+}
@@ -9,12 +9,37 @@
 #include <arpa/inet.h>
 #include <signal.h>
 #include <sys/wait.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include "protocol.h"
 
 #define BUFFER_SIZE 4096
+#define REPLY_SIZE (BUFFER_SIZE + 16)  // A full buffer of text plus the reply's status field
+#define MAX_STORAGE_SESSIONS 8  // Storage server connections kept open between commands
+
+// Open connection to a storage server, reused by later commands for the same server
+typedef struct {
+    char ip[INET_ADDRSTRLEN];
+    int port;
+    int socket;                 // -1 when the slot is free
+    time_t last_used;
+} StorageSession;
 
-int parse_storage_server_info(const char *input, char *ss_ip, int *ss_port);
 // Structure for audio player callback
 typedef void (*audio_callback)(const unsigned char* data, long size);
 int request_audio_stream(int sock, const char* filename);
 void write_completion(int sock) ;
+void print_completion(const FrameHeader *header, const char *payload);
+void send_to_storage_server(int sock, unsigned long long request_id, uint8_t flags, const char *command);
+int recv_result(int sock, char *text, size_t size, uint8_t *flags);
+int recv_ns_reply(int sock, FrameHeader *header, char *payload, size_t capacity);
+int take_durability_option(char *command);
+int open_upload(const char *command, char *upload_command, size_t size, off_t *length);
+int send_upload(int sock, unsigned long long request_id, uint8_t flags, const char *upload_command,
+                int fd, off_t length);
+int get_storage_session(const char *ip, int port);
+void drop_storage_session(int sock);
+void close_storage_sessions();
 #endif
\ No newline at end of file
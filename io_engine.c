@@ -0,0 +1,410 @@
+#include "io_engine.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#ifdef SS_IO_URING
+#include <linux/io_uring.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#endif
+
+static int write_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t written = write(fd, data, len);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written < 0) {
+            return -1;
+        }
+        data += written;
+        len -= written;
+    }
+    return 0;
+}
+
+static int plain_send_file(int sock, int fd, off_t offset, off_t length) {
+    off_t end = offset + length;
+    while (offset < end) {
+        ssize_t sent = sendfile(sock, fd, &offset, end - offset);
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent < 0) {
+            return -1;
+        }
+        if (sent == 0) {
+            // The file shrank after its size was taken
+            errno = ENODATA;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int plain_recv_file(int sock, int fd, unsigned long long remaining, int *write_error) {
+    char chunk[IO_ENGINE_BUFFER_SIZE];
+    while (remaining > 0) {
+        ssize_t got = recv(sock, chunk, remaining < sizeof(chunk) ? remaining : sizeof(chunk), 0);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            return -1;
+        }
+        remaining -= got;
+        if (fd >= 0 && write_all(fd, chunk, got) < 0) {
+            *write_error = errno;
+            fd = -1;
+        }
+    }
+    return 0;
+}
+
+#ifdef SS_IO_URING
+// One ring per thread, so no locking is needed around submission and completion
+typedef struct {
+    int fd;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *rings;                 // SQ and CQ rings share one mapping
+    size_t rings_size;
+    size_t sqes_size;
+    char *buffers;               // IO_ENGINE_BATCH chunks of IO_ENGINE_BUFFER_SIZE bytes
+    bool registered;             // The chunks are registered, fixed reads and writes can be used
+    unsigned queued;             // SQEs prepared since the last submit
+} IoRing;
+
+static pthread_once_t ring_once = PTHREAD_ONCE_INIT;
+static pthread_key_t ring_key;
+static volatile int ring_unavailable;  // Setup failed, every thread uses the default engine
+
+static void free_ring(void *arg) {
+    IoRing *ring = arg;
+    close(ring->fd);  // Also drops the buffer registration
+    if (ring->sqes != MAP_FAILED) {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+    if (ring->rings != MAP_FAILED) {
+        munmap(ring->rings, ring->rings_size);
+    }
+    free(ring->buffers);
+    free(ring);
+}
+
+static void create_ring_key(void) {
+    pthread_key_create(&ring_key, free_ring);
+}
+
+static IoRing *setup_ring(void) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = syscall(__NR_io_uring_setup, 2 * IO_ENGINE_BATCH, &params);
+    if (fd < 0) {
+        return NULL;
+    }
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        close(fd);
+        errno = ENOSYS;
+        return NULL;
+    }
+
+    IoRing *ring = calloc(1, sizeof(IoRing));
+    if (!ring) {
+        close(fd);
+        return NULL;
+    }
+    ring->fd = fd;
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->rings_size = sq_size > cq_size ? sq_size : cq_size;
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->rings = mmap(NULL, ring->rings_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       fd, IORING_OFF_SQ_RING);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      fd, IORING_OFF_SQES);
+    ring->buffers = aligned_alloc(4096, IO_ENGINE_BATCH * IO_ENGINE_BUFFER_SIZE);
+    if (ring->rings == MAP_FAILED || ring->sqes == MAP_FAILED || !ring->buffers) {
+        free_ring(ring);
+        return NULL;
+    }
+
+    char *base = ring->rings;
+    ring->sq_tail = (unsigned *)(base + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)(base + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(base + params.sq_off.array);
+    ring->cq_head = (unsigned *)(base + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(base + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)(base + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(base + params.cq_off.cqes);
+
+    // Pinning the chunks can exceed RLIMIT_MEMLOCK, unregistered ones still work
+    struct iovec iov[IO_ENGINE_BATCH];
+    for (int i = 0; i < IO_ENGINE_BATCH; i++) {
+        iov[i].iov_base = ring->buffers + (size_t)i * IO_ENGINE_BUFFER_SIZE;
+        iov[i].iov_len = IO_ENGINE_BUFFER_SIZE;
+    }
+    ring->registered = syscall(__NR_io_uring_register, fd, IORING_REGISTER_BUFFERS,
+                               iov, IO_ENGINE_BATCH) == 0;
+    return ring;
+}
+
+// The calling thread's ring, created on first use. NULL means use the default engine.
+static IoRing *get_ring(void) {
+    if (ring_unavailable) {
+        return NULL;
+    }
+    pthread_once(&ring_once, create_ring_key);
+    IoRing *ring = pthread_getspecific(ring_key);
+    if (!ring) {
+        ring = setup_ring();
+        if (!ring) {
+            perror("io_uring setup failed, using the default file I/O engine");
+            ring_unavailable = 1;
+            return NULL;
+        }
+        pthread_setspecific(ring_key, ring);
+    }
+    return ring;
+}
+
+static char *chunk_buffer(IoRing *ring, int slot) {
+    return ring->buffers + (size_t)slot * IO_ENGINE_BUFFER_SIZE;
+}
+
+// Every SQE is linked to the next one, ring_submit() ends the chain at the last
+static struct io_uring_sqe *next_sqe(IoRing *ring) {
+    unsigned index = (*ring->sq_tail + ring->queued) & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->flags = IOSQE_IO_LINK;
+    sqe->user_data = ring->queued++;
+    ring->sq_array[index] = index;
+    return sqe;
+}
+
+static void queue_file_io(IoRing *ring, bool write, int fd, int slot, unsigned len, off_t offset) {
+    struct io_uring_sqe *sqe = next_sqe(ring);
+    if (ring->registered) {
+        sqe->opcode = write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+        sqe->buf_index = slot;
+    } else {
+        sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+    }
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t)chunk_buffer(ring, slot);
+    sqe->len = len;
+    sqe->off = offset;
+}
+
+static void queue_socket_io(IoRing *ring, bool send, int sock, int slot, unsigned len) {
+    struct io_uring_sqe *sqe = next_sqe(ring);
+    sqe->opcode = send ? IORING_OP_SEND : IORING_OP_RECV;
+    sqe->fd = sock;
+    sqe->addr = (uintptr_t)chunk_buffer(ring, slot);
+    sqe->len = len;
+    // WAITALL makes the kernel retry partial transfers instead of ending the chain
+    sqe->msg_flags = MSG_WAITALL | (send ? MSG_NOSIGNAL : 0);
+}
+
+// Submit the queued SQEs with one system call, wait for all of them and store each
+// result by its queue position. A failed or short step cancels the rest of its chain.
+static int ring_submit(IoRing *ring, int *results) {
+    unsigned count = ring->queued;
+    unsigned tail = *ring->sq_tail;
+    ring->sqes[(tail + count - 1) & *ring->sq_mask].flags &= ~IOSQE_IO_LINK;
+    __atomic_store_n(ring->sq_tail, tail + count, __ATOMIC_RELEASE);
+    ring->queued = 0;
+
+    unsigned submitted = 0;
+    unsigned completed = 0;
+    while (completed < count) {
+        int ret = syscall(__NR_io_uring_enter, ring->fd, count - submitted, count - completed,
+                          IORING_ENTER_GETEVENTS, NULL, 0);
+        if (ret < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            return -1;
+        }
+        if (ret > 0) {
+            submitted += ret;
+        }
+        unsigned head = *ring->cq_head;
+        unsigned ready = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != ready; head++, completed++) {
+            struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+            results[cqe->user_data] = cqe->res;
+        }
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    }
+    return 0;
+}
+
+// Each chunk is a read into a buffer linked to a send from it
+static int ring_send_file(IoRing *ring, int sock, int fd, off_t offset, off_t length) {
+    int results[2 * IO_ENGINE_BATCH];
+    unsigned lengths[IO_ENGINE_BATCH];
+    off_t end = offset + length;
+
+    while (offset < end) {
+        int chunks = 0;
+        for (off_t pos = offset; chunks < IO_ENGINE_BATCH && pos < end; chunks++) {
+            lengths[chunks] = end - pos < IO_ENGINE_BUFFER_SIZE ? end - pos : IO_ENGINE_BUFFER_SIZE;
+            queue_file_io(ring, false, fd, chunks, lengths[chunks], pos);
+            queue_socket_io(ring, true, sock, chunks, lengths[chunks]);
+            pos += lengths[chunks];
+        }
+        if (ring_submit(ring, results) < 0) {
+            return -1;
+        }
+
+        // Finish the chunk where the chain stopped by hand, the next batch resumes after it
+        for (int i = 0; i < chunks; i++) {
+            int got = results[2 * i];
+            int sent = results[2 * i + 1];
+            if (got == -ECANCELED) {
+                break;
+            }
+            if (got <= 0) {
+                errno = got < 0 ? -got : ENODATA;
+                return -1;
+            }
+            if (sent < 0 && sent != -ECANCELED) {
+                errno = -sent;
+                return -1;
+            }
+            int done = sent > 0 ? sent : 0;
+            for (char *data = chunk_buffer(ring, i); done < got; ) {
+                ssize_t n = send(sock, data + done, got - done, MSG_NOSIGNAL);
+                if (n < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (n < 0) {
+                    return -1;
+                }
+                done += n;
+            }
+            offset += got;
+            if ((unsigned)got < lengths[i] || sent != got) {
+                break;
+            }
+        }
+    }
+    return 0;
+}
+
+// Each chunk is a receive into a buffer linked to a write from it
+static int ring_recv_file(IoRing *ring, int sock, int fd, unsigned long long remaining,
+                          int *write_error) {
+    int results[2 * IO_ENGINE_BATCH];
+    unsigned lengths[IO_ENGINE_BATCH];
+    off_t offset = 0;
+
+    while (remaining > 0) {
+        int chunks = 0;
+        off_t pos = offset;
+        for (unsigned long long left = remaining; chunks < IO_ENGINE_BATCH && left > 0; chunks++) {
+            lengths[chunks] = left < IO_ENGINE_BUFFER_SIZE ? left : IO_ENGINE_BUFFER_SIZE;
+            queue_socket_io(ring, false, sock, chunks, lengths[chunks]);
+            queue_file_io(ring, true, fd, chunks, lengths[chunks], pos);
+            pos += lengths[chunks];
+            left -= lengths[chunks];
+        }
+        if (ring_submit(ring, results) < 0) {
+            return -1;
+        }
+
+        for (int i = 0; i < chunks; i++) {
+            int got = results[2 * i];
+            int written = results[2 * i + 1];
+            if (got == -ECANCELED) {
+                break;
+            }
+            if (got <= 0) {
+                errno = got < 0 ? -got : ECONNRESET;
+                return -1;
+            }
+            remaining -= got;
+            if (written < 0 && written != -ECANCELED) {
+                *write_error = -written;
+                return plain_recv_file(sock, -1, remaining, write_error);
+            }
+            int done = written > 0 ? written : 0;
+            while (done < got) {
+                ssize_t n = pwrite(fd, chunk_buffer(ring, i) + done, got - done, offset + done);
+                if (n < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (n < 0) {
+                    *write_error = errno;
+                    return plain_recv_file(sock, -1, remaining, write_error);
+                }
+                done += n;
+            }
+            offset += got;
+            if ((unsigned)got < lengths[i] || written != got) {
+                break;
+            }
+        }
+    }
+    return 0;
+}
+#endif
+
+// Check once at startup whether the configured engine can be used
+void io_engine_init(void) {
+#ifdef SS_IO_URING
+    IoRing *ring = setup_ring();
+    if (!ring) {
+        perror("io_uring setup failed, using the default file I/O engine");
+        ring_unavailable = 1;
+    } else {
+        if (!ring->registered) {
+            printf("io_uring buffers could not be registered, using unregistered buffers\n");
+        }
+        free_ring(ring);
+    }
+#endif
+    printf("File I/O engine: %s\n", io_engine_name());
+}
+
+const char *io_engine_name(void) {
+#ifdef SS_IO_URING
+    if (!ring_unavailable) {
+        return "io_uring";
+    }
+#endif
+    return "sendfile";
+}
+
+int io_engine_send_file(int sock, int fd, off_t offset, off_t length) {
+#ifdef SS_IO_URING
+    IoRing *ring = get_ring();
+    if (ring) {
+        return ring_send_file(ring, sock, fd, offset, length);
+    }
+#endif
+    return plain_send_file(sock, fd, offset, length);
+}
+
+int io_engine_recv_file(int sock, int fd, unsigned long long length, int *write_error) {
+    *write_error = 0;
+#ifdef SS_IO_URING
+    IoRing *ring = fd >= 0 ? get_ring() : NULL;
+    if (ring) {
+        return ring_recv_file(ring, sock, fd, length, write_error);
+    }
+#endif
+    return plain_recv_file(sock, fd, length, write_error);
+}
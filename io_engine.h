@@ -0,0 +1,28 @@
+#ifndef IO_ENGINE_H
+#define IO_ENGINE_H
+#include <stdbool.h>
+#include <sys/types.h>
+
+// Moves file contents between a file and a socket for the storage server.
+// The default engine uses sendfile() and read/write calls. Built with -DSS_IO_URING
+// it drives an io_uring per thread instead: each chunk is a read linked to a send
+// (or a receive linked to a write) through a registered buffer, and up to
+// IO_ENGINE_BATCH chunks go to the kernel with one system call. If the kernel
+// refuses io_uring the default engine is used.
+#define IO_ENGINE_BATCH 8              // Chunks submitted together
+#define IO_ENGINE_BUFFER_SIZE 65536    // Bytes per chunk, one registered buffer each
+
+void io_engine_init(void);
+const char *io_engine_name(void);
+
+// Send length bytes of fd starting at offset. Returns -1 with errno set if the
+// connection failed or the file ended early.
+int io_engine_send_file(int sock, int fd, off_t offset, off_t length);
+
+// Receive exactly length bytes and write them to fd from its start (or its end if it was
+// opened with O_APPEND). With fd -1, or after a write fails, the rest is received and
+// dropped so the connection stays usable, and *write_error holds the write's errno.
+// Returns -1 if the connection failed.
+int io_engine_recv_file(int sock, int fd, unsigned long long length, int *write_error);
+
+#endif
@@ -1,10 +1,16 @@
 #include "naming_server.h"
 #include "cache.h"
+#include "trie.h"
 // #include "storage_server.h"
 
 // Global cache instance
 LRUCache *cache;
+NegativeCache *negative_cache;
 SSConnectionManager ss_manager;
+StorageServer storage_servers[MAX_STORAGE_SERVERS];
+int server_count = 0;
+// Registrations run on pool workers, this keeps two from claiming the same slot
+pthread_mutex_t registration_lock = PTHREAD_MUTEX_INITIALIZER;
 
 // Initialize the SS connection manager
 void init_ss_connection_manager()
@@ -14,10 +20,15 @@ void init_ss_connection_manager()
     for (int i = 0; i < MAX_SS_CONNECTIONS; i++)
     {
         ss_manager.connections[i].is_active = false;
+        ss_manager.connections[i].generation = 0;
+        ss_manager.connections[i].pending = NULL;
+        ss_manager.connections[i].pending_ops = 0;
+        pthread_mutex_init(&ss_manager.connections[i].op_lock, NULL);
+        pthread_mutex_init(&ss_manager.connections[i].send_lock, NULL);
     }
 }
 // Add a new SS connection
-int add_ss_connection(int socket, const char *ip, int port, int client_port)
+int add_ss_connection(int socket, const char *ip, int port, int client_port, int ss_id, bool framed)
 {
     pthread_mutex_lock(&ss_manager.lock);
 
@@ -33,10 +44,16 @@ int add_ss_connection(int socket, const char *ip, int port, int client_port)
 
     if (index != -1)
     {
+        // Senders check the generation under send_lock before writing to the socket
+        pthread_mutex_lock(&ss_manager.connections[index].send_lock);
         ss_manager.connections[index].socket = socket;
+        ss_manager.connections[index].generation++;
+        pthread_mutex_unlock(&ss_manager.connections[index].send_lock);
         strncpy(ss_manager.connections[index].ip_address, ip, INET_ADDRSTRLEN);
         ss_manager.connections[index].port = port;
         ss_manager.connections[index].client_port = client_port;
+        ss_manager.connections[index].ss_id = ss_id;
+        ss_manager.connections[index].framed = framed;
         ss_manager.connections[index].is_active = true;
         ss_manager.count++;
     }
@@ -45,19 +62,69 @@ int add_ss_connection(int socket, const char *ip, int port, int client_port)
     return index;
 }
 
-// Remove an SS connection
+// Fail every command still waiting on a connection that went away
+static void fail_pending_ss_ops(SSConnection *conn)
+{
+    pthread_mutex_lock(&conn->op_lock);
+    for (PendingSSOp *op = conn->pending; op; op = op->next)
+    {
+        op->status = ERR_SOCK_RECEIVE;
+        strcpy(op->response, "Storage server disconnected");
+        op->done = true;
+        pthread_cond_signal(&op->cond);
+    }
+    conn->pending = NULL;
+    conn->pending_ops = 0;
+    pthread_mutex_unlock(&conn->op_lock);
+}
+
+// Remove an SS connection; lookups stop resolving to the server and its cache entries are dropped
 void remove_ss_connection(int index)
 {
+    int ss_id = -1;
     pthread_mutex_lock(&ss_manager.lock);
 
     if (index >= 0 && index < MAX_SS_CONNECTIONS && ss_manager.connections[index].is_active)
     {
-        close(ss_manager.connections[index].socket);
-        ss_manager.connections[index].is_active = false;
+        SSConnection *conn = &ss_manager.connections[index];
+        pthread_mutex_lock(&conn->send_lock);
+        close(conn->socket);
+        conn->is_active = false;
+        pthread_mutex_unlock(&conn->send_lock);
+        fail_pending_ss_ops(conn);
         ss_manager.count--;
+        ss_id = conn->ss_id;
     }
 
     pthread_mutex_unlock(&ss_manager.lock);
+
+    if (ss_id >= 0)
+    {
+        storage_servers[ss_id].is_active = false;
+        int dropped = cache_remove_server(cache, ss_id);
+        printf("Storage server %d disconnected, invalidated %d cache entries\n", ss_id, dropped);
+    }
+}
+
+// Hand a result to the worker waiting for request_id, if it is still waiting
+static void complete_ss_op(SSConnection *conn, unsigned long long request_id, int status, const char *text)
+{
+    pthread_mutex_lock(&conn->op_lock);
+    for (PendingSSOp **p = &conn->pending; *p; p = &(*p)->next)
+    {
+        if ((*p)->request_id == request_id)
+        {
+            PendingSSOp *op = *p;
+            *p = op->next;
+            conn->pending_ops--;
+            op->status = status;
+            snprintf(op->response, sizeof(op->response), "%s", text);
+            op->done = true;
+            pthread_cond_signal(&op->cond);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&conn->op_lock);
 }
 
 // Thread function to handle individual SS connection
@@ -68,408 +135,1173 @@ void *handle_ss_connection(void *arg)
 
     SSConnection *conn = &ss_manager.connections[index];
     char buffer[BUFFER_SIZE];
+    FrameHeader header;
+
+    // The storage server keeps this socket open for as long as it runs,
+    // so end of stream means it has gone away
+    if (!conn->framed)
+    {
+        while (recv(conn->socket, buffer, sizeof(buffer), 0) > 0)
+        {
+        }
+        remove_ss_connection(index);
+        return NULL;
+    }
+
+    // Framed servers also answer forwarded commands on it, in any order
+    while (1)
+    {
+        int length = proto_recv_frame(conn->socket, &header, buffer, BUFFER_SIZE - 1);
+        if (length < 0 && errno == EMSGSIZE)
+        {
+            complete_ss_op(conn, header.request_id, ERR_SOCK_RECEIVE, "Result too long");
+            continue;
+        }
+        if (length < 0)
+        {
+            break;
+        }
+        if (header.opcode == OP_ASYNC_ACCEPTED)
+        {
+            confirm_async_write(header.request_id);
+            continue;
+        }
+        if (header.opcode != OP_RESULT || header.request_id == 0)
+        {
+            continue;
+        }
+
+        ProtoReader reader;
+        char text[BUFFER_SIZE];
+        proto_reader_init(&reader, buffer, length);
+        int status = proto_get_u16(&reader);
+        proto_get_rest(&reader, text, sizeof(text));
+        complete_ss_op(conn, header.request_id, reader.error ? PROTO_STATUS_FAILED : status, text);
+    }
+
+    remove_ss_connection(index);
     return NULL;
 }
 
-// Initialize the LRU cache
-LRUCache *init_lru_cache(int capacity)
+// Forward a command to a storage server over its persistent connection. Any number
+// of workers can have commands outstanding on it, each result is matched back by
+// request ID. Returns the storage server's status, or -1 when the server has no
+// framed connection and the caller has to dial it.
+int send_ss_command(int ss_id, const char *message, unsigned long long request_id, char *response,
+                    size_t size)
 {
-    LRUCache *cache = (LRUCache *)malloc(sizeof(LRUCache));
-    cache->capacity = capacity;
-    cache->size = 0;
-    cache->head = NULL;
-    cache->tail = NULL;
+    PendingSSOp op;
+    SSConnection *conn = NULL;
+    unsigned long generation = 0;
 
-    // Initialize hash table
-    memset(cache->hash, 0, sizeof(CacheNode *) * CACHE_SIZE);
+    op.request_id = request_id;
+    op.done = false;
+    op.status = PROTO_STATUS_FAILED;
+    op.response[0] = '\0';
+    pthread_cond_init(&op.cond, NULL);
 
-    // Initialize mutex
-    pthread_mutex_init(&cache->lock, NULL);
+    // Registered under the manager lock so a disconnect either fails it or never sees the slot
+    pthread_mutex_lock(&ss_manager.lock);
+    for (int i = 0; i < MAX_SS_CONNECTIONS; i++)
+    {
+        SSConnection *candidate = &ss_manager.connections[i];
+        if (candidate->is_active && candidate->framed && candidate->ss_id == ss_id)
+        {
+            conn = candidate;
+            generation = conn->generation;
+            pthread_mutex_lock(&conn->op_lock);
+            op.next = conn->pending;
+            conn->pending = &op;
+            conn->pending_ops++;
+            pthread_mutex_unlock(&conn->op_lock);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&ss_manager.lock);
+    if (!conn)
+    {
+        pthread_cond_destroy(&op.cond);
+        return -1;
+    }
 
-    return cache;
+    int sent = -1;
+    pthread_mutex_lock(&conn->send_lock);
+    if (conn->is_active && conn->generation == generation)
+    {
+        sent = proto_send_frame(conn->socket, OP_COMMAND, 0, request_id, message, strlen(message));
+    }
+    pthread_mutex_unlock(&conn->send_lock);
+    if (sent < 0)
+    {
+        printf("socket send error (ERROR CODE %d)\n",ERR_SOCK_SEND);
+    }
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += SS_OP_TIMEOUT_MS / 1000;
+    deadline.tv_nsec += (SS_OP_TIMEOUT_MS % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L)
+    {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&conn->op_lock);
+    while (!op.done && sent >= 0)
+    {
+        if (pthread_cond_timedwait(&op.cond, &conn->op_lock, &deadline) == ETIMEDOUT)
+        {
+            break;
+        }
+    }
+    if (!op.done)
+    {
+        // Not answered, take it off the list before the stack frame goes away
+        for (PendingSSOp **p = &conn->pending; *p; p = &(*p)->next)
+        {
+            if (*p == &op)
+            {
+                *p = op.next;
+                conn->pending_ops--;
+                break;
+            }
+        }
+        op.status = sent < 0 ? ERR_SOCK_SEND : ERR_SOCK_RECEIVE;
+        strcpy(op.response, sent < 0 ? "Failed to send to storage server" : "Storage server did not answer");
+    }
+    pthread_mutex_unlock(&conn->op_lock);
+    pthread_cond_destroy(&op.cond);
+
+    snprintf(response, size, "%s", op.response);
+    return op.status;
 }
 
-// Hash function for paths
-unsigned int cache_hash(const char *path)
+// Append every framed storage server's own counters (its async write executor) to a STATS report
+void format_storage_server_stats(char *report, size_t size, unsigned long long request_id)
 {
-    unsigned int hash = 0;
-    while (*path)
+    int ss_ids[MAX_SS_CONNECTIONS];
+    char addresses[MAX_SS_CONNECTIONS][INET_ADDRSTRLEN + 8];
+    int count = 0;
+
+    pthread_mutex_lock(&ss_manager.lock);
+    for (int i = 0; i < MAX_SS_CONNECTIONS; i++)
     {
-        hash = (hash * 31) + *path++;
+        SSConnection *conn = &ss_manager.connections[i];
+        if (conn->is_active && conn->framed)
+        {
+            ss_ids[count] = conn->ss_id;
+            snprintf(addresses[count], sizeof(addresses[count]), "%s:%d", conn->ip_address, conn->client_port);
+            count++;
+        }
+    }
+    pthread_mutex_unlock(&ss_manager.lock);
+
+    for (int i = 0; i < count; i++)
+    {
+        char stats[BUFFER_SIZE];
+        size_t len = strlen(report);
+        if (send_ss_command(ss_ids[i], "STATS", request_id, stats, sizeof(stats)) != PROTO_STATUS_OK)
+        {
+            strcpy(stats, "unavailable");
+        }
+        snprintf(report + len, size - len, "\nStorage server %s\n%s", addresses[i], stats);
+    }
+}
+
+// Whether ss_id registered over the framed protocol. Such storage servers confirm each
+// async write they queue on their connection, text ones never do.
+bool ss_confirms_async_writes(int ss_id)
+{
+    bool framed = false;
+    pthread_mutex_lock(&ss_manager.lock);
+    for (int i = 0; i < MAX_SS_CONNECTIONS; i++)
+    {
+        SSConnection *conn = &ss_manager.connections[i];
+        if (conn->is_active && conn->framed && conn->ss_id == ss_id)
+        {
+            framed = true;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&ss_manager.lock);
+    return framed;
+}
+
+// Send a COPY, CREATE or DELETE to the storage server at location.
+// Returns 1 on success, 0 on failure.
+int forward_to_ss(const SSLocation *location, char *message, unsigned long long request_id)
+{
+    char response[BUFFER_SIZE];
+    int status = send_ss_command(location->ss_id, message, request_id, response, sizeof(response));
+    if (status == -1)
+    {
+        // Registered over text, it only takes commands on its client port
+        return connect_and_send_to_ss((char *)location->ip_address, location->client_port, message, request_id);
+    }
+    printf("Response from SS: %s\n", response);
+    return status == PROTO_STATUS_OK;
+}
+
+// #define TABLE_SIZE 101  // Prime number for better distribution
+// #define MAX_PATHS 256   // Example maximum paths
+
+// typedef struct {
+//     char path[256];      // File or folder path name
+//     bool is_occupied;    // Flag to indicate if slot is occupied
+//     bool is_deleted;     // Flag to indicate if slot is a tombstone
+// } HashEntry;
+
+// typedef struct {
+//     char ip_address[INET_ADDRSTRLEN];  // Storage server's IP address
+//     int port;                          // Storage server's port for NM connection
+//     int client_port;                   // Storage server's port for client connection
+//     char metadata[256];                // Additional metadata
+//     // char accessible_paths[MAX_PATHS][256];  // List of accessible paths
+//     HashEntry accessible_paths[TABLE_SIZE];  // Hash table for accessible paths
+//     int num_paths;                     // Number of accessible paths
+//     // int is_occupied;  // Flag to indicate if the slot is occupied
+// } StorageServer;
+
+// Array to store registered storage servers
+RequestQueue request_queue;
+WorkerPool worker_pool;
+static void grow_worker_pool(bool force);
+// Shared source of request IDs, threads take whole blocks of it
+unsigned long long next_request_id_block = ACK_PREFIX;
+static __thread unsigned long long thread_next_id;
+static __thread unsigned long long thread_id_limit;
+
+// Unique 64-bit ID for a session or command. Each thread hands out IDs from its
+// own block, so the shared counter is touched once every REQUEST_ID_BLOCK IDs.
+unsigned long long allocate_request_id()
+{
+    if (thread_next_id == thread_id_limit)
+    {
+        thread_next_id = __atomic_fetch_add(&next_request_id_block, REQUEST_ID_BLOCK, __ATOMIC_RELAXED);
+        thread_id_limit = thread_next_id + REQUEST_ID_BLOCK;
+    }
+    return thread_next_id++;
+}
+
+static long futex(int *word, int op, int value, const struct timespec *timeout)
+{
+    return syscall(SYS_futex, word, op, value, timeout, NULL, 0);
+}
+
+static long monotonic_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+static void init_request_ring(RequestRing *ring)
+{
+    for (unsigned long i = 0; i < MAX_QUEUE_SIZE; i++)
+    {
+        ring->slots[i].sequence = i;
+        ring->slots[i].request = NULL;
+    }
+    ring->enqueue_pos = 0;
+    ring->dequeue_pos = 0;
+    ring->wake_seq = 0;
+    ring->sleepers = 0;
+}
+
+// Returns false if the ring is full, or looks full because a consumer a lap
+// behind has claimed the slot and not finished reading it yet
+static bool request_ring_push(RequestRing *ring, ClientRequest *request)
+{
+    RequestSlot *slot;
+    unsigned long pos = __atomic_load_n(&ring->enqueue_pos, __ATOMIC_RELAXED);
+    while (1)
+    {
+        slot = &ring->slots[pos & (MAX_QUEUE_SIZE - 1)];
+        long diff = (long)__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) - (long)pos;
+        if (diff == 0)
+        {
+            // Slot is free for this position, claim it
+            if (__atomic_compare_exchange_n(&ring->enqueue_pos, &pos, pos + 1, true,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            {
+                break;
+            }
+        }
+        else if (diff < 0)
+        {
+            return false;
+        }
+        else
+        {
+            pos = __atomic_load_n(&ring->enqueue_pos, __ATOMIC_RELAXED);
+        }
+    }
+    slot->request = request;
+    __atomic_store_n(&slot->sequence, pos + 1, __ATOMIC_RELEASE);
+
+    // Pairs with the fence in request_ring_pop_wait so a sleeper is never missed
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ring->sleepers, __ATOMIC_RELAXED) > 0)
+    {
+        __atomic_add_fetch(&ring->wake_seq, 1, __ATOMIC_RELEASE);
+        futex(&ring->wake_seq, FUTEX_WAKE_PRIVATE, 1, NULL);
+    }
+    return true;
+}
+
+// Returns NULL if the ring is empty
+static ClientRequest *request_ring_pop(RequestRing *ring)
+{
+    RequestSlot *slot;
+    unsigned long pos = __atomic_load_n(&ring->dequeue_pos, __ATOMIC_RELAXED);
+    while (1)
+    {
+        slot = &ring->slots[pos & (MAX_QUEUE_SIZE - 1)];
+        long diff = (long)__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) - (long)(pos + 1);
+        if (diff == 0)
+        {
+            // Slot holds the item for this position, claim it
+            if (__atomic_compare_exchange_n(&ring->dequeue_pos, &pos, pos + 1, true,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            {
+                break;
+            }
+        }
+        else if (diff < 0)
+        {
+            return NULL;
+        }
+        else
+        {
+            pos = __atomic_load_n(&ring->dequeue_pos, __ATOMIC_RELAXED);
+        }
+    }
+    ClientRequest *request = slot->request;
+    __atomic_store_n(&slot->sequence, pos + MAX_QUEUE_SIZE, __ATOMIC_RELEASE);
+    return request;
+}
+
+// Push an item into a ring that has room for every pooled request, so a
+// failed push is only ever a consumer still finishing with the slot
+static void request_ring_push_retry(RequestRing *ring, ClientRequest *request)
+{
+    while (!request_ring_push(ring, request))
+    {
+        sched_yield();
+    }
+}
+
+// Pop an item, sleeping on the futex while the ring is empty.
+// With a timeout, returns NULL once timeout_ms passes without an item.
+static ClientRequest *request_ring_pop_wait(RequestRing *ring, int timeout_ms)
+{
+    long deadline_us = timeout_ms > 0 ? monotonic_us() + timeout_ms * 1000L : 0;
+    while (1)
+    {
+        ClientRequest *request = request_ring_pop(ring);
+        // Items usually arrive quickly under load, retry briefly before sleeping
+        for (int spin = 0; !request && spin < QUEUE_SPIN_TRIES; spin++)
+        {
+            sched_yield();
+            request = request_ring_pop(ring);
+        }
+        if (request)
+        {
+            return request;
+        }
+
+        int seq = __atomic_load_n(&ring->wake_seq, __ATOMIC_ACQUIRE);
+        __atomic_add_fetch(&ring->sleepers, 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        request = request_ring_pop(ring);
+        if (!request)
+        {
+            struct timespec timeout;
+            struct timespec *timeout_ptr = NULL;
+            if (deadline_us)
+            {
+                long remaining_us = deadline_us - monotonic_us();
+                if (remaining_us <= 0)
+                {
+                    __atomic_sub_fetch(&ring->sleepers, 1, __ATOMIC_RELAXED);
+                    return NULL;
+                }
+                timeout.tv_sec = remaining_us / 1000000;
+                timeout.tv_nsec = (remaining_us % 1000000) * 1000;
+                timeout_ptr = &timeout;
+            }
+            // Returns at once if a push bumped wake_seq after it was read
+            futex(&ring->wake_seq, FUTEX_WAIT_PRIVATE, seq, timeout_ptr);
+        }
+        __atomic_sub_fetch(&ring->sleepers, 1, __ATOMIC_RELAXED);
+        if (request)
+        {
+            return request;
+        }
     }
-    return hash % CACHE_SIZE;
 }
 
-// Move node to front (most recently used)
-void move_to_front(LRUCache *cache, CacheNode *node)
+// Initialize the request queue
+void init_request_queue()
 {
-    if (node == cache->head)
+    init_request_ring(&request_queue.pending);
+    init_request_ring(&request_queue.free_list);
+    for (int i = 0; i < MAX_QUEUE_SIZE; i++)
     {
-        return; // Already at front
+        request_ring_push_retry(&request_queue.free_list, &request_queue.pool[i]);
     }
+    request_queue.parked = NULL;
+    request_queue.parked_tail = NULL;
+    request_queue.num_parked = 0;
+    pthread_mutex_init(&request_queue.parked_lock, NULL);
+}
+
+// Take a request object from the pool, NULL while every one is queued or in use
+ClientRequest *acquire_request()
+{
+    return request_ring_pop(&request_queue.free_list);
+}
 
-    // Remove from current position
-    if (node->prev)
+// Take a request for a session's next command without waiting. If the pool is empty
+// the session is parked, left disarmed, and release_request re-arms it later.
+static ClientRequest *acquire_request_for_session(ReactorConnection *session)
+{
+    ClientRequest *request = acquire_request();
+    if (request)
     {
-        node->prev->next = node->next;
+        return request;
     }
-    if (node->next)
+
+    pthread_mutex_lock(&request_queue.parked_lock);
+    __atomic_add_fetch(&request_queue.num_parked, 1, __ATOMIC_RELAXED);
+    // Pairs with the fence in release_request, a request freed before the count
+    // went up is found by this second look rather than lost
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    request = acquire_request();
+    if (request)
     {
-        node->next->prev = node->prev;
+        __atomic_sub_fetch(&request_queue.num_parked, 1, __ATOMIC_RELAXED);
     }
-    if (node == cache->tail)
+    else
+    {
+        session->next_parked = NULL;
+        if (request_queue.parked_tail)
+        {
+            request_queue.parked_tail->next_parked = session;
+        }
+        else
+        {
+            request_queue.parked = session;
+        }
+        request_queue.parked_tail = session;
+    }
+    pthread_mutex_unlock(&request_queue.parked_lock);
+    return request;
+}
+
+// Give a handled request back to the pool, waking the longest parked session if any
+void release_request(ClientRequest *request)
+{
+    request_ring_push_retry(&request_queue.free_list, request);
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&request_queue.num_parked, __ATOMIC_RELAXED) == 0)
+    {
+        return;
+    }
+    pthread_mutex_lock(&request_queue.parked_lock);
+    ReactorConnection *session = request_queue.parked;
+    if (session)
+    {
+        request_queue.parked = session->next_parked;
+        if (!request_queue.parked)
+        {
+            request_queue.parked_tail = NULL;
+        }
+        __atomic_sub_fetch(&request_queue.num_parked, 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&request_queue.parked_lock);
+    if (session)
+    {
+        rearm_client_session(session); // Its pending command is still unread in the socket
+    }
+}
+
+// Add request to queue; never full, it has a slot for every pooled request
+unsigned long long enqueue_request(ClientRequest *request)
+{
+    unsigned long long request_id = request->request_id; // A worker may own the request once it is pushed
+    request->enqueued_us = monotonic_us();
+    request_ring_push_retry(&request_queue.pending, request);
+    grow_worker_pool(false);
+    return request_id;
+}
+
+// Get next request from queue, NULL if none arrives within timeout_ms
+ClientRequest *dequeue_request(int timeout_ms)
+{
+    return request_ring_pop_wait(&request_queue.pending, timeout_ms);
+}
+
+// Start one more worker if the pool is below its maximum. Unless forced, only
+// when more commands are queued than there are workers free to take them.
+static void grow_worker_pool(bool force)
+{
+    int workers = __atomic_load_n(&worker_pool.num_workers, __ATOMIC_RELAXED);
+    if (workers >= worker_pool.max_workers)
+    {
+        return;
+    }
+    if (!force)
+    {
+        long queued = (long)(__atomic_load_n(&request_queue.pending.enqueue_pos, __ATOMIC_RELAXED) -
+                             __atomic_load_n(&request_queue.pending.dequeue_pos, __ATOMIC_RELAXED));
+        int free_workers = workers - __atomic_load_n(&worker_pool.busy_workers, __ATOMIC_RELAXED);
+        if (queued <= free_workers)
+        {
+            return;
+        }
+    }
+    if (!__atomic_compare_exchange_n(&worker_pool.num_workers, &workers, workers + 1, false,
+                                     __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    {
+        return; // Another thread changed the pool first
+    }
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, process_requests, NULL) != 0)
+    {
+        perror("Error creating worker thread");
+        __atomic_sub_fetch(&worker_pool.num_workers, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    pthread_detach(thread);
+    __atomic_add_fetch(&worker_pool.spawned, 1, __ATOMIC_RELAXED);
+
+    int peak = __atomic_load_n(&worker_pool.peak_workers, __ATOMIC_RELAXED);
+    while (workers + 1 > peak &&
+           !__atomic_compare_exchange_n(&worker_pool.peak_workers, &peak, workers + 1, false,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
     {
-        cache->tail = node->prev;
     }
+}
+
+// Leave the pool unless that would take it below its minimum
+static bool retire_worker()
+{
+    int workers = __atomic_load_n(&worker_pool.num_workers, __ATOMIC_RELAXED);
+    while (workers > worker_pool.min_workers)
+    {
+        if (__atomic_compare_exchange_n(&worker_pool.num_workers, &workers, workers - 1, false,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        {
+            __atomic_add_fetch(&worker_pool.retired, 1, __ATOMIC_RELAXED);
+            return true;
+        }
+    }
+    return false;
+}
+
+static void record_queue_wait(long wait_us)
+{
+    int bucket = 0;
+    for (long limit = 100; bucket < QUEUE_WAIT_BUCKETS - 1 && wait_us >= limit; limit *= 10)
+    {
+        bucket++;
+    }
+    __atomic_add_fetch(&worker_pool.queue_wait[bucket], 1, __ATOMIC_RELAXED);
+}
+
+// Start min_workers workers; the pool grows towards max_workers under load
+void init_worker_pool(int min_workers, int max_workers)
+{
+    memset(&worker_pool, 0, sizeof(worker_pool));
+    worker_pool.min_workers = min_workers;
+    worker_pool.max_workers = max_workers;
+    for (int i = 0; i < min_workers; i++)
+    {
+        grow_worker_pool(true);
+    }
+    printf("Worker pool started with %d workers (max %d)\n", min_workers, max_workers);
+}
+
+// Append the pool's counters to a STATS report
+void format_worker_pool_stats(char *report, size_t size)
+{
+    unsigned long busy_us = __atomic_load_n(&worker_pool.busy_us, __ATOMIC_RELAXED);
+    unsigned long idle_us = __atomic_load_n(&worker_pool.idle_us, __ATOMIC_RELAXED);
+    unsigned long waits[QUEUE_WAIT_BUCKETS];
+    for (int i = 0; i < QUEUE_WAIT_BUCKETS; i++)
+    {
+        waits[i] = __atomic_load_n(&worker_pool.queue_wait[i], __ATOMIC_RELAXED);
+    }
+
+    size_t len = strlen(report);
+    snprintf(report + len, size - len,
+             "\nWorkers: %d (min %d, max %d, peak %d), busy: %d\n"
+             "Workers started: %lu, retired: %lu\n"
+             "Worker utilization: %.1f%%\n"
+             "Queue wait: <100us %lu, <1ms %lu, <10ms %lu, <100ms %lu, <1s %lu, >=1s %lu",
+             __atomic_load_n(&worker_pool.num_workers, __ATOMIC_RELAXED),
+             worker_pool.min_workers, worker_pool.max_workers,
+             __atomic_load_n(&worker_pool.peak_workers, __ATOMIC_RELAXED),
+             __atomic_load_n(&worker_pool.busy_workers, __ATOMIC_RELAXED),
+             __atomic_load_n(&worker_pool.spawned, __ATOMIC_RELAXED),
+             __atomic_load_n(&worker_pool.retired, __ATOMIC_RELAXED),
+             busy_us + idle_us ? 100.0 * busy_us / (busy_us + idle_us) : 0.0,
+             waits[0], waits[1], waits[2], waits[3], waits[4], waits[5]);
+}
+
+// Worker thread function to process requests
+void *process_requests(void *arg)
+{
+    while (1)
+    {
+        long wait_start = monotonic_us();
+        ClientRequest *request = dequeue_request(WORKER_IDLE_TIMEOUT_MS);
+        long now = monotonic_us();
+        __atomic_add_fetch(&worker_pool.idle_us, now - wait_start, __ATOMIC_RELAXED);
+        if (!request)
+        {
+            if (retire_worker())
+            {
+                return NULL;
+            }
+            continue;
+        }
+
+        long queued_us = now - request->enqueued_us;
+        record_queue_wait(queued_us);
+        if (queued_us >= WORKER_GROW_WAIT_US)
+        {
+            grow_worker_pool(true); // Commands are waiting too long for a worker
+        }
+
+        __atomic_add_fetch(&worker_pool.busy_workers, 1, __ATOMIC_RELAXED);
+        ReactorConnection *session = request->session;
+        if (request->kind == REQUEST_FIRST_MESSAGE)
+        {
+            // Registration, an async completion or the start of a session, all of which
+            // send on blocking sockets, so they are kept off the reactor thread
+            handle_first_message(session);
+        }
+        else
+        {
+            printf("Processing request %llu (ACK %llu) from %s:%d\n",
+                   request->request_id, request->ack_number, request->client_ip, request->client_port);
+
+            // Handle this one command, then let the reactor wait for the session's next one
+            if (request->kind == REQUEST_REJECT)
+            {
+                pthread_mutex_lock(&session->send_lock);
+                proto_send_result(session->socket, OP_RESULT, 0, 0, ERR_INVALID_COMMAND, "Invalid command");
+                pthread_mutex_unlock(&session->send_lock);
+            }
+            else
+            {
+                handle_client_command(request->client_socket, request->client_ip, request->client_port,
+                                      request->request, request->ack_number, request->request_id,
+                                      request->framed, session);
+            }
+            rearm_client_session(session);
+        }
+        release_request(request);
+
+        __atomic_sub_fetch(&worker_pool.busy_workers, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&worker_pool.busy_us, monotonic_us() - now, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+unsigned int hash(const char *str)
+{
+    unsigned int hash = 0;
+    while (*str)
+    {
+        hash = (hash * 31) + *str++; // 31 is chosen as a multiplier for distribution
+    }
+    // Fold the high bits down, path tables index with the low bits only
+    hash ^= hash >> 16;
+    hash *= 0x45d9f3b;
+    hash ^= hash >> 16;
+    return hash;
+}
+
+PathIndex path_index;
+NamespaceTrie *namespace_trie;
+
+// Initialize the global path -> server index
+void init_path_index()
+{
+    path_index.buckets = (PathIndexEntry **)calloc(PATH_INDEX_INITIAL_BUCKETS, sizeof(PathIndexEntry *));
+    path_index.capacity = PATH_INDEX_INITIAL_BUCKETS;
+    path_index.num_entries = 0;
+    pthread_rwlock_init(&path_index.lock, NULL);
+}
+
+// Hash function for the path index, callers mask it with the current capacity
+unsigned int path_index_hash(const char *path)
+{
+    unsigned int hash = 0;
+    while (*path)
+    {
+        hash = (hash * 31) + *path++;
+    }
+    return hash;
+}
+
+// Find the index entry for a path, caller must hold path_index.lock
+static PathIndexEntry *path_index_find(const char *path)
+{
+    unsigned int h = path_index_hash(path);
+    PathIndexEntry *entry = path_index.buckets[h & (path_index.capacity - 1)];
+    while (entry)
+    {
+        if (entry->hash == h && strcmp(entry->path, path) == 0)
+        {
+            return entry;
+        }
+        entry = entry->next;
+    }
+    return NULL;
+}
 
-    // Move to front
-    node->next = cache->head;
-    node->prev = NULL;
-    if (cache->head)
+// Double the bucket array and relink every entry by its stored hash,
+// caller must hold path_index.lock for writing
+static void path_index_grow(void)
+{
+    unsigned int capacity = path_index.capacity * 2;
+    PathIndexEntry **buckets = (PathIndexEntry **)calloc(capacity, sizeof(PathIndexEntry *));
+    if (!buckets)
     {
-        cache->head->prev = node;
+        return; // Keep the longer chains rather than fail the insert
     }
-    cache->head = node;
-    if (!cache->tail)
+
+    for (unsigned int i = 0; i < path_index.capacity; i++)
     {
-        cache->tail = node;
+        PathIndexEntry *entry = path_index.buckets[i];
+        while (entry)
+        {
+            PathIndexEntry *next = entry->next;
+            unsigned int bucket = entry->hash & (capacity - 1);
+            entry->next = buckets[bucket];
+            buckets[bucket] = entry;
+            entry = next;
+        }
     }
+    free(path_index.buckets);
+    path_index.buckets = buckets;
+    path_index.capacity = capacity;
 }
 
-// Create new cache node
-CacheNode *create_node(const char *path, const char *ss_ip, int ss_port)
+// Record that ss_id holds path, caller must hold path_index.lock for writing
+static void path_index_add(const char *path, int ss_id)
 {
-    CacheNode *node = (CacheNode *)malloc(sizeof(CacheNode));
-    strncpy(node->path, path, sizeof(node->path) - 1);
-    strncpy(node->ss_ip, ss_ip, sizeof(node->ss_ip) - 1);
-    node->ss_port = ss_port;
-    node->prev = NULL;
-    node->next = NULL;
-    return node;
-}
-
-// Add or update entry in cache
-void cache_put(LRUCache *cache, const char *path, const char *ss_ip, int ss_port)
-{
-    pthread_mutex_lock(&cache->lock);
+    PathIndexEntry *entry = path_index_find(path);
+    if (!entry)
+    {
+        if ((unsigned long)(path_index.num_entries + 1) * 100 >
+            (unsigned long)path_index.capacity * PATH_INDEX_MAX_LOAD)
+        {
+            path_index_grow();
+        }
 
-    unsigned int hash_key = cache_hash(path);
-    CacheNode *existing = cache->hash[hash_key];
+        entry = (PathIndexEntry *)malloc(sizeof(PathIndexEntry));
+        entry->path = strdup(path);
+        entry->hash = path_index_hash(path);
+        entry->num_owners = 0;
+        unsigned int bucket = entry->hash & (path_index.capacity - 1);
+        entry->next = path_index.buckets[bucket];
+        path_index.buckets[bucket] = entry;
+        path_index.num_entries++;
+    }
 
-    if (existing)
+    for (int i = 0; i < entry->num_owners; i++)
     {
-        // Update existing entry
-        strncpy(existing->ss_ip, ss_ip, sizeof(existing->ss_ip) - 1);
-        existing->ss_port = ss_port;
-        move_to_front(cache, existing);
+        if (entry->ss_ids[i] == ss_id)
+        {
+            return; // Already recorded
+        }
     }
-    else
+    if (entry->num_owners < MAX_PATH_OWNERS)
     {
-        // Create new entry
-        CacheNode *new_node = create_node(path, ss_ip, ss_port);
+        entry->ss_ids[entry->num_owners++] = ss_id;
+    }
+}
 
-        // If cache is full, remove least recently used
-        if (cache->size >= cache->capacity)
+// Drop ss_id as an owner of path, caller must hold path_index.lock for writing
+static void path_index_remove(const char *path, int ss_id)
+{
+    unsigned int h = path_index_hash(path);
+    PathIndexEntry **link = &path_index.buckets[h & (path_index.capacity - 1)];
+    while (*link)
+    {
+        PathIndexEntry *entry = *link;
+        if (entry->hash == h && strcmp(entry->path, path) == 0)
         {
-            CacheNode *lru = cache->tail;
-            unsigned int lru_hash = cache_hash(lru->path);
-            cache->hash[lru_hash] = NULL;
-
-            cache->tail = lru->prev;
-            if (cache->tail)
+            for (int i = 0; i < entry->num_owners; i++)
             {
-                cache->tail->next = NULL;
+                if (entry->ss_ids[i] == ss_id)
+                {
+                    entry->ss_ids[i] = entry->ss_ids[--entry->num_owners];
+                    break;
+                }
             }
-            free(lru);
-            cache->size--;
-        }
-
-        // Add new node to front
-        new_node->next = cache->head;
-        if (cache->head)
-        {
-            cache->head->prev = new_node;
-        }
-        cache->head = new_node;
-        if (!cache->tail)
-        {
-            cache->tail = new_node;
+            if (entry->num_owners == 0)
+            {
+                *link = entry->next;
+                free(entry->path);
+                free(entry);
+                path_index.num_entries--;
+            }
+            return;
         }
-
-        cache->hash[hash_key] = new_node;
-        cache->size++;
+        link = &entry->next;
     }
-
-    pthread_mutex_unlock(&cache->lock);
 }
 
-// Get entry from cache
-bool cache_get(LRUCache *cache, const char *path, char *ss_ip, int *ss_port)
+// Returns the index of a storage server holding path, or -1 if none does
+int path_index_lookup(const char *path)
 {
-    pthread_mutex_lock(&cache->lock);
-
-    unsigned int hash_key = cache_hash(path);
-    CacheNode *node = cache->hash[hash_key];
+    int ss_id = -1;
+    char key[TRIE_MAX_PATH];
+    trie_canonical_path(path, key, sizeof(key));
 
-    if (node && strcmp(node->path, path) == 0)
+    pthread_rwlock_rdlock(&path_index.lock);
+    PathIndexEntry *entry = path_index_find(key);
+    for (int i = 0; entry && i < entry->num_owners; i++)
     {
-        // Cache hit
-        strncpy(ss_ip, node->ss_ip, INET_ADDRSTRLEN);
-        *ss_port = node->ss_port;
-        move_to_front(cache, node);
-        pthread_mutex_unlock(&cache->lock);
-        return true;
+        // Skip replicas whose storage server has disconnected
+        if (storage_servers[entry->ss_ids[i]].is_active)
+        {
+            ss_id = entry->ss_ids[i];
+            break;
+        }
     }
+    pthread_rwlock_unlock(&path_index.lock);
 
-    pthread_mutex_unlock(&cache->lock);
-    return false;
+    return ss_id;
 }
 
-// Clean up cache
-void free_lru_cache(LRUCache *cache)
+// Returns the server holding path, or owning its longest registered prefix, or -1.
+// exact tells which of the two it was.
+int resolve_path_owner(const char *path, bool *exact)
 {
-    pthread_mutex_lock(&cache->lock);
-
-    CacheNode *current = cache->head;
-    while (current)
+    int ss_id = path_index_lookup(path);
+    *exact = (ss_id != -1);
+    if (ss_id == -1)
     {
-        CacheNode *next = current->next;
-        free(current);
-        current = next;
+        ss_id = trie_resolve(namespace_trie, path);
+        if (ss_id != -1 && !storage_servers[ss_id].is_active)
+        {
+            ss_id = -1;
+        }
     }
-
-    pthread_mutex_unlock(&cache->lock);
-    pthread_mutex_destroy(&cache->lock);
-    free(cache);
+    return ss_id;
 }
 
-// Print cache contents (for debugging)
-void print_cache_contents(LRUCache *cache)
+// Add a path to a storage server's table, the global index and the namespace trie.
+// The tables and index are keyed by the canonical form the trie reports on removal.
+void add_path_to_server(int ss_id, const char *path)
 {
-    pthread_mutex_lock(&cache->lock);
+    char key[TRIE_MAX_PATH];
+    trie_canonical_path(path, key, sizeof(key));
 
-    printf("\nCache Contents (Most Recent First):\n");
-    CacheNode *current = cache->head;
-    while (current)
-    {
-        printf("Path: %s -> SS: %s:%d\n",
-               current->path, current->ss_ip, current->ss_port);
-        current = current->next;
-    }
-    printf("Cache size: %d/%d\n", cache->size, cache->capacity);
+    pthread_rwlock_wrlock(&path_index.lock);
+    insert_path(&storage_servers[ss_id], key);
+    path_index_add(key, ss_id);
+    pthread_rwlock_unlock(&path_index.lock);
 
-    pthread_mutex_unlock(&cache->lock);
+    // Taken after path_index.lock is released, removals nest the two the other way round
+    trie_insert(namespace_trie, key, ss_id);
 }
-// #define TABLE_SIZE 101  // Prime number for better distribution
-// #define MAX_PATHS 256   // Example maximum paths
 
-// typedef struct {
-//     char path[256];      // File or folder path name
-//     bool is_occupied;    // Flag to indicate if slot is occupied
-//     bool is_deleted;     // Flag to indicate if slot is a tombstone
-// } HashEntry;
+// Remove a path from a storage server's table and from the global index
+void remove_path_from_server(int ss_id, const char *path)
+{
+    char key[TRIE_MAX_PATH];
+    trie_canonical_path(path, key, sizeof(key));
 
-// typedef struct {
-//     char ip_address[INET_ADDRSTRLEN];  // Storage server's IP address
-//     int port;                          // Storage server's port for NM connection
-//     int client_port;                   // Storage server's port for client connection
-//     char metadata[256];                // Additional metadata
-//     // char accessible_paths[MAX_PATHS][256];  // List of accessible paths
-//     HashEntry accessible_paths[TABLE_SIZE];  // Hash table for accessible paths
-//     int num_paths;                     // Number of accessible paths
-//     // int is_occupied;  // Flag to indicate if the slot is occupied
-// } StorageServer;
+    pthread_rwlock_wrlock(&path_index.lock);
+    delete_path(&storage_servers[ss_id], key);
+    path_index_remove(key, ss_id);
+    pthread_rwlock_unlock(&path_index.lock);
+}
 
-// Array to store registered storage servers
-RequestQueue request_queue;
-int next_ack_number = ACK_PREFIX;
+// trie_visit_fn dropping one removed path from its owner's table and the index
+static void unregister_removed_path(const char *path, int owner, void *arg)
+{
+    (void)arg;
+    remove_path_from_server(owner, path);
+}
 
-// Initialize the request queue
-void init_request_queue()
+// Remove ss_id's registration of path and of every path below it, returns the number removed.
+// Other servers holding the same paths keep them.
+int remove_subtree_from_servers(const char *path, int ss_id)
+{
+    return trie_remove_subtree(namespace_trie, path, ss_id, unregister_removed_path, NULL);
+}
+
+// trie_visit_fn appending one directory entry to a listing buffer
+static void append_listing_entry(const char *name, int owner, void *arg)
 {
-    request_queue.front = 0;
-    request_queue.rear = -1;
-    request_queue.size = 0;
-    pthread_mutex_init(&request_queue.mutex, NULL);
-    pthread_cond_init(&request_queue.not_empty, NULL);
-    pthread_cond_init(&request_queue.not_full, NULL);
+    (void)owner;
+    char *listing = (char *)arg;
+    size_t len = strlen(listing);
+    snprintf(listing + len, BUFFER_SIZE - len, "%s\n", name);
 }
 
-// Add request to queue
-int enqueue_request(ClientRequest request)
+// function to find storage server in which path is present.
+// Returns by value so concurrent workers never share a result; ss_id is -1 if not found.
+SSLocation get_ss_ipandport(const char *requested_path)
 {
-    pthread_mutex_lock(&request_queue.mutex);
+    SSLocation location;
+    location.ss_id = -1;
 
-    while (request_queue.size >= MAX_QUEUE_SIZE)
+    // Cache, index and trie all agree on one spelling of each path
+    char filepath[TRIE_MAX_PATH];
+    trie_canonical_path(requested_path, filepath, sizeof(filepath));
+
+    // Try to get from cache first
+    if (cache_get(cache, filepath, location.ip_address, &location.client_port, &location.ss_id))
+    {
+        if (storage_servers[location.ss_id].is_active)
+        {
+            printf("Cache hit for path: %s\n", filepath);
+            return location;
+        }
+        // Raced with the server's removal, never hand out its address
+        cache_drop_stale(cache, filepath);
+        printf("Dropped stale cache entry for path: %s\n", filepath);
+    }
+    else
     {
-        pthread_cond_wait(&request_queue.not_full, &request_queue.mutex);
+        printf("Cache miss for path: %s\n", filepath);
     }
+    location.ss_id = -1;
 
-    request_queue.rear = (request_queue.rear + 1) % MAX_QUEUE_SIZE;
-    request_queue.requests[request_queue.rear] = request;
-    request_queue.size++;
-
-    pthread_cond_signal(&request_queue.not_empty);
-    pthread_mutex_unlock(&request_queue.mutex);
+    // Paths recently found missing are answered without touching the index
+    if (neg_cache_contains(negative_cache, filepath))
+    {
+        printf("Negative cache hit for path: %s\n", filepath);
+        return location;
+    }
 
-    return request.ack_number;
-}
+    // One probe of the global index instead of scanning every server,
+    // then the owner of the longest registered prefix
+    unsigned long generation = neg_cache_generation(negative_cache);
+    unsigned long cache_gen = cache_generation(cache);
+    bool exact;
+    int ss_id = resolve_path_owner(filepath, &exact);
+    if (ss_id == -1)
+    {
+        neg_cache_put(negative_cache, filepath, generation);
+        return location;
+    }
 
-// Get next request from queue
-ClientRequest dequeue_request()
-{
-    pthread_mutex_lock(&request_queue.mutex);
+    strncpy(location.ip_address, storage_servers[ss_id].ip_address, INET_ADDRSTRLEN - 1);
+    location.ip_address[INET_ADDRSTRLEN - 1] = '\0';
+    location.client_port = storage_servers[ss_id].client_port;
+    location.ss_id = ss_id;
 
-    while (request_queue.size == 0)
+    // Only registered paths are cached. A prefix hit also answers for paths the
+    // directory's owner has since deleted, and nothing would invalidate it.
+    if (exact)
     {
-        pthread_cond_wait(&request_queue.not_empty, &request_queue.mutex);
+        cache_put(cache, filepath, location.ip_address, location.client_port, ss_id, cache_gen);
+        printf("Added to cache: %s -> %s:%d\n",
+               filepath, location.ip_address, location.client_port);
     }
+    return location;
+}
 
-    ClientRequest request = request_queue.requests[request_queue.front];
-    request_queue.front = (request_queue.front + 1) % MAX_QUEUE_SIZE;
-    request_queue.size--;
-
-    pthread_cond_signal(&request_queue.not_full);
-    pthread_mutex_unlock(&request_queue.mutex);
+// Allocate an empty slot array with the given (power of two) capacity
+static void init_path_slots(PathTableSlots *slots, unsigned int capacity)
+{
+    slots->slots = (HashEntry *)calloc(capacity, sizeof(HashEntry));
+    slots->capacity = capacity;
+    slots->used = 0;
+    slots->tombstones = 0;
+}
 
-    return request;
+// Initialize an empty path table
+void init_path_table(PathTable *table)
+{
+    init_path_slots(&table->tables[0], PATH_TABLE_INITIAL_SIZE);
+    memset(&table->tables[1], 0, sizeof(PathTableSlots));
+    table->rehash_index = -1;
 }
 
-// Worker thread function to process requests
-void *process_requests(void *arg)
+// Find the live slot holding path, or NULL
+static HashEntry *find_path_slot(const PathTableSlots *slots, const char *path, unsigned int h)
 {
-    while (1)
-    {
-        ClientRequest request = dequeue_request();
-        printf("Processing request with ACK %d from %s:%d\n",
-               request.ack_number, request.client_ip, request.client_port);
+    if (slots->capacity == 0)
+        return NULL;
 
-        // Process the request using existing handle_client function
-        handle_client(request.client_socket, request.client_ip, request.client_port);
+    unsigned int mask = slots->capacity - 1;
+    unsigned int index = h & mask;
+    for (unsigned int i = 1; i <= slots->capacity; i++)
+    {
+        HashEntry *entry = &slots->slots[index];
+        if (!entry->is_occupied)
+            return NULL; // An empty slot ends the probe chain
+        if (!entry->is_deleted && entry->hash == h && strcmp(entry->path, path) == 0)
+            return entry;
+        index = (index + i) & mask; // Triangular steps visit every slot of a power of two table
     }
     return NULL;
 }
 
-StorageServer storage_servers[MAX_STORAGE_SERVERS];
-int server_count = 0;
-
-unsigned int hash(const char *str)
+// Store a path known to be absent, reusing the first tombstone on its chain.
+// Returns the number of probes it took.
+static unsigned int place_path_slot(PathTableSlots *slots, char *path, unsigned int h)
 {
-    unsigned int hash = 0;
-    while (*str)
+    unsigned int mask = slots->capacity - 1;
+    unsigned int index = h & mask;
+    unsigned int i = 1;
+
+    while (slots->slots[index].is_occupied && !slots->slots[index].is_deleted)
     {
-        hash = (hash * 31) + *str++; // 31 is chosen as a multiplier for distribution
+        index = (index + i) & mask;
+        i++;
     }
-    return hash % TABLE_SIZE;
+
+    HashEntry *entry = &slots->slots[index];
+    if (entry->is_deleted)
+        slots->tombstones--;
+    entry->path = path;
+    entry->hash = h;
+    entry->is_occupied = true;
+    entry->is_deleted = false;
+    slots->used++;
+    return i;
 }
 
-// function to find storage server in which path is present
-StorageServer *get_ss_ipandport(char *filepath)
+// Start moving live entries into a fresh table of at least min_capacity slots.
+// Tombstones are not carried over, so this also compacts the table.
+static void start_path_rehash(PathTable *table, unsigned int min_capacity)
 {
-    char cached_ip[INET_ADDRSTRLEN];
-    int cached_port;
+    unsigned int capacity = PATH_TABLE_INITIAL_SIZE;
+    unsigned long live = table->tables[0].used + 1;
 
-    // Try to get from cache first
-    if (cache_get(cache, filepath, cached_ip, &cached_port))
+    // Leave the live entries at half the allowed load so inserts made during the rehash fit
+    while (capacity < min_capacity || (unsigned long)capacity * PATH_TABLE_MAX_LOAD < live * 200)
     {
-        printf("Cache hit for path: %s\n", filepath);
-        // Create temporary StorageServer struct for cache hit
-        static StorageServer cached_server;
-        strncpy(cached_server.ip_address, cached_ip, INET_ADDRSTRLEN);
-        cached_server.client_port = cached_port;
-        return &cached_server;
+        capacity *= 2;
     }
+    init_path_slots(&table->tables[1], capacity);
+    table->rehash_index = 0;
+}
 
-    printf("Cache miss for path: %s\n", filepath);
+// Migrate up to steps slots of tables[0], finishing the rehash once all have moved
+static void path_rehash_step(PathTable *table, unsigned long steps)
+{
+    PathTableSlots *old = &table->tables[0];
 
-    // StorageServer S ;
-    // Original storage server lookup
-    for (int i = 0; i < server_count; i++)
+    while (steps-- > 0 && table->rehash_index < (long)old->capacity)
     {
-        int res = search_path(storage_servers[i], filepath);
-        if (res == 1)
+        HashEntry *entry = &old->slots[table->rehash_index++];
+        if (entry->is_occupied && !entry->is_deleted)
         {
-            // Add to cache before returning
-            cache_put(cache, filepath,
-                      storage_servers[i].ip_address,
-                      storage_servers[i].client_port);
-            printf("Added to cache: %s -> %s:%d\n",
-                   filepath, storage_servers[i].ip_address,
-                   storage_servers[i].client_port);
-            return &storage_servers[i];
+            place_path_slot(&table->tables[1], entry->path, entry->hash);
+            // Leave a tombstone so probe chains of unmigrated entries stay intact
+            entry->path = NULL;
+            entry->is_deleted = true;
+            old->used--;
+            old->tombstones++;
         }
     }
-    return NULL;
+
+    if (table->rehash_index >= (long)old->capacity)
+    {
+        free(old->slots);
+        table->tables[0] = table->tables[1];
+        memset(&table->tables[1], 0, sizeof(PathTableSlots));
+        table->rehash_index = -1;
+    }
 }
 
-// Insert a file or folder path into the hash table with quadratic probing
-StorageServer insert_path(StorageServer server, const char *path)
+// Insert a file or folder path into the server's hash table in place, growing it as needed
+bool insert_path(StorageServer *server, const char *path)
 {
-    unsigned int index = hash(path);
-    unsigned int i = 1;
+    PathTable *table = &server->accessible_paths;
+    unsigned int h = hash(path);
 
-    while (server.accessible_paths[index].is_occupied && !server.accessible_paths[index].is_deleted)
+    if (table->rehash_index >= 0)
+        path_rehash_step(table, PATH_TABLE_REHASH_STEP);
+
+    if (search_path(server, path))
+        return true; // Already present
+
+    PathTableSlots *target = &table->tables[table->rehash_index >= 0 ? 1 : 0];
+    if ((unsigned long)(target->used + target->tombstones + 1) * 100 >
+        (unsigned long)target->capacity * PATH_TABLE_MAX_LOAD)
     {
-        index = (index + i * i) % TABLE_SIZE;
-        i++;
-        if (i > TABLE_SIZE)
-            return server; // Table is full, return unmodified
+        if (table->rehash_index >= 0)
+            path_rehash_step(table, table->tables[0].capacity); // Finish the one in progress
+        start_path_rehash(table, 0);
+        target = &table->tables[1];
     }
 
-    strcpy(server.accessible_paths[index].path, path);
-    server.accessible_paths[index].is_occupied = true;
-    server.accessible_paths[index].is_deleted = false;
-    server.num_paths++;
-    return server;
+    unsigned int probes = place_path_slot(target, strdup(path), h);
+    server->num_paths++;
+
+    // A long chain at normal load means clustering, double the table to spread it
+    if (probes > PATH_TABLE_MAX_PROBE && table->rehash_index < 0)
+        start_path_rehash(table, table->tables[0].capacity * 2);
+    return true;
 }
 
-// Delete a file or folder path from the hash table with quadratic probing
+// Delete a file or folder path from the hash table, leaving a tombstone
 bool delete_path(StorageServer *server, const char *path)
 {
-    unsigned int index = hash(path);
-    unsigned int i = 1;
+    PathTable *table = &server->accessible_paths;
+    unsigned int h = hash(path);
+
+    if (table->rehash_index >= 0)
+        path_rehash_step(table, PATH_TABLE_REHASH_STEP);
 
-    while (server->accessible_paths[index].is_occupied)
+    for (int t = 0; t < 2; t++)
     {
-        if (!server->accessible_paths[index].is_deleted &&
-            strcmp(server->accessible_paths[index].path, path) == 0)
-        {
-            server->accessible_paths[index].is_deleted = true;
-            server->num_paths--;
-            return true; // Path deleted
-        }
-        index = (index + i * i) % TABLE_SIZE;
-        i++;
-        if (i > TABLE_SIZE)
-            return false; // Path not found
+        PathTableSlots *slots = &table->tables[t];
+        HashEntry *entry = find_path_slot(slots, path, h);
+        if (!entry)
+            continue;
+
+        free(entry->path);
+        entry->path = NULL;
+        entry->is_deleted = true;
+        slots->used--;
+        slots->tombstones++;
+        server->num_paths--;
+
+        // Compact once tombstones make up a quarter of the slots
+        if (table->rehash_index < 0 &&
+            (unsigned long)slots->tombstones * 200 > (unsigned long)slots->capacity * PATH_TABLE_MAX_LOAD)
+            start_path_rehash(table, 0);
+        return true; // Path deleted
     }
     return false; // Path not found
 }
 
-// Search for a file or folder path in the hash table with quadratic probing
-int search_path(StorageServer server, const char *path)
+// Search for a file or folder path, looking in both tables while a rehash is in progress
+int search_path(const StorageServer *server, const char *path)
 {
-    unsigned int index = hash(path);
-    unsigned int i = 1;
+    const PathTable *table = &server->accessible_paths;
+    unsigned int h = hash(path);
 
-    while (server.accessible_paths[index].is_occupied)
-    {
-        if (!server.accessible_paths[index].is_deleted &&
-            strcmp(server.accessible_paths[index].path, path) == 0)
-        {
-            return 1; // Path found
-        }
-        index = (index + i * i) % TABLE_SIZE;
-        i++;
-        if (i > TABLE_SIZE)
-            return 0; // Path not found
-    }
+    if (table->rehash_index >= 0 && find_path_slot(&table->tables[1], path, h))
+        return 1; // Path found
+    if (find_path_slot(&table->tables[0], path, h))
+        return 1; // Path found
     return 0; // Path not found
 }
 
 // Function to register a storage server in the array
-void register_storage_server(const char *ip_address, int port, int client_port, const char *metadata, const char *paths[], int num_paths)
+// Returns the index of the new server, or -1 if the table is full
+int register_storage_server(const char *ip_address, int port, int client_port, const char *metadata, const char *paths[], int num_paths)
 {
+    pthread_mutex_lock(&registration_lock);
     if (server_count < MAX_STORAGE_SERVERS)
     {
         // Set IP address, ports, metadata, and initialize paths
@@ -478,21 +1310,76 @@ void register_storage_server(const char *ip_address, int port, int client_port,
         storage_servers[server_count].client_port = client_port;
         strcpy(storage_servers[server_count].metadata, metadata);
         storage_servers[server_count].num_paths = 0; // Start with 0 and increment as paths are added
+        init_path_table(&storage_servers[server_count].accessible_paths);
+        storage_servers[server_count].is_active = true;
 
-        // Insert each path into the hash table within the struct
+        // Insert each path into the hash table within the struct and the global index
         for (int i = 0; i < num_paths; i++)
         {
-            storage_servers[server_count] = insert_path(storage_servers[server_count], paths[i]);
+            add_path_to_server(server_count, paths[i]);
         }
 
+        // Any path may have just come into existence. Cleared only once all of them are
+        // indexed, the generation bump also rejects misses recorded by lookups still in flight.
+        neg_cache_clear(negative_cache);
+
         // Increment server count after registration
         server_count++;
+        int ss_id = server_count - 1;
+        pthread_mutex_unlock(&registration_lock);
         printf("Registered storage server %s:%d (Client Port: %d) with metadata: %s and %d accessible paths.\n",
-               ip_address, port, client_port, metadata, storage_servers[server_count - 1].num_paths);
+               ip_address, port, client_port, metadata, storage_servers[ss_id].num_paths);
+        return ss_id;
     }
-    else
+    pthread_mutex_unlock(&registration_lock);
+
+    printf("Error: Maximum number of storage servers reached.\n");
+    return -1;
+}
+
+int reactor_fd = -1;
+
+// Watch a client session in the reactor; EPOLLONESHOT keeps at most one of its commands in flight
+void add_client_session(int client_socket, struct sockaddr_in *client_addr, unsigned long long ack_number,
+                        bool framed)
+{
+    ReactorConnection *session = malloc(sizeof(ReactorConnection));
+    session->socket = client_socket;
+    session->addr = *client_addr;
+    session->is_session = true;
+    inet_ntop(AF_INET, &client_addr->sin_addr, session->client_ip, INET_ADDRSTRLEN);
+    session->client_port = ntohs(client_addr->sin_port);
+    session->ack_number = ack_number;
+    session->framed = framed;
+    proto_assembler_init(&session->frame);
+    pthread_mutex_init(&session->send_lock, NULL);
+    session->refs = 1; // The reactor's, dropped when the client disconnects
+
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+    event.data.ptr = session;
+    epoll_ctl(reactor_fd, EPOLL_CTL_ADD, client_socket, &event);
+}
+
+// Let the reactor deliver the connection's next message
+void rearm_client_session(ReactorConnection *session)
+{
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+    event.data.ptr = session;
+    epoll_ctl(reactor_fd, EPOLL_CTL_MOD, session->socket, &event);
+}
+
+// Drop a reference to a session. The socket is closed with the last one, so an async
+// completion still being sent never writes to a descriptor reused by a newer connection.
+void release_client_session(ReactorConnection *session)
+{
+    if (__atomic_sub_fetch(&session->refs, 1, __ATOMIC_ACQ_REL) == 0)
     {
-        printf("Error: Maximum number of storage servers reached.\n");
+        close(session->socket);
+        proto_assembler_free(&session->frame);
+        pthread_mutex_destroy(&session->send_lock);
+        free(session);
     }
 }
 
@@ -504,12 +1391,14 @@ void start_naming_server(int port)
     socklen_t client_addr_len = sizeof(client_addr);
 
     // Create socket for the naming server
-    server_socket = socket(AF_INET, SOCK_STREAM, 0);
+    server_socket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
     if (server_socket < 0){
         printf("socket error (ERROR CODE %d)\n",ERR_SOCK);
         perror("Error creating socket");
         exit(EXIT_FAILURE);
     }
+    int reuse = 1;
+    setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
 
     // Configure server address structure
     server_addr.sin_family = AF_INET;
@@ -526,7 +1415,7 @@ void start_naming_server(int port)
     }
 
     // Start listening for incoming connections
-    if (listen(server_socket, 10) < 0)
+    if (listen(server_socket, SOMAXCONN) < 0)
     {
         printf("socket error (ERROR CODE %d)\n",ERR_SOCK);
         perror("Error listening on socket");
@@ -537,29 +1426,211 @@ void start_naming_server(int port)
 
     cache = init_lru_cache(CACHE_SIZE);
     printf("Initialized LRU cache with capacity %d\n", CACHE_SIZE);
+    negative_cache = init_negative_cache(NEG_CACHE_TTL_MS);
     // for storing trail;
     //    register_storage_server("192.168.1.10", 9095, "Server 6");
     // register_storage_server("192.168.1.11", 8084, "Server 7");
     // register_storage_server("192.168.1.5", 9094, "Server 8");
 
-    // Main loop to accept and handle connections from storage servers
+    reactor_fd = epoll_create1(0);
+    if (reactor_fd < 0)
+    {
+        printf("socket error (ERROR CODE %d)\n",ERR_SOCK);
+        perror("Error creating epoll instance");
+        close(server_socket);
+        exit(EXIT_FAILURE);
+    }
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = NULL; // NULL marks the listening socket
+    epoll_ctl(reactor_fd, EPOLL_CTL_ADD, server_socket, &event);
+
+    // Reactor loop: accept everything pending and wait for each connection's first
+    // message without blocking, so a silent client never holds up the others
+    struct epoll_event events[MAX_EPOLL_EVENTS];
     while (1)
     {
-        // printf("hhhh");
-        // Accept connection from a storage server
-        int client_socket = accept(server_socket, (struct sockaddr *)&client_addr, &client_addr_len);
-        if (client_socket < 0)
+        int ready = epoll_wait(reactor_fd, events, MAX_EPOLL_EVENTS, -1);
+        if (ready < 0)
         {
-            printf("socket error (ERROR CODE %d)\n",ERR_SOCK);
-            perror("Error accepting connection");
+            if (errno != EINTR)
+            {
+                perror("Error waiting for connections");
+            }
             continue;
         }
 
-        // Handle the connected storage server
-        handle_storage_server(client_socket, &client_addr);
+        for (int i = 0; i < ready; i++)
+        {
+            ReactorConnection *conn = (ReactorConnection *)events[i].data.ptr;
+            if (conn == NULL)
+            {
+                // Accept connection from a storage server or client
+                while (1)
+                {
+                    client_addr_len = sizeof(client_addr);
+                    int client_socket = accept(server_socket, (struct sockaddr *)&client_addr, &client_addr_len);
+                    if (client_socket < 0)
+                    {
+                        if (errno != EAGAIN && errno != EWOULDBLOCK)
+                        {
+                            printf("socket error (ERROR CODE %d)\n",ERR_SOCK);
+                            perror("Error accepting connection");
+                        }
+                        break;
+                    }
+
+                    ReactorConnection *pending = malloc(sizeof(ReactorConnection));
+                    pending->socket = client_socket;
+                    pending->addr = client_addr;
+                    pending->is_session = false;
+                    pending->framed = false;
+                    proto_assembler_init(&pending->frame);
+                    event.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+                    event.data.ptr = pending;
+                    epoll_ctl(reactor_fd, EPOLL_CTL_ADD, client_socket, &event);
+                }
+                continue;
+            }
+
+            // Sockets stay blocking for the handlers, only the reactor's reads are non-blocking
+            if (conn->is_session)
+            {
+                // Taken before reading so a command is never left half consumed; with the
+                // pool empty the session stays parked until a worker frees a request
+                ClientRequest *request = acquire_request_for_session(conn);
+                if (!request)
+                {
+                    continue;
+                }
+                int bytes_read;
+                if (conn->framed)
+                {
+                    // A command may arrive over several reads, the session is re-armed until it is whole
+                    int status = proto_assembler_feed(&conn->frame, conn->socket);
+                    if (status == 0)
+                    {
+                        release_request(request);
+                        rearm_client_session(conn);
+                        continue;
+                    }
+                    bytes_read = status < 0 ? -1 : (int)conn->frame.header.length;
+                    if (status > 0 && (conn->frame.header.opcode != OP_COMMAND || bytes_read >= BUFFER_SIZE))
+                    {
+                        // Answered by a worker, which holds the session's send lock for it
+                        proto_assembler_reset(&conn->frame);
+                        request->kind = REQUEST_REJECT;
+                        request->request[0] = '\0';
+                        request->client_socket = conn->socket;
+                        strcpy(request->client_ip, conn->client_ip);
+                        request->client_port = conn->client_port;
+                        request->ack_number = conn->ack_number;
+                        request->request_id = 0;
+                        request->framed = conn->framed;
+                        request->session = conn;
+                        enqueue_request(request);
+                        continue;
+                    }
+                    if (status > 0)
+                    {
+                        memcpy(request->request, conn->frame.payload, bytes_read);
+                        proto_assembler_reset(&conn->frame);
+                    }
+                }
+                else
+                {
+                    // Read the command straight into a pooled request
+                    bytes_read = recv(conn->socket, request->request, sizeof(request->request) - 1, MSG_DONTWAIT);
+                    if (bytes_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                    {
+                        release_request(request);
+                        rearm_client_session(conn);
+                        continue;
+                    }
+                }
+                if (bytes_read <= 0)
+                {
+                    if (bytes_read < 0 && errno != 0)
+                    {
+                        perror("Error receiving data");
+                    }
+                    release_request(request);
+                    printf("Client %s:%d disconnected.\n", conn->client_ip, conn->client_port);
+                    purge_async_writes_for_session(conn);
+                    epoll_ctl(reactor_fd, EPOLL_CTL_DEL, conn->socket, NULL);
+                    release_client_session(conn); // Closes the socket unless a completion is being sent on it
+                    continue;
+                }
+
+                // One command is one work item, the session stays disarmed until it is handled
+                request->kind = REQUEST_COMMAND;
+                request->request[bytes_read] = '\0';
+                request->client_socket = conn->socket;
+                strcpy(request->client_ip, conn->client_ip);
+                request->client_port = conn->client_port;
+                request->ack_number = conn->ack_number;
+                request->request_id = allocate_request_id();
+                request->framed = conn->framed;
+                request->timestamp = time(NULL);
+                request->session = conn;
+                enqueue_request(request);
+                continue;
+            }
+
+            // Framed peers open with the protocol's magic byte, text peers with a plain message.
+            // The message goes to a worker in a pooled request, taken first as for sessions.
+            ClientRequest *request = acquire_request_for_session(conn);
+            if (!request)
+            {
+                continue;
+            }
+            unsigned char first;
+            int bytes_read = recv(conn->socket, &first, 1, MSG_PEEK | MSG_DONTWAIT);
+            if (bytes_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            {
+                release_request(request);
+                rearm_client_session(conn);
+                continue;
+            }
+            if (bytes_read > 0 && proto_is_frame_start(&first, 1))
+            {
+                conn->framed = true;
+                int status = proto_assembler_feed(&conn->frame, conn->socket);
+                if (status == 0)
+                {
+                    release_request(request);
+                    rearm_client_session(conn);
+                    continue; // Rest of the first frame still to come
+                }
+                bytes_read = status;
+            }
+
+            // A new connection leaves the reactor once its first message is in
+            epoll_ctl(reactor_fd, EPOLL_CTL_DEL, conn->socket, NULL);
+            if (bytes_read <= 0)
+            {
+                release_request(request);
+                close(conn->socket); // Closed before saying anything
+                proto_assembler_free(&conn->frame);
+                free(conn);
+                continue;
+            }
+            request->kind = REQUEST_FIRST_MESSAGE;
+            request->request[0] = '\0';
+            request->client_socket = conn->socket;
+            inet_ntop(AF_INET, &conn->addr.sin_addr, request->client_ip, INET_ADDRSTRLEN);
+            request->client_port = ntohs(conn->addr.sin_port);
+            request->ack_number = 0;
+            request->request_id = 0;
+            request->framed = conn->framed;
+            request->timestamp = time(NULL);
+            request->session = conn;
+            enqueue_request(request);
+        }
     }
 
     // Close the naming server socket (not reachable in this example)
+    close(reactor_fd);
     close(server_socket);
 }
 
@@ -610,10 +1681,11 @@ void send_metadata_to_replica(const char *metadata, const char *replica_ip, int
     close(socket_fd);
 }
 // Returns 1 on success, 0 on failure
-int connect_and_send_to_ss(char* ip, int port, char* message) {
+int connect_and_send_to_ss(char* ip, int port, char* message, unsigned long long request_id) {
     int sock = 0;
     struct sockaddr_in serv_addr;
     char buffer[BUFFER_SIZE] = {0};
+    FrameHeader header;
     int status = 0;
 
     // Create socket
@@ -623,115 +1695,334 @@ int connect_and_send_to_ss(char* ip, int port, char* message) {
         return 0;
     }
 
-    serv_addr.sin_family = AF_INET;
-    serv_addr.sin_port = htons(port);
-
-    // Convert IPv4 and IPv6 addresses from text to binary form
-    if (inet_pton(AF_INET, ip, &serv_addr.sin_addr) <= 0) {
-        printf("Invalid address/ Address not supported\n");
-        close(sock);
-        return 0;
+    serv_addr.sin_family = AF_INET;
+    serv_addr.sin_port = htons(port);
+
+    // Convert IPv4 and IPv6 addresses from text to binary form
+    if (inet_pton(AF_INET, ip, &serv_addr.sin_addr) <= 0) {
+        printf("Invalid address/ Address not supported\n");
+        close(sock);
+        return 0;
+    }
+
+    // Connect to the storage server
+    if (connect(sock, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0) {
+        // printf("Connection Failed\n");
+        printf("socket connection error (ERROR CODE %d)\n",ERR_SOCK_CONNECT);
+        close(sock);
+        return 0;
+    }
+
+    // Send the message, the SS greets every connection with its banner first
+    if (proto_expect_banner(sock) < 0 ||
+        proto_send_frame(sock, OP_COMMAND, 0, request_id, message, strlen(message)) < 0) {
+        // printf("Send failed\n");
+        printf("socket send error (ERROR CODE %d)\n",ERR_SOCK_SEND);
+        close(sock);
+        return 0;
+    }
+
+    // Wait for response
+    int bytes_read = proto_recv_frame(sock, &header, buffer, BUFFER_SIZE - 1);
+    if (bytes_read < 0 || header.opcode != OP_RESULT) {
+        printf("Read failed\n");
+        status = 0;
+    } else {
+        ProtoReader reader;
+        char text[BUFFER_SIZE];
+        proto_reader_init(&reader, buffer, bytes_read);
+        int ss_status = proto_get_u16(&reader);
+        proto_get_rest(&reader, text, sizeof(text));
+        printf("Response from SS: %s\n", text);
+        status = !reader.error && ss_status == PROTO_STATUS_OK;
+    }
+
+    // Close the connection
+    close(sock);
+    return status;
+}
+AsyncWriteRegistry async_writes;
+
+void init_async_write_registry()
+{
+    memset(async_writes.by_id, 0, sizeof(async_writes.by_id));
+    memset(async_writes.by_name, 0, sizeof(async_writes.by_name));
+    async_writes.count = 0;
+    async_writes.accepted = 0;
+    async_writes.next_reap_us = 0;
+    pthread_mutex_init(&async_writes.lock, NULL);
+}
+
+static unsigned int async_write_name_bucket(const char *filename)
+{
+    return cache_hash(filename) & (ASYNC_WRITE_BUCKETS - 1);
+}
+
+// Unlink entry from both chains, caller must hold async_writes.lock
+static void unlink_async_write(PendingAsyncWrite *entry)
+{
+    PendingAsyncWrite **link = &async_writes.by_id[entry->request_id & (ASYNC_WRITE_BUCKETS - 1)];
+    while (*link != entry)
+    {
+        link = &(*link)->id_next;
+    }
+    *link = entry->id_next;
+
+    link = &async_writes.by_name[async_write_name_bucket(entry->filename)];
+    while (*link != entry)
+    {
+        link = &(*link)->name_next;
+    }
+    *link = entry->name_next;
+    async_writes.count--;
+    if (entry->accepted)
+    {
+        async_writes.accepted--;
+    }
+}
+
+// Drop routed writes whose storage server never accepted them, say because the client
+// could not reach it. Scans at most once per timeout, caller must hold async_writes.lock.
+static void reap_unaccepted_async_writes(long now)
+{
+    if (now < async_writes.next_reap_us)
+    {
+        return;
+    }
+    async_writes.next_reap_us = now + ASYNC_WRITE_ACCEPT_TIMEOUT_MS * 1000L;
+
+    for (int i = 0; i < ASYNC_WRITE_BUCKETS; i++)
+    {
+        PendingAsyncWrite *entry = async_writes.by_id[i];
+        while (entry)
+        {
+            PendingAsyncWrite *next = entry->id_next;
+            if (!entry->accepted && entry->deadline_us <= now)
+            {
+                printf("Dropping async write %llu of %s, never accepted by its storage server\n",
+                       entry->request_id, entry->filename);
+                unlink_async_write(entry);
+                release_client_session(entry->session); // Never the last, the reactor holds one
+                free(entry);
+            }
+            entry = next;
+        }
+    }
+}
+
+// Remember which session is waiting on an async WRITE of filename. Unless accepted is
+// set, it only counts as outstanding once its storage server confirms it queued the write.
+void register_async_write(unsigned long long request_id, const char *filename, ReactorConnection *session,
+                          bool accepted)
+{
+    PendingAsyncWrite *entry = (PendingAsyncWrite *)malloc(sizeof(PendingAsyncWrite));
+    if (!entry)
+    {
+        perror("Failed to record async write");
+        return;
+    }
+    entry->request_id = request_id;
+    strncpy(entry->filename, filename, sizeof(entry->filename) - 1);
+    entry->filename[sizeof(entry->filename) - 1] = '\0';
+    entry->session = session;
+    __atomic_add_fetch(&session->refs, 1, __ATOMIC_RELAXED); // Dropped once the completion is sent
+    entry->accepted = accepted;
+    long now = monotonic_us();
+    entry->deadline_us = now + ASYNC_WRITE_ACCEPT_TIMEOUT_MS * 1000L;
+
+    unsigned int id_bucket = request_id & (ASYNC_WRITE_BUCKETS - 1);
+    unsigned int name_bucket = async_write_name_bucket(entry->filename);
+    pthread_mutex_lock(&async_writes.lock);
+    reap_unaccepted_async_writes(now);
+    entry->id_next = async_writes.by_id[id_bucket];
+    async_writes.by_id[id_bucket] = entry;
+    entry->name_next = async_writes.by_name[name_bucket];
+    async_writes.by_name[name_bucket] = entry;
+    async_writes.count++;
+    if (accepted)
+    {
+        async_writes.accepted++;
+    }
+    pthread_mutex_unlock(&async_writes.lock);
+}
+
+// The storage server queued the write with this request ID. Unknown IDs are ignored,
+// the completion may have been handled first since it arrives on its own connection.
+void confirm_async_write(unsigned long long request_id)
+{
+    pthread_mutex_lock(&async_writes.lock);
+    PendingAsyncWrite *entry = async_writes.by_id[request_id & (ASYNC_WRITE_BUCKETS - 1)];
+    while (entry && entry->request_id != request_id)
+    {
+        entry = entry->id_next;
     }
-
-    // Connect to the storage server
-    if (connect(sock, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0) {
-        // printf("Connection Failed\n");
-        printf("socket connection error (ERROR CODE %d)\n",ERR_SOCK_CONNECT);
-        close(sock);
-        return 0;
+    if (entry && !entry->accepted)
+    {
+        entry->accepted = true;
+        async_writes.accepted++;
     }
+    pthread_mutex_unlock(&async_writes.lock);
+}
 
-    // Send the message
-    if (send(sock, message, strlen(message), 0) < 0) {
-        // printf("Send failed\n");
-        printf("socket send error (ERROR CODE %d)\n",ERR_SOCK_SEND);
-        close(sock);
-        return 0;
+// Remove and return the write with this request ID, NULL if there is none.
+// The caller frees the entry.
+PendingAsyncWrite *take_async_write_by_id(unsigned long long request_id)
+{
+    pthread_mutex_lock(&async_writes.lock);
+    PendingAsyncWrite *entry = async_writes.by_id[request_id & (ASYNC_WRITE_BUCKETS - 1)];
+    while (entry && entry->request_id != request_id)
+    {
+        entry = entry->id_next;
+    }
+    if (entry)
+    {
+        unlink_async_write(entry);
     }
+    pthread_mutex_unlock(&async_writes.lock);
+    return entry;
+}
 
-    // Wait for response
-    int bytes_read = read(sock, buffer, BUFFER_SIZE);
-    if (bytes_read < 0) {
-        printf("Read failed\n");
-        status = 0;
-    } else {
-        buffer[bytes_read] = '\0';
-        printf("Response from SS: %s\n", buffer);
-        
-        // Check if response indicates success
-        if (strstr(buffer, "Success") != NULL) {
-            status = 1;
+// Remove and return the oldest outstanding write of filename, NULL if there is none.
+// Used while storage server completions name only the file.
+PendingAsyncWrite *take_async_write_by_name(const char *filename)
+{
+    PendingAsyncWrite *oldest = NULL;
+    pthread_mutex_lock(&async_writes.lock);
+    for (PendingAsyncWrite *entry = async_writes.by_name[async_write_name_bucket(filename)]; entry; entry = entry->name_next)
+    {
+        if (strcmp(entry->filename, filename) == 0 && (!oldest || entry->request_id < oldest->request_id))
+        {
+            oldest = entry;
         }
     }
+    if (oldest)
+    {
+        unlink_async_write(oldest);
+    }
+    pthread_mutex_unlock(&async_writes.lock);
+    return oldest;
+}
 
-    // Close the connection
-    close(sock);
-    return status;
+// Forget the writes of a session that has gone away, dropping their references to it
+int purge_async_writes_for_session(ReactorConnection *session)
+{
+    int purged = 0;
+    pthread_mutex_lock(&async_writes.lock);
+    for (int i = 0; i < ASYNC_WRITE_BUCKETS; i++)
+    {
+        PendingAsyncWrite *entry = async_writes.by_id[i];
+        while (entry)
+        {
+            PendingAsyncWrite *next = entry->id_next;
+            if (entry->session == session)
+            {
+                unlink_async_write(entry);
+                release_client_session(session); // Never the last, the caller still holds one
+                free(entry);
+                purged++;
+            }
+            entry = next;
+        }
+    }
+    pthread_mutex_unlock(&async_writes.lock);
+    return purged;
 }
-void notify_client_of_completion(const char *filename) {
-    char client_ip[INET_ADDRSTRLEN];
-    int client_port;int client_sock_fd;
-
-    // Search the log file for the client info
-    if (find_client_info_from_log(filename, client_ip, &client_port, &client_sock_fd) == 0) {
-        printf("Found client for async write completion: IP: %s, Port: %d client_sock_fd: %d\n", client_ip, client_port,client_sock_fd);
-
-        // Now send acknowledgment to the client
-        // int client_sock = socket(AF_INET, SOCK_STREAM, 0);
-        // struct sockaddr_in client_addr;
-        // client_addr.sin_family = AF_INET;
-        // client_addr.sin_port = htons(client_port);
-        // inet_pton(AF_INET, client_ip, &client_addr.sin_addr);
-
-        // if (connect(client_sock, (struct sockaddr*)&client_addr, sizeof(client_addr)) == 0) {
-            char ack_message[100];
-            snprintf(ack_message, sizeof(ack_message), "Async write completed for file: %s", filename);
-            printf("ACK %s\n",ack_message);
-            send(client_sock_fd, ack_message, strlen(ack_message), 0);
-            printf("Acknowledgment sent to client: %s:%d\n", client_ip, client_port);
-        // } else { 
-        //     perror("Error connecting to client");
-        // }
 
-        // close(client_sock_fd);
-    } else {
-        printf("Client info not found in log for file: %s\n", filename);
+// Pass a storage server's async write completion on to the client waiting for it.
+// Completions from storage servers that do not send the request ID are matched by file name.
+void notify_client_of_completion(unsigned long long request_id, const char *filename, int status,
+                                 const char *result)
+{
+    PendingAsyncWrite *pending = request_id ? take_async_write_by_id(request_id) : NULL;
+    if (!pending)
+    {
+        pending = take_async_write_by_name(filename);
     }
+    if (!pending)
+    {
+        printf("No outstanding async write for file: %s\n", filename);
+        return;
+    }
+    ReactorConnection *session = pending->session;
+    printf("Found client for async write completion: IP: %s, Port: %d client_sock_fd: %d\n",
+           session->client_ip, session->client_port, session->socket);
+
+    unsigned char payload[BUFFER_SIZE];
+    ProtoWriter writer;
+    proto_writer_init(&writer, payload, sizeof(payload));
+    proto_put_u16(&writer, status);
+    proto_put_str(&writer, filename);
+    proto_put_bytes(&writer, result, strlen(result));
+    pthread_mutex_lock(&session->send_lock);
+    proto_send_compat(session->socket, session->framed, OP_ASYNC_COMPLETE, 0,
+                      pending->request_id, writer.data, writer.len);
+    pthread_mutex_unlock(&session->send_lock);
+    printf("Acknowledgment sent to client: %s:%d\n", session->client_ip, session->client_port);
+    release_client_session(session);
+    free(pending);
 }
+// Handle a new connection's first message on a worker. A framed message is already
+// in conn's frame, a text one is still waiting in the socket.
+void handle_first_message(ReactorConnection *conn)
+{
+    if (conn->framed)
+    {
+        handle_storage_server(conn->socket, &conn->addr, &conn->frame.header, conn->frame.payload, true);
+    }
+    else
+    {
+        // Translate the text message so both kinds of peer share one code path
+        char buffer[BUFFER_SIZE];
+        char payload[BUFFER_SIZE + 256];
+        FrameHeader header;
+        ProtoWriter writer;
+        int bytes_read = recv(conn->socket, buffer, sizeof(buffer) - 1, MSG_DONTWAIT);
+        buffer[bytes_read > 0 ? bytes_read : 0] = '\0';
+        proto_writer_init(&writer, payload, sizeof(payload));
+        if (bytes_read <= 0 || proto_text_to_frame(buffer, &header, &writer) < 0)
+        {
+            close(conn->socket);
+        }
+        else
+        {
+            handle_storage_server(conn->socket, &conn->addr, &header, payload, false);
+        }
+    }
+    proto_assembler_free(&conn->frame);
+    free(conn);
+}
+
 // Function to handle connections from storage servers
-// Function to handle connections from storage servers
-void handle_storage_server(int client_socket, struct sockaddr_in *client_addr)
+// Dispatches a new connection on its first message, already read into a frame by the reactor
+void handle_storage_server(int client_socket, struct sockaddr_in *client_addr, const FrameHeader *header,
+                           const char *payload, bool framed)
 {
-    char buffer[BUFFER_SIZE];
     char metadata[256];
-    char paths[MAX_PATHS][256];
     int port, client_port;
     int num_paths = 0;
+    ProtoReader reader;
+    proto_reader_init(&reader, payload, header->length);
 
     // Get client IP and port
     char client_ip[INET_ADDRSTRLEN];
     inet_ntop(AF_INET, &(client_addr->sin_addr), client_ip, INET_ADDRSTRLEN);
     port = ntohs(client_addr->sin_port);
 
-    // Receive message (metadata, client port, and accessible paths)
-    memset(buffer, 0, sizeof(buffer));
-    recv(client_socket, buffer, sizeof(buffer) - 1, 0);
-    if (strncmp(buffer, "ASYNCWRITE_COMPLETE", 18) == 0) {
+    // The message is metadata, client port, and accessible paths for a storage server
+    if (header->opcode == OP_ASYNC_COMPLETE) {
         char filename[256];
-        char client_ip[INET_ADDRSTRLEN];
-        int clientt_portt;
         char result[256];
         
         // Parse the completion message
-        sscanf(buffer, "ASYNCWRITE_COMPLETE %s %s %d %[^\n]", 
-               filename, client_ip, &clientt_portt, result);
+        int status = proto_get_u16(&reader);
+        proto_get_str(&reader, filename, sizeof(filename));
+        proto_get_rest(&reader, result, sizeof(result));
 
-        printf("async write done %s\n",buffer);
-        printf("file : %s client ip: %s client port: %d\n",filename,client_ip,clientt_portt);
+        printf("async write done for %s (request %llu, status %d): %s\n",
+               filename, (unsigned long long)header->request_id, status, result);
         
         // Forward the completion message to the client
-        // forward_write_completion_to_client(client_ip, clientt_portt, filename, result);
-        notify_client_of_completion(filename);
+        notify_client_of_completion(header->request_id, filename, status, result);
         
         // Send acknowledgment back to storage server
         // const char *ack = "ASYNC WRITE Completion notification received";
@@ -739,243 +2030,341 @@ void handle_storage_server(int client_socket, struct sockaddr_in *client_addr)
         close(client_socket);
         return;
     }
-    else if (strncmp(buffer, "Metadata", 8) != 0)
+    else if (header->opcode != OP_REGISTER)
     {
-        ClientRequest new_request;
-        new_request.client_socket = client_socket;
-        strcpy(new_request.client_ip, client_ip);
-        new_request.client_port = port;
-        new_request.ack_number = next_ack_number++;
-        new_request.timestamp = time(NULL);
-        strcpy(new_request.request, buffer);
+        unsigned long long ack_number = allocate_request_id();
 
         // Send ACK number to client
-        char ack_message[50];
-        sprintf(ack_message, "ACK:%d", new_request.ack_number);
-        send(client_socket, ack_message, strlen(ack_message), 0);
-
-        // Add request to queue
-        enqueue_request(new_request);
-        // handle_client(client_socket, client_ip, port);
+        unsigned char ack_payload[8];
+        ProtoWriter ack;
+        proto_writer_init(&ack, ack_payload, sizeof(ack_payload));
+        proto_put_u64(&ack, ack_number);
+        proto_send_compat(client_socket, framed, OP_ACK, 0, 0, ack.data, ack.len);
+
+        // The session goes back to the reactor, each command becomes its own work item
+        add_client_session(client_socket, client_addr, ack_number, framed);
         return;
     }
 
-    // Parse the received message (Assume the format: "Metadata: <metadata>, Client Port: <client_port>, Paths: <path1> <path2> ...")
-    sscanf(buffer, "Metadata: %[^,], Client Port: %d", metadata, &client_port);
-
-    // Extract paths
-    char *paths_str = strstr(buffer, "Paths:") + 6;
-    char *token = strtok(paths_str, " ");
-    while (token && num_paths < MAX_PATHS)
+    // Registration: client port, metadata, then one string per accessible path
+    client_port = proto_get_u16(&reader);
+    proto_get_str(&reader, metadata, sizeof(metadata));
+
+    // Extract paths, as many as the frame carries. The storage server sends paths up
+    // to PATH_MAX; one too long for the namespace is skipped, the rest still register.
+    int capacity = 0;
+    int skipped = 0;
+    char **paths = NULL;
+    char path[PATH_MAX];
+    while (proto_remaining(&reader) > 0 && proto_get_str(&reader, path, sizeof(path)))
+    {
+        if (strlen(path) >= TRIE_MAX_PATH)
+        {
+            printf("Skipping path longer than %d bytes from storage server %s (ERROR CODE %d)\n",
+                   TRIE_MAX_PATH - 1, client_ip, ERR_INVALID_COMMAND);
+            skipped++;
+            continue;
+        }
+        if (num_paths == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 64;
+            paths = realloc(paths, capacity * sizeof(char *));
+        }
+        paths[num_paths++] = strdup(path);
+    }
+    if (reader.error)
+    {
+        printf("Malformed registration from storage server %s, %d paths read\n", client_ip, num_paths);
+    }
+    if (skipped > 0)
     {
-        strcpy(paths[num_paths], token);
-        token = strtok(NULL, " ");
-        num_paths++;
+        printf("%d paths from storage server %s were too long to register\n", skipped, client_ip);
     }
 
     printf("Received metadata: %s, Client Port: %d, %d accessible paths from storage server %s\n", metadata, client_port, num_paths, client_ip);
     log_storage_server_registration(client_ip, port, client_port, metadata, num_paths);
 
     // Register the storage server
-    const char *path_list[MAX_PATHS];
+    int ss_id = register_storage_server(client_ip, port, client_port, metadata, (const char **)paths, num_paths);
     for (int i = 0; i < num_paths; i++)
     {
-        path_list[i] = paths[i];
+        free(paths[i]);
+    }
+    free(paths);
+    if (ss_id == -1)
+    {
+        printf("Maximum storage servers reached (ERROR CODE %d)\n", ERR_MAX_SS_REACHED);
+        proto_reply(client_socket, framed, OP_RESULT, 0, 0, ERR_MAX_SS_REACHED, "Maximum storage servers reached");
+        close(client_socket);
+        return;
     }
-    register_storage_server(client_ip, port, client_port, metadata, path_list, num_paths);
     // Add to connection manager and start thread
-    int conn_index = add_ss_connection(client_socket, client_ip, port, client_port);
+    int conn_index = add_ss_connection(client_socket, client_ip, port, client_port, ss_id, framed);
     printf("Added storage server connection at index %d\n", conn_index);
     if (conn_index != -1)
     {
+        // Send acknowledgment before the connection thread starts reading
+        const char *ack_message = "Storage server registered successfully";
+        proto_reply(client_socket, framed, OP_RESULT, 0, 0, PROTO_STATUS_OK, ack_message);
+
         int *thread_arg = malloc(sizeof(int));
         *thread_arg = conn_index;
         pthread_create(&ss_manager.connections[conn_index].thread,
                        NULL,
                        handle_ss_connection,
                        thread_arg);
-
-        // Send acknowledgment
-        const char *ack_message = "Storage server registered successfully";
-        send(client_socket, ack_message, strlen(ack_message), 0);
     }
     else
     {
+        // Registered but unreachable, keep lookups from resolving to it
+        storage_servers[ss_id].is_active = false;
+        cache_remove_server(cache, ss_id);
         const char *error_message = "Maximum storage servers reached";
-        send(client_socket, error_message, strlen(error_message), 0);
+        proto_reply(client_socket, framed, OP_RESULT, 0, 0, ERR_MAX_SS_REACHED, error_message);
         close(client_socket);
     }
-    // Send acknowledgment to the storage server
-    const char *ack_message = "Storage server registered successfully";
-    send(client_socket, ack_message, strlen(ack_message), 0);
 
     // Close connection
     // close(client_socket);
 
 }
 
-void handle_client(int client_socket, const char *client_ip, int port)
+// Handle one command from a client session, buffer holds the received text
+// Replies take the session's send lock for one frame only, so an async completion
+// never lands inside a reply while forwards to storage servers run unlocked
+static void reply_to_session(ReactorConnection *session, bool framed, uint8_t opcode,
+                             uint64_t request_id, uint16_t status, const char *text)
 {
-    char buffer[BUFFER_SIZE];
-    int bytes_received;
-
-
-    while ((bytes_received = recv(client_socket, buffer, sizeof(buffer) - 1, 0)) > 0)
-    {
-        buffer[bytes_received] = '\0'; // Null-terminate the received string
-        char command2[8192];
-        strcpy(command2, buffer);
-        //printf("Command2 - %s\n", command2);
-
-        printf("Received command from client %s:%d: %s\n", client_ip, port, buffer);
-        log_client_request(client_ip, port,client_socket, buffer, next_ack_number - 1);
-        char *inst = strtok(buffer, " ");
-        char *path = strtok(NULL, " ");
-        char * path2;
-        if(strncmp(inst, "COPY", 4) == 0){
-            path2 = strtok(NULL," ");
-            StorageServer * retrieved_ss_source = get_ss_ipandport(path);
-            StorageServer * retrieved_ss_destination = get_ss_ipandport(path2);
-            if(!retrieved_ss_source || !retrieved_ss_destination){
-                printf("Path not found\n");
-                char mssg[BUFFER_SIZE];
-                strcpy(mssg, "Path not found");
-                send(client_socket, mssg, strlen(mssg), 0);
-                continue;
-            }
-            
-            char *source = retrieved_ss_source->ip_address;
-            int source_port = retrieved_ss_source->client_port;
-            int destination_port = retrieved_ss_destination->client_port;
-            char *destination = retrieved_ss_destination->ip_address;
-        char *inst2 = strtok(command2, " ");
-        path = strtok(NULL, " ");
-        path2 = strtok(NULL, " ");
-            memset(buffer, 0, sizeof(buffer));
-            sprintf(buffer, "COPY %s %s %s %d", path, path2, destination, destination_port);
-            int success =connect_and_send_to_ss(source, source_port, buffer);
-            if(success){
-                send(client_socket, "Successful Copy", strlen("Success"), 0);
-            }
-            continue;
-        }
-        if(strncmp(inst,"DELETE", 6) == 0){
-                   
+    pthread_mutex_lock(&session->send_lock);
+    proto_reply(session->socket, framed, opcode, 0, request_id, status, text);
+    pthread_mutex_unlock(&session->send_lock);
+}
 
-            StorageServer * retrieved_ss_source = get_ss_ipandport(path);
-            if(!retrieved_ss_source){
-                // printf("Path not found\n");
-                printf("Path not found (ERROR CODE %d)\n",ERR_PATH_NOT_FOUND);
-                char mssg[BUFFER_SIZE];
-                strcpy(mssg, "Path not found");
-                send(client_socket, mssg, strlen(mssg), 0);
-                continue;
-            }
-            char *source = retrieved_ss_source->ip_address;
-            int source_port = retrieved_ss_source->client_port;
-            char *inst2 = strtok(command2, " ");
-        path = strtok(NULL, " ");
+static void send_to_session(ReactorConnection *session, bool framed, uint8_t opcode,
+                            uint64_t request_id, const void *payload, size_t length)
+{
+    pthread_mutex_lock(&session->send_lock);
+    proto_send_compat(session->socket, framed, opcode, 0, request_id, payload, length);
+    pthread_mutex_unlock(&session->send_lock);
+}
+
+void handle_client_command(int client_socket, const char *client_ip, int port, char *buffer,
+                           unsigned long long ack_number, unsigned long long request_id, bool framed,
+                           ReactorConnection *session)
+{
+    char command2[8192];
+    strcpy(command2, buffer);
+    //printf("Command2 - %s\n", command2);
+
+    printf("Received command from client %s:%d: %s\n", client_ip, port, buffer);
+    log_client_request(client_ip, port,client_socket, buffer, ack_number, request_id);
+    // strtok_r keeps each worker's position in its own save pointer
+    char *saveptr;
+    char *command_saveptr;
+    char *inst = strtok_r(buffer, " ", &saveptr);
+    if (!inst)
+    {
+        return; // Blank line
+    }
+    char *path = strtok_r(NULL, " ", &saveptr);
+    char * path2;
+    if(strncmp(inst, "COPY", 4) == 0){
+        path2 = strtok_r(NULL, " ", &saveptr);
+        SSLocation retrieved_ss_source = get_ss_ipandport(path);
+        SSLocation retrieved_ss_destination = get_ss_ipandport(path2);
+        if(retrieved_ss_source.ss_id == -1 || retrieved_ss_destination.ss_id == -1){
+            printf("Path not found\n");
+            char mssg[BUFFER_SIZE];
+            strcpy(mssg, "Path not found");
+            reply_to_session(session, framed, OP_RESULT, request_id, ERR_PATH_NOT_FOUND, mssg);
+            return;
+        }
         
-            memset(buffer, 0, sizeof(buffer));
-            sprintf(buffer, " DELETE %s %s %d", path, source, source_port);
-            int success =connect_and_send_to_ss(source, source_port, buffer);
-            if(success){
-                send(client_socket, "Successful Create", strlen("Successful Create"), 0);
-            }
-            // if(recv(client_socket, buffer, sizeof(buffer), 0) > 0){
-            //     printf("Buffer: %s\n", buffer);
-            // }
-            continue;
-            }
-            if(strncmp(inst,"CREATE",6) == 0){
-                    char* name = strtok(NULL," ");
-            char* flag = strtok(NULL, " ");
-            StorageServer * retrieved_ss_source = get_ss_ipandport(path);
-            if(!retrieved_ss_source){
-                // printf("Path not found\n");
-                printf("Path not found (ERROR CODE %d)\n",ERR_PATH_NOT_FOUND);
-                char mssg[BUFFER_SIZE];
-                strcpy(mssg, "Path not found");
-                send(client_socket, mssg, strlen(mssg), 0);
-                continue;
-            }
-            char *source = retrieved_ss_source->ip_address;
-            int source_port = retrieved_ss_source->client_port;
-            char *inst2 = strtok(command2, " ");
-        path = strtok(NULL, " ");
-        name = strtok(NULL, " ");
-        flag = strtok(NULL, " ");
-            memset(buffer, 0, sizeof(buffer));
-            char full_name[512]; // Make sure this is large enough to hold the full path
-            if (path != NULL && name != NULL) {
-                snprintf(full_name, sizeof(full_name), "%s/%s", path, name);
-                printf("Full name: %s\n", full_name);
-            } 
-            // else {
-                // printf("Error: Path or Name is NULL\n");
-            // }
-            if (retrieved_ss_source != NULL) {
-                StorageServer ss = insert_path(*retrieved_ss_source, full_name);
-                *retrieved_ss_source = ss; // Copy the modified value back to the original
-            }
-            sprintf(buffer, "CREATE %s %s %s %s %d", path, name, flag, source, source_port);
-            int success =connect_and_send_to_ss(source, source_port, buffer);
-            if(success){
-                send(client_socket, "Successful Create", strlen("Successful Create"), 0);
-            }
-            // if(recv(client_socket, buffer, sizeof(buffer), 0) > 0){
-            //     printf("Buffer: %s\n", buffer);
-            // }
-            
-            continue;
-            }
-       
-        if (!path)
-        {
-            printf("Path not given.\n");
-            char *message = "Path not given.";
-            send(client_socket, message, strlen(message), 0);
-            continue;
-            // return;
+        int destination_port = retrieved_ss_destination.client_port;
+        char *destination = retrieved_ss_destination.ip_address;
+    char *inst2 = strtok_r(command2, " ", &command_saveptr);
+    path = strtok_r(NULL, " ", &command_saveptr);
+    path2 = strtok_r(NULL, " ", &command_saveptr);
+        memset(buffer, 0, BUFFER_SIZE);
+        sprintf(buffer, "COPY %s %s %s %d", path, path2, destination, destination_port);
+        int success =forward_to_ss(&retrieved_ss_source, buffer, request_id);
+        if(success){
+            reply_to_session(session, framed, OP_RESULT, request_id, PROTO_STATUS_OK, "Successful Copy");
+        } else {
+            reply_to_session(session, framed, OP_RESULT, request_id, ERR_FAILED_TO_COPY, "Copy failed");
         }
-        printf("Instruction: %s, Path: %s.\n", inst, path);
-        bool copy_f = 0;
-        StorageServer *retrieved_ss_source;
-        StorageServer *retrieved_ss_destination;
-        // Acknowledge based on the command type
-        char *source;
-        char *destination;
-            StorageServer *retrieved_ss = get_ss_ipandport(path);
-            char *retrieved_ss_ip = retrieved_ss->ip_address;
-            if (!retrieved_ss_ip)
-            {
-                // printf("Path not found\n");
-                printf("Path not found (ERROR CODE %d)\n",ERR_PATH_NOT_FOUND);
-                char mssg[BUFFER_SIZE];
-                strcpy(mssg, "Path not found");
-                send(client_socket, mssg, strlen(mssg), 0);
-                // return;
-                continue;
-                // return;
-            }
-            int retrieved_ss_port = retrieved_ss->client_port;
-            printf("Retrieved storage server IP: %s, Port: %d\n", retrieved_ss_ip, retrieved_ss_port);
-            char message[BUFFER_SIZE];
-            sprintf(message, "Storage Server IP: %s, Port: %d", retrieved_ss_ip, retrieved_ss_port);
-            send(client_socket, message, strlen(message), 0);
+        return;
+    }
+    if(strncmp(inst,"DELETE", 6) == 0){
+               
+
+        SSLocation retrieved_ss_source = get_ss_ipandport(path);
+        if(retrieved_ss_source.ss_id == -1){
+            // printf("Path not found\n");
+            printf("Path not found (ERROR CODE %d)\n",ERR_PATH_NOT_FOUND);
+            char mssg[BUFFER_SIZE];
+            strcpy(mssg, "Path not found");
+            reply_to_session(session, framed, OP_RESULT, request_id, ERR_PATH_NOT_FOUND, mssg);
+            return;
+        }
+        char *source = retrieved_ss_source.ip_address;
+        int source_port = retrieved_ss_source.client_port;
+        char *inst2 = strtok_r(command2, " ", &command_saveptr);
+    path = strtok_r(NULL, " ", &command_saveptr);
     
+        memset(buffer, 0, BUFFER_SIZE);
+        sprintf(buffer, " DELETE %s %s %d", path, source, source_port);
+        int success =forward_to_ss(&retrieved_ss_source, buffer, request_id);
+        if(success){
+            // Drops the path and, for a directory, everything the server registered below it
+            char key[TRIE_MAX_PATH];
+            trie_canonical_path(path, key, sizeof(key));
+            remove_subtree_from_servers(key, retrieved_ss_source.ss_id);
+            int dropped = cache_remove_prefix(cache, key);
+            printf("Invalidated %d cache entries under %s\n", dropped, key);
+            reply_to_session(session, framed, OP_RESULT, request_id, PROTO_STATUS_OK, "Successful Delete");
+        } else {
+            reply_to_session(session, framed, OP_RESULT, request_id, ERR_FAILED_TO_DELETE, "Delete failed");
+        }
+        // if(recv(client_socket, buffer, sizeof(buffer), 0) > 0){
+        //     printf("Buffer: %s\n", buffer);
+        // }
+        return;
+        }
+        if(strncmp(inst,"CREATE",6) == 0){
+                char* name = strtok_r(NULL, " ", &saveptr);
+        char* flag = strtok_r(NULL, " ", &saveptr);
+        SSLocation retrieved_ss_source = get_ss_ipandport(path);
+        if(retrieved_ss_source.ss_id == -1){
+            // printf("Path not found\n");
+            printf("Path not found (ERROR CODE %d)\n",ERR_PATH_NOT_FOUND);
+            char mssg[BUFFER_SIZE];
+            strcpy(mssg, "Path not found");
+            reply_to_session(session, framed, OP_RESULT, request_id, ERR_PATH_NOT_FOUND, mssg);
+            return;
+        }
+        char *source = retrieved_ss_source.ip_address;
+        int source_port = retrieved_ss_source.client_port;
+        char *inst2 = strtok_r(command2, " ", &command_saveptr);
+    path = strtok_r(NULL, " ", &command_saveptr);
+    name = strtok_r(NULL, " ", &command_saveptr);
+    flag = strtok_r(NULL, " ", &command_saveptr);
+        memset(buffer, 0, BUFFER_SIZE);
+        char full_name[512]; // Make sure this is large enough to hold the full path
+        if (path != NULL && name != NULL) {
+            snprintf(full_name, sizeof(full_name), "%s/%s", path, name);
+            printf("Full name: %s\n", full_name);
+        } 
+        // else {
+            // printf("Error: Path or Name is NULL\n");
+        // }
+        sprintf(buffer, "CREATE %s %s %s %s %d", path, name, flag, source, source_port);
+        int success =forward_to_ss(&retrieved_ss_source, buffer, request_id);
+        if(success){
+            // Only index the path once the storage server has actually created it
+            char key[TRIE_MAX_PATH];
+            trie_canonical_path(full_name, key, sizeof(key));
+            add_path_to_server(retrieved_ss_source.ss_id, key);
+            cache_remove(cache, key);
+            neg_cache_remove_prefix(negative_cache, key);
+            reply_to_session(session, framed, OP_RESULT, request_id, PROTO_STATUS_OK, "Successful Create");
+        } else {
+            reply_to_session(session, framed, OP_RESULT, request_id, ERR_FAILED_TO_CREATE, "Create failed");
+        }
+        // if(recv(client_socket, buffer, sizeof(buffer), 0) > 0){
+        //     printf("Buffer: %s\n", buffer);
+        // }
         
-    }
-    if (bytes_received == 0)
-    {
-        printf("Client %s:%d disconnected.\n", client_ip, port);
-    }
-    else if (bytes_received < 0)
+        return;
+        }
+        if(strncmp(inst,"LIST",4) == 0){
+        // Answered from the namespace trie, no storage server involved
+        char listing[BUFFER_SIZE];
+        int status = PROTO_STATUS_OK;
+        listing[0] = '\0';
+        if (trie_list_directory(namespace_trie, path ? path : "/", append_listing_entry, listing) == -1) {
+            printf("Path not found (ERROR CODE %d)\n",ERR_PATH_NOT_FOUND);
+            strcpy(listing, "Path not found");
+            status = ERR_PATH_NOT_FOUND;
+        } else if (listing[0] == '\0') {
+            strcpy(listing, "Directory is empty");
+        }
+        reply_to_session(session, framed, OP_RESULT, request_id, status, listing);
+        return;
+        }
+        if(strncmp(inst,"STATS",5) == 0){
+        CacheStats stats;
+        unsigned long negative_hits, negative_inserts;
+        char report[BUFFER_SIZE];
+        cache_get_stats(cache, &stats);
+        neg_cache_get_stats(negative_cache, &negative_hits, &negative_inserts);
+        snprintf(report, sizeof(report),
+                 "Cache hits: %lu\nCache misses: %lu\nInvalidations: %lu\nStale hits avoided: %lu\n"
+                 "Negative cache hits: %lu\nNegative cache inserts: %lu",
+                 stats.hits, stats.misses, stats.invalidations, stats.stale_hits,
+                 negative_hits, negative_inserts);
+        format_worker_pool_stats(report, sizeof(report));
+        pthread_mutex_lock(&async_writes.lock);
+        int outstanding = async_writes.accepted;
+        pthread_mutex_unlock(&async_writes.lock);
+        size_t len = strlen(report);
+        snprintf(report + len, sizeof(report) - len, "\nAsync writes outstanding: %d", outstanding);
+        format_storage_server_stats(report, sizeof(report), request_id);
+        reply_to_session(session, framed, OP_RESULT, request_id, PROTO_STATUS_OK, report);
+        return;
+        }
+   
+    if (!path)
     {
-        perror("Error receiving data");
+        printf("Path not given.\n");
+        char *message = "Path not given.";
+        reply_to_session(session, framed, OP_RESULT, request_id, ERR_INVALID_COMMAND, message);
+        return;
+        // return;
     }
+    printf("Instruction: %s, Path: %s.\n", inst, path);
+    bool copy_f = 0;
+    // Acknowledge based on the command type
+    char *source;
+    char *destination;
+        SSLocation retrieved_ss = get_ss_ipandport(path);
+        char *retrieved_ss_ip = retrieved_ss.ip_address;
+        if (retrieved_ss.ss_id == -1)
+        {
+            // printf("Path not found\n");
+            printf("Path not found (ERROR CODE %d)\n",ERR_PATH_NOT_FOUND);
+            char mssg[BUFFER_SIZE];
+            strcpy(mssg, "Path not found");
+            reply_to_session(session, framed, OP_RESULT, request_id, ERR_PATH_NOT_FOUND, mssg);
+            // return;
+            return;
+            // return;
+        }
+        int retrieved_ss_port = retrieved_ss.client_port;
+        printf("Retrieved storage server IP: %s, Port: %d\n", retrieved_ss_ip, retrieved_ss_port);
+        if (strcmp(inst, "WRITE") == 0)
+        {
+            // The storage server will write large data in the background and report back to us,
+            // record now who is waiting so the completion can be routed without searching.
+            // It counts as outstanding once the storage server says it queued the write.
+            char *data = strchr(command2, ' ');
+            data = data ? strchr(data + 1, ' ') : NULL;
+            if (data && strlen(data + 1) > ASYNC_THRESHOLD)
+            {
+                // Text clients do not pass the request ID on, so nothing could confirm theirs
+                register_async_write(request_id, path, session,
+                                     !framed || !ss_confirms_async_writes(retrieved_ss.ss_id));
+            }
+        }
+        // The reply carries the request ID, the client passes it on to the storage server
+        unsigned char location[64];
+        ProtoWriter writer;
+        proto_writer_init(&writer, location, sizeof(location));
+        proto_put_str(&writer, retrieved_ss_ip);
+        proto_put_u16(&writer, retrieved_ss_port);
+        send_to_session(session, framed, OP_SS_LOCATION, request_id, writer.data, writer.len);
 
-    close(client_socket); // Close the connection
+    
 }
 
 void find_ip(char *ip)
@@ -1026,57 +2415,257 @@ void find_ip(char *ip)
 #define MAX_LOG_LENGTH 512
 
 // Add these global variables
-FILE* log_file = NULL;
-pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER;
+int log_fd = -1;
+bool log_console_echo = true;   // Also copy log lines to stdout
+LogBuffer *log_buffers = NULL;  // Lock-free list of per-thread buffers
+pthread_key_t log_buffer_key;
+pthread_t log_writer_thread;
+int log_writer_wake = 0;        // Futex word, bumped to wake the writer early
+int log_space_seq = 0;          // Futex word, bumped once the writer has freed buffer space
+int log_writer_stop = 0;
+
+static __thread LogBuffer *thread_log_buffer;
+static __thread time_t thread_log_second = -1;
+static __thread char thread_log_timestamp[26];
+
+// Thread exit hands the buffer back for reuse, the writer still drains what is left
+static void release_log_buffer(void *buffer)
+{
+    __atomic_store_n(&((LogBuffer *)buffer)->in_use, 0, __ATOMIC_RELEASE);
+}
+
+// The calling thread's log buffer, reusing one left by an exited thread if possible
+static LogBuffer *get_log_buffer()
+{
+    if (thread_log_buffer)
+    {
+        return thread_log_buffer;
+    }
+
+    LogBuffer *buffer;
+    for (buffer = __atomic_load_n(&log_buffers, __ATOMIC_ACQUIRE); buffer; buffer = buffer->next)
+    {
+        int unused = 0;
+        if (__atomic_compare_exchange_n(&buffer->in_use, &unused, 1, false,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        {
+            break;
+        }
+    }
+    if (!buffer)
+    {
+        buffer = calloc(1, sizeof(LogBuffer));
+        buffer->in_use = 1;
+        buffer->next = __atomic_load_n(&log_buffers, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&log_buffers, &buffer->next, buffer, true,
+                                            __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        {
+        }
+    }
+
+    thread_log_buffer = buffer;
+    pthread_setspecific(log_buffer_key, buffer);
+    return buffer;
+}
+
+static void wake_log_writer()
+{
+    __atomic_add_fetch(&log_writer_wake, 1, __ATOMIC_RELEASE);
+    futex(&log_writer_wake, FUTEX_WAKE_PRIVATE, 1, NULL);
+}
+
+// writev the whole of iov, continuing after short writes
+static void writev_all(int fd, struct iovec *iov, int count)
+{
+    while (count > 0)
+    {
+        ssize_t written = writev(fd, iov, count);
+        if (written < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            perror("Error writing log");
+            return;
+        }
+        while (count > 0 && (size_t)written >= iov->iov_len)
+        {
+            written -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0)
+        {
+            iov->iov_base = (char *)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+}
+
+// Write out everything buffered, a batch of ring segments per writev
+static void drain_log_buffers()
+{
+    struct iovec iov[LOG_MAX_IOV];
+    struct iovec echo_iov[LOG_MAX_IOV];
+    LogBuffer *drained[LOG_MAX_IOV];
+    unsigned long drained_head[LOG_MAX_IOV];
+    int count = 0;
+    int num_drained = 0;
+    bool freed = false;
+
+    LogBuffer *buffer = __atomic_load_n(&log_buffers, __ATOMIC_ACQUIRE);
+    while (buffer || num_drained > 0)
+    {
+        if (buffer && count + 2 <= LOG_MAX_IOV)
+        {
+            unsigned long head = __atomic_load_n(&buffer->head, __ATOMIC_ACQUIRE);
+            unsigned long tail = buffer->tail;
+            if (head != tail)
+            {
+                // Up to two segments, the ring may wrap
+                unsigned long start = tail & (LOG_BUFFER_SIZE - 1);
+                unsigned long len = head - tail;
+                unsigned long first = len < LOG_BUFFER_SIZE - start ? len : LOG_BUFFER_SIZE - start;
+                iov[count].iov_base = buffer->data + start;
+                iov[count++].iov_len = first;
+                if (first < len)
+                {
+                    iov[count].iov_base = buffer->data;
+                    iov[count++].iov_len = len - first;
+                }
+                drained[num_drained] = buffer;
+                drained_head[num_drained++] = head;
+            }
+            buffer = buffer->next;
+            continue;
+        }
+
+        // Batch is full or every buffer was visited
+        memcpy(echo_iov, iov, sizeof(struct iovec) * count);
+        writev_all(log_fd, iov, count);
+        if (log_console_echo)
+        {
+            writev_all(STDOUT_FILENO, echo_iov, count);
+        }
+        for (int i = 0; i < num_drained; i++)
+        {
+            __atomic_store_n(&drained[i]->tail, drained_head[i], __ATOMIC_RELEASE);
+        }
+        freed |= (num_drained > 0);
+        count = 0;
+        num_drained = 0;
+    }
+
+    if (freed)
+    {
+        // Threads blocked on a full buffer recheck it
+        __atomic_add_fetch(&log_space_seq, 1, __ATOMIC_RELEASE);
+        futex(&log_space_seq, FUTEX_WAKE_PRIVATE, INT_MAX, NULL);
+    }
+}
+
+// Background thread writing buffered log lines, woken early when a buffer fills up
+static void *log_writer(void *arg)
+{
+    (void)arg;
+    struct timespec interval;
+    interval.tv_sec = LOG_FLUSH_INTERVAL_MS / 1000;
+    interval.tv_nsec = (LOG_FLUSH_INTERVAL_MS % 1000) * 1000000L;
+
+    while (!__atomic_load_n(&log_writer_stop, __ATOMIC_ACQUIRE))
+    {
+        int seq = __atomic_load_n(&log_writer_wake, __ATOMIC_ACQUIRE);
+        drain_log_buffers();
+        futex(&log_writer_wake, FUTEX_WAIT_PRIVATE, seq, &interval);
+    }
+    drain_log_buffers();
+    return NULL;
+}
 
 // Initialize logging system
-void init_logging() {
-    log_file = fopen(LOG_FILE, "a");
-    if (log_file == NULL) {
+void init_logging(bool console_echo) {
+    log_fd = open(LOG_FILE, O_WRONLY | O_APPEND | O_CREAT, 0644);
+    if (log_fd < 0) {
         printf("Error opening log file (ERROR CODE %d)\n",ERR_OPENING);
         perror("Error opening log file");
         exit(EXIT_FAILURE);
     }
+    log_console_echo = console_echo;
+    pthread_key_create(&log_buffer_key, release_log_buffer);
+    pthread_create(&log_writer_thread, NULL, log_writer, NULL);
     // Write startup message
     log_message("INFO", "Naming Server started");
 }
 
-// Close logging system
+// Close logging system, writing out whatever is still buffered
 void close_logging() {
-    if (log_file) {
+    if (log_fd >= 0) {
         log_message("INFO", "Naming Server shutting down");
-        fclose(log_file);
+        __atomic_store_n(&log_writer_stop, 1, __ATOMIC_RELEASE);
+        wake_log_writer();
+        pthread_join(log_writer_thread, NULL);
+        close(log_fd);
+        log_fd = -1;
     }
-    pthread_mutex_destroy(&log_mutex);
 }
 
 // Function to get current timestamp as string
 void get_timestamp(char* timestamp_str, size_t size) {
     time_t now = time(NULL);
-    struct tm* tm_info = localtime(&now);
-    strftime(timestamp_str, size, "%Y-%m-%d %H:%M:%S", tm_info);
+    struct tm tm_info;
+    localtime_r(&now, &tm_info);
+    strftime(timestamp_str, size, "%Y-%m-%d %H:%M:%S", &tm_info);
 }
 
-// Main logging function
+// Main logging function. Copies the line into the calling thread's buffer;
+// the writer thread does the I/O, so callers never wait on the disk.
 void log_message(const char* level, const char* message) {
-    char timestamp[26];
-    get_timestamp(timestamp, sizeof(timestamp));
-    
-    pthread_mutex_lock(&log_mutex);
-    fprintf(log_file, "[%s] [%s] %s\n", timestamp, level, message);
-    fflush(log_file);
-    pthread_mutex_unlock(&log_mutex);
-    
-    // Also print to console
-    printf("[%s] [%s] %s\n", timestamp, level, message);
+    // Timestamps only change once a second, so each thread reformats at most that often
+    time_t now = time(NULL);
+    if (now != thread_log_second) {
+        get_timestamp(thread_log_timestamp, sizeof(thread_log_timestamp));
+        thread_log_second = now;
+    }
+
+    char line[MAX_LOG_LENGTH + 64];
+    int len = snprintf(line, sizeof(line), "[%s] [%s] %s\n", thread_log_timestamp, level, message);
+    if (len >= (int)sizeof(line)) {
+        len = sizeof(line) - 1;
+        line[len - 1] = '\n';
+    }
+
+    LogBuffer *buffer = get_log_buffer();
+    unsigned long head = buffer->head;
+    // A full buffer sleeps until the writer frees space rather than dropping the line.
+    // The sequence is read before the recheck, so a drain in between ends the wait at once.
+    while (1) {
+        int seq = __atomic_load_n(&log_space_seq, __ATOMIC_ACQUIRE);
+        if (LOG_BUFFER_SIZE - (head - __atomic_load_n(&buffer->tail, __ATOMIC_ACQUIRE)) >= (unsigned long)len) {
+            break;
+        }
+        wake_log_writer();
+        futex(&log_space_seq, FUTEX_WAIT_PRIVATE, seq, NULL);
+    }
+
+    unsigned long start = head & (LOG_BUFFER_SIZE - 1);
+    unsigned long first = (unsigned long)len < LOG_BUFFER_SIZE - start ? (unsigned long)len : LOG_BUFFER_SIZE - start;
+    memcpy(buffer->data + start, line, first);
+    memcpy(buffer->data, line + first, len - first);
+    __atomic_store_n(&buffer->head, head + len, __ATOMIC_RELEASE);
+
+    if (head + len - __atomic_load_n(&buffer->tail, __ATOMIC_RELAXED) > LOG_BUFFER_SIZE / 2) {
+        wake_log_writer();
+    }
 }
 
 // Function to log client requests
-void log_client_request(const char* client_ip, int client_port, int client_socket_fd, const char* request, int ack_number) {
+void log_client_request(const char* client_ip, int client_port, int client_socket_fd, const char* request,
+                        unsigned long long ack_number, unsigned long long request_id) {
     char log_buffer[MAX_LOG_LENGTH];
     snprintf(log_buffer, sizeof(log_buffer), 
-             "Client Request - IP: %s, Port: %d, Socket FD: %d, ACK: %d, Request: %s",
-             client_ip, client_port, client_socket_fd, ack_number, request);
+             "Client Request - IP: %s, Port: %d, Socket FD: %d, ACK: %llu, Request ID: %llu, Request: %s",
+             client_ip, client_port, client_socket_fd, ack_number, request_id, request);
     log_message("REQUEST", log_buffer);
 }
 
@@ -1126,104 +2715,48 @@ void handle_shutdown(int sig) {
     exit(0);  // Exit the program
 }
 
-// int find_client_info_from_log(const char *filename, char *client_ip, int *client_port, int* client_sock_fd) {
-//     FILE *log_file = fopen(LOG_FILE, "r");
-//     if (!log_file) {
-//         printf("Error opening log file (ERROR CODE %d)\n",ERR_OPENINING);
-//         perror("Error opening log file");
-//         return -1;
-//     }
-
-//     char line[512];
-//     while (fgets(line, sizeof(line), log_file)) {
-//         // Look for a WRITE request in the log
-//         if (strstr(line, "WRITE") && strstr(line, filename)) {
-//             // sscanf(line, "%*[^I]IP: %[^,], Port: %d, Socket FD: %d", client_ip, &client_port, &client_sock_fd);
-//             if (sscanf(line, "%*[^I]IP: %[^,], Port: %d, Socket FD: %d", client_ip, client_port, client_sock_fd) == 3) {
-//                 fclose(log_file);
-//                 return 0; // Success
-//             }
-//             // fclose(log_file);
-//             // return 0;  // Found the client info
-//         }
-//     }
-
-//     fclose(log_file);
-//     return -1;  // Client info not found
-// }
-
-
-int find_client_info_from_log(const char *filename, char *client_ip, int *client_port, int *client_sock_fd) {
-    FILE *log_file = fopen(LOG_FILE, "r");
-    if (!log_file) {
-        printf("Error opening log file (ERROR CODE %d)\n", ERR_OPENING);
-        perror("Error opening log file");
-        return -1;
+// Main function
+int main(int argc, char *argv[])
+{
+    // Optional worker pool bounds: [min_workers] [max_workers]
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int min_workers = argc > 1 ? atoi(argv[1]) : (cpus > 0 ? (int)cpus : 4);
+    int max_workers = argc > 2 ? atoi(argv[2]) : 4 * min_workers;
+    // Optional third arg: 0 keeps log lines out of the console
+    bool log_echo = argc > 3 ? atoi(argv[3]) != 0 : true;
+    if (min_workers < 1)
+    {
+        min_workers = 1;
     }
-
-    // Seek to the end of the file
-    fseek(log_file, 0, SEEK_END);
-
-    // Find the file size
-    long file_size = ftell(log_file);
-    if (file_size == 0) {
-        fclose(log_file);
-        return -1;  // Empty file
+    if (max_workers > MAX_WORKERS)
+    {
+        max_workers = MAX_WORKERS;
     }
-
-    // Buffer for reading lines
-    char line[BUFFER_SIZE];
-    long offset = file_size;
-
-    while (offset > 0) {
-        // Move backwards, one byte at a time
-        fseek(log_file, --offset, SEEK_SET);
-
-        // Check for newline to identify the start of a line
-        if (fgetc(log_file) == '\n' || offset == 0) {
-            // Read the current line
-            if (fgets(line, sizeof(line), log_file)) {
-                // Check for WRITE request and the specific filename
-                if (strstr(line, "WRITE") && strstr(line, filename)) {
-                    // Example log entry:
-                    // [2024-11-17 15:41:27] [REQUEST] Client Request - IP: 192.168.12.48, Port: 48964, Socket FD: 15, ACK: 1001, Request: WRITE /home/test1.txt
-
-                    // Extract IP, Port, and Socket FD
-                    if (sscanf(line, "%*[^I]IP: %[^,], Port: %d, Socket FD: %d", client_ip, client_port, client_sock_fd) == 3) {
-                        fclose(log_file);
-                        return 0;  // Success
-                    }
-                }
-            }
-        }
+    if (min_workers > max_workers)
+    {
+        min_workers = max_workers;
     }
 
-    fclose(log_file);
-    return -1;  // No matching entry found
-}
-
-// Main function
-int main()
-{
     init_ss_connection_manager(); // Initialize the SS connection manager
     // Initialize request queue
     init_request_queue();
+    init_path_index();
+    init_async_write_registry();
+    namespace_trie = init_namespace_trie();
     signal(SIGINT, handle_shutdown);
     printf("Naming Server started. Press CTRL+C to stop and clear log file.\n");
-    init_logging();
+    init_logging(log_echo);
 
     // Create worker threads
-    pthread_t worker_threads[4]; // Create 4 worker threads
-    for (int i = 0; i < 4; i++)
-    {
-        pthread_create(&worker_threads[i], NULL, process_requests, NULL);
-    }
+    init_worker_pool(min_workers, max_workers);
     char ip[INET_ADDRSTRLEN];
     find_ip(ip);
     printf("Naming Server IP: %s\n", ip);
     start_naming_server(NS_PORT); // Start the naming server on the defined port
 
     free_lru_cache(cache); // Free the cache memory
+    free_negative_cache(negative_cache);
+    free_namespace_trie(namespace_trie);
     close_logging();
     return 0;
 }
@@ -15,6 +15,15 @@
 #include <dirent.h>
 #include <time.h>
 #include <signal.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <linux/futex.h>
+#include <errno.h>
+#include <limits.h>
+#include "protocol.h"
 #define MAX_STORAGE_SERVERS 100   // Maximum number of storage servers
 #define BUFFER_SIZE 4096          // Size of the buffer for communication
 #define NS_PORT 8099           // Port for Naming Server
@@ -24,27 +33,112 @@
 #define RS1_PORT 9000
 #define RS2_PORT 9001
 
-#define TABLE_SIZE 101  // Prime number for better distribution
+#define PATH_TABLE_INITIAL_SIZE 128  // Initial slots of a server's path table (power of two)
+#define PATH_TABLE_MAX_LOAD 50        // Max percent of slots in use (live + tombstones) before a rehash
+#define PATH_TABLE_MAX_PROBE 16       // An insert probing further than this triggers a grow
+#define PATH_TABLE_REHASH_STEP 64     // Old slots migrated per table update while rehashing
 #define MAX_PATHS 256   // Example maximum paths
 
-#define MAX_QUEUE_SIZE 100
+#define PATH_INDEX_INITIAL_BUCKETS 4096  // Initial buckets in the global path index (power of two)
+#define PATH_INDEX_MAX_LOAD 100          // Max entries per 100 buckets before the index doubles
+#define MAX_PATH_OWNERS 4         // Storage servers that may hold the same path
+
+#define MAX_EPOLL_EVENTS 64  // Events handled per epoll_wait in the accept loop
+
+#define MAX_QUEUE_SIZE 128  // Pooled requests and ring slots, a power of two
+#define QUEUE_SPIN_TRIES 16  // Yields on an empty ring before sleeping on its futex
+
+#define MAX_WORKERS 256               // Upper bound on worker threads
+#define WORKER_IDLE_TIMEOUT_MS 5000   // Idle time after which a worker above the minimum exits
+#define WORKER_GROW_WAIT_US 2000      // Queue wait that makes a worker start another one
+#define QUEUE_WAIT_BUCKETS 6          // <100us, <1ms, <10ms, <100ms, <1s, >=1s
 #define ACK_PREFIX 1000  // Starting point for ACK numbers
+#define REQUEST_ID_BLOCK 1024  // IDs a thread takes from the shared counter at a time
 
 // Add these to naming_server.h
 #define MAX_SS_CONNECTIONS 10
+
+#ifndef ASYNC_THRESHOLD
+#define ASYNC_THRESHOLD 1024  // Same cutoff the storage server uses for asynchronous writes
+#endif
+#define ASYNC_WRITE_BUCKETS 256  // Hash chains of the outstanding async write table (power of two)
+#define ASYNC_WRITE_ACCEPT_TIMEOUT_MS 30000 // A routed WRITE its storage server has not accepted by then is dropped
+#define SS_OP_TIMEOUT_MS 30000   // Longest a forwarded command waits for the storage server's result
+
+// Command sent on a storage server's persistent connection, waiting for the
+// result that carries the same request ID. Lives on the waiting worker's stack.
+typedef struct PendingSSOp {
+    unsigned long long request_id;
+    bool done;
+    int status;                  // 0 or an error code from the storage server
+    char response[BUFFER_SIZE];
+    pthread_cond_t cond;         // Signalled under the connection's op_lock
+    struct PendingSSOp *next;
+} PendingSSOp;
+
 // Enhanced SS connection handling structure
 typedef struct {
-    int socket;
+    int socket;               // Registration connection, kept open and reused for commands
     char ip_address[INET_ADDRSTRLEN];
     int port;
     int client_port;
     bool is_active;
+    int ss_id;                // Index of the registered server in storage_servers[]
     pthread_t thread;
     time_t last_heartbeat;
     int pending_ops;  // Track pending operations
     pthread_mutex_t op_lock;  // Lock for operations
+    bool framed;              // Registered over the framed protocol, commands go over socket
+    unsigned long generation; // Bumped whenever the slot is taken by a new registration
+    pthread_mutex_t send_lock; // Serializes frames written to socket
+    PendingSSOp *pending;     // Commands sent on socket still waiting for their result
 } SSConnection;
 
+// Connection watched by the reactor: either a new connection waiting for its
+// first message, or a client session waiting for its next command
+typedef struct ReactorConnection {
+    int socket;
+    struct sockaddr_in addr;
+    bool is_session;          // Client session, its commands go to the worker queue
+    char client_ip[INET_ADDRSTRLEN];
+    int client_port;
+    unsigned long long ack_number; // ACK number handed out when the session started
+    bool framed;              // Peer speaks the framed protocol rather than text
+    FrameAssembler frame;     // Framed command being received
+    struct ReactorConnection *next_parked; // Next session waiting for a pooled request
+    pthread_mutex_t send_lock; // Keeps a worker's reply and an async completion from interleaving
+    int refs;                 // The reactor's, plus one per async write waiting to report on it
+} ReactorConnection;
+
+// Worker threads grow with the backlog up to max_workers and retire down to
+// min_workers when idle. Counters are updated with atomics.
+typedef struct {
+    int min_workers;
+    int max_workers;
+    int num_workers;                  // Running workers
+    int busy_workers;                 // Workers handling a command right now
+    int peak_workers;
+    unsigned long spawned;
+    unsigned long retired;
+    unsigned long busy_us;            // Total time workers spent handling commands
+    unsigned long idle_us;            // Total time workers spent waiting for one
+    unsigned long queue_wait[QUEUE_WAIT_BUCKETS]; // Commands by time spent queued
+} WorkerPool;
+
+#define LOG_BUFFER_SIZE 65536     // Per-thread log ring, a power of two
+#define LOG_FLUSH_INTERVAL_MS 50  // Longest a logged line waits for the writer
+#define LOG_MAX_IOV 64            // Ring segments gathered into one writev
+
+// Log lines of one thread waiting for the writer thread. The owning thread
+// only advances head and the writer only advances tail, so neither locks.
+typedef struct LogBuffer {
+    char data[LOG_BUFFER_SIZE];
+    unsigned long head;       // Bytes written by the owning thread
+    unsigned long tail;       // Bytes already written out
+    int in_use;               // Owned by a live thread, free buffers are reused
+    struct LogBuffer *next;   // All buffers ever created, never unlinked
+} LogBuffer;
+
 // Command response structure
 typedef struct {
     int status;
@@ -59,24 +153,55 @@ typedef struct {
 } SSConnectionManager;
 
 
+// What a worker is handed through the request queue
+typedef enum {
+    REQUEST_COMMAND,        // A session's command, text in request
+    REQUEST_REJECT,         // A session's frame that is not a command it may send
+    REQUEST_FIRST_MESSAGE   // A new connection's first message, in session's frame or socket
+} RequestKind;
+
 typedef struct {
+    RequestKind kind;
     int client_socket;
     char client_ip[INET_ADDRSTRLEN];
     int client_port;
-    int ack_number;
+    unsigned long long ack_number;  // Session the command arrived on
+    unsigned long long request_id;  // Unique per command, correlates its log lines
+    bool framed;                    // Replies go out as frames rather than text
     time_t timestamp;
     char request[BUFFER_SIZE];
+    ReactorConnection *session;  // Re-armed in the reactor once the command is handled
+    long enqueued_us;            // Monotonic time the command was queued
     // char file_path[256];
 } ClientRequest;
 
+// Slot of a RequestRing, sequence says whether it is free for the producer
+// at that position or holds an item for the consumer at that position
+typedef struct {
+    unsigned long sequence;
+    ClientRequest *request;
+} RequestSlot;
+
+// Bounded lock-free multi-producer/multi-consumer ring of request pointers.
+// Threads only sleep on the futex word when the ring is empty.
+typedef struct {
+    RequestSlot slots[MAX_QUEUE_SIZE];
+    unsigned long enqueue_pos __attribute__((aligned(64)));
+    unsigned long dequeue_pos __attribute__((aligned(64)));
+    int wake_seq __attribute__((aligned(64)));  // Futex word, bumped to wake sleepers
+    int sleepers;                               // Threads waiting for an item
+} RequestRing;
+
+// Commands travel as pointers to pooled ClientRequests, so the 4 KB text is
+// written once by the reactor and never copied through the queue
 typedef struct {
-    ClientRequest requests[MAX_QUEUE_SIZE];
-    int front;
-    int rear;
-    int size;
-    pthread_mutex_t mutex;
-    pthread_cond_t not_empty;
-    pthread_cond_t not_full;
+    RequestRing pending;                 // Commands waiting for a worker
+    RequestRing free_list;               // Pooled requests not in use
+    ClientRequest pool[MAX_QUEUE_SIZE];
+    ReactorConnection *parked;           // Sessions left disarmed while the pool was empty, oldest first
+    ReactorConnection *parked_tail;
+    int num_parked;
+    pthread_mutex_t parked_lock;
 } RequestQueue;
 
 
@@ -84,51 +209,148 @@ typedef struct {
 // // Struct to store metadata for each storage server
 
 typedef struct {
-    char path[256];      // File or folder path name
+    char *path;          // File or folder path name (heap copy)
+    unsigned int hash;   // Full hash of path, kept so rehashing never rehashes strings
     bool is_occupied;    // Flag to indicate if slot is occupied
     bool is_deleted;     // Flag to indicate if slot is a tombstone
 } HashEntry;
 
+typedef struct {
+    HashEntry *slots;         // Open-addressed slots, probed quadratically
+    unsigned int capacity;    // Number of slots, always a power of two
+    unsigned int used;        // Live entries
+    unsigned int tombstones;  // Deleted entries still occupying a slot
+} PathTableSlots;
+
+// Growable path table; while rehashing, entries move from tables[0] to
+// tables[1] a few slots per update so no single insert pays for a full copy
+typedef struct {
+    PathTableSlots tables[2];
+    long rehash_index;        // Next slot of tables[0] to migrate, -1 when not rehashing
+} PathTable;
+
 typedef struct {
     char ip_address[INET_ADDRSTRLEN];  // Storage server's IP address
     int port;                          // Storage server's port for NM connection
     int client_port;                   // Storage server's port for client connection
     char metadata[256];                // Additional metadata
     // char accessible_paths[MAX_PATHS][256];  // List of accessible paths
-    HashEntry accessible_paths[TABLE_SIZE];  // Hash table for accessible paths
+    PathTable accessible_paths;        // Hash table for accessible paths
     int num_paths;                     // Number of accessible paths
+    bool is_active;                    // Cleared when its connection goes away
     // int is_occupied;  // Flag to indicate if the slot is occupied
 } StorageServer;
 
+// Result of a path lookup, a small value so workers never share lookup state
+typedef struct {
+    char ip_address[INET_ADDRSTRLEN];  // Storage server's IP address
+    int client_port;                   // Storage server's port for client connection
+    int ss_id;                         // Index into storage_servers[], -1 if not found
+} SSLocation;
+
+// Global path -> owning storage servers index, so a lookup is a single
+// hash probe regardless of how many storage servers are registered
+typedef struct PathIndexEntry {
+    char *path;                        // File or folder path name, owned by the entry
+    unsigned int hash;                 // Full hash of path, kept so growing never rehashes strings
+    int ss_ids[MAX_PATH_OWNERS];       // Indices into storage_servers[]
+    int num_owners;                    // Number of servers holding the path
+    struct PathIndexEntry *next;       // Next entry in the bucket chain
+} PathIndexEntry;
+
+typedef struct {
+    PathIndexEntry **buckets;          // Bucket chains, doubled once the load passes PATH_INDEX_MAX_LOAD
+    unsigned int capacity;             // Number of buckets, always a power of two
+    int num_entries;
+    pthread_rwlock_t lock;             // Readers share, registration/CREATE/DELETE write
+} PathIndex;
+
+// An async WRITE the storage server has not reported back on yet, recorded when
+// the naming server routes the request and confirmed when the storage server queues it
+typedef struct PendingAsyncWrite {
+    unsigned long long request_id;     // ID the naming server gave the WRITE
+    char filename[256];                // Path being written
+    ReactorConnection *session;        // Session the completion is sent on, a reference is held
+    bool accepted;                     // Queued by the storage server, until then only routed
+    long deadline_us;                  // Dropped at this monotonic time unless accepted
+    struct PendingAsyncWrite *id_next;   // Next entry in the by_id chain
+    struct PendingAsyncWrite *name_next; // Next entry in the by_name chain
+} PendingAsyncWrite;
+
+// Outstanding async writes, looked up by request ID or by file name
+typedef struct {
+    PendingAsyncWrite *by_id[ASYNC_WRITE_BUCKETS];
+    PendingAsyncWrite *by_name[ASYNC_WRITE_BUCKETS];
+    int count;
+    int accepted;                      // Entries their storage server has queued, shown by STATS
+    long next_reap_us;                 // When routed entries are next checked for their deadline
+    pthread_mutex_t lock;
+} AsyncWriteRegistry;
+
 
 
 // Function declarations
 void find_ip(char *ip);
-void register_storage_server(const char *ip_address, int port, int client_port, const char *metadata, const char *paths[], int num_paths);
+int register_storage_server(const char *ip_address, int port, int client_port, const char *metadata, const char *paths[], int num_paths);
 void start_naming_server(int port);
-void handle_storage_server(int client_socket, struct sockaddr_in *client_addr);
+void handle_storage_server(int client_socket, struct sockaddr_in *client_addr, const FrameHeader *header,
+                           const char *payload, bool framed);
+void handle_first_message(ReactorConnection *conn);
 void send_metadata_to_replica(const char *metadata, const char *replica_ip, int replica_port);
 void init_storage_servers();
 
-void handle_client(int client_socket, const char *client_ip, int port);
-StorageServer* get_ss_ipandport(char *filepath);
-StorageServer insert_path(StorageServer server, const char *path) ;
+void handle_client_command(int client_socket, const char *client_ip, int port, char *buffer,
+                           unsigned long long ack_number, unsigned long long request_id, bool framed,
+                           ReactorConnection *session);
+void add_client_session(int client_socket, struct sockaddr_in *client_addr, unsigned long long ack_number,
+                        bool framed);
+int connect_and_send_to_ss(char* ip, int port, char* message, unsigned long long request_id);
+int send_ss_command(int ss_id, const char *message, unsigned long long request_id, char *response,
+                    size_t size);
+int forward_to_ss(const SSLocation *location, char *message, unsigned long long request_id);
+bool ss_confirms_async_writes(int ss_id);
+void format_storage_server_stats(char *report, size_t size, unsigned long long request_id);
+unsigned long long allocate_request_id();
+void rearm_client_session(ReactorConnection *session);
+void release_client_session(ReactorConnection *session);
+void *process_requests(void *arg);
+void init_worker_pool(int min_workers, int max_workers);
+void format_worker_pool_stats(char *report, size_t size);
+SSLocation get_ss_ipandport(const char *filepath);
+void init_path_table(PathTable *table);
+bool insert_path(StorageServer *server, const char *path) ;
 bool delete_path(StorageServer *server, const char *path) ;
-int search_path(StorageServer server, const char *path) ;
+int search_path(const StorageServer *server, const char *path) ;
+
+void init_path_index();
+unsigned int path_index_hash(const char *path);
+int path_index_lookup(const char *path);
+void add_path_to_server(int ss_id, const char *path);
+void remove_path_from_server(int ss_id, const char *path);
+int resolve_path_owner(const char *path, bool *exact);
+int remove_subtree_from_servers(const char *path, int ss_id);
 
 
 int find_ss_connection(const char* ip, int port);
 
 void init_storage_servers();
-void init_logging();
+void init_logging(bool console_echo);
 void close_logging();
 void get_timestamp(char* timestamp_str, size_t size) ;
 void log_message(const char* level, const char* message);
 // void log_client_request(const char* client_ip, int client_port, const char* request, int ack_number);
-void log_client_request(const char* client_ip, int client_port, int client_socket_fd, const char* request, int ack_number) ;
+void log_client_request(const char* client_ip, int client_port, int client_socket_fd, const char* request,
+                        unsigned long long ack_number, unsigned long long request_id);
 void log_storage_server_registration(const char* ip_address, int port, int client_port, const char* metadata, int num_paths);
-int find_client_info_from_log(const char *filename, char *client_ip, int *client_port, int* client_sock_fd);
-void notify_client_of_completion(const char *filename) ;
+void init_async_write_registry();
+void register_async_write(unsigned long long request_id, const char *filename, ReactorConnection *session,
+                          bool accepted);
+void confirm_async_write(unsigned long long request_id);
+PendingAsyncWrite *take_async_write_by_id(unsigned long long request_id);
+PendingAsyncWrite *take_async_write_by_name(const char *filename);
+int purge_async_writes_for_session(ReactorConnection *session);
+void notify_client_of_completion(unsigned long long request_id, const char *filename, int status,
+                                 const char *result);
 enum Errorcodes {
     ERR_FILE_NOT_FOUND = 300,
     ERR_FAILED_TO_READ = 301,
@@ -147,11 +369,10 @@ enum Errorcodes {
     ERR_MAX_SS_REACHED = 314,
     ERR_OPENING = 315,
     ERR_PIPE = 316,
-    ERR_INVALID_COMMAND = 317
+    ERR_INVALID_COMMAND = 317,
+    ERR_SERVER_BUSY = 318
 };
 
-#define MAX_PENDING_WRITES 100
-
 
 
 #endif
\ No newline at end of file
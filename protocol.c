@@ -0,0 +1,524 @@
+#include "protocol.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+static void store_be(unsigned char *out, uint64_t value, int bytes) {
+    for (int i = bytes - 1; i >= 0; i--) {
+        out[i] = (unsigned char)value;
+        value >>= 8;
+    }
+}
+
+static uint64_t load_be(const unsigned char *in, int bytes) {
+    uint64_t value = 0;
+    for (int i = 0; i < bytes; i++) {
+        value = (value << 8) | in[i];
+    }
+    return value;
+}
+
+void proto_encode_header(const FrameHeader *header, unsigned char *out) {
+    out[0] = PROTO_MAGIC;
+    out[1] = PROTO_VERSION;
+    out[2] = header->opcode;
+    out[3] = header->flags;
+    store_be(out + 4, header->length, 4);
+    store_be(out + 8, header->request_id, 8);
+}
+
+// Returns -1 if in is not a frame header this version understands
+int proto_decode_header(const unsigned char *in, FrameHeader *header) {
+    if (in[0] != PROTO_MAGIC || in[1] != PROTO_VERSION) {
+        return -1;
+    }
+    header->opcode = in[2];
+    header->flags = in[3];
+    header->length = (uint32_t)load_be(in + 4, 4);
+    header->request_id = load_be(in + 8, 8);
+    if (header->length > PROTO_MAX_PAYLOAD) {
+        return -1;
+    }
+    return 0;
+}
+
+// True if data starts like a frame rather than a text message
+bool proto_is_frame_start(const void *data, size_t len) {
+    return len > 0 && ((const unsigned char *)data)[0] == PROTO_MAGIC;
+}
+
+void proto_writer_init(ProtoWriter *w, void *buffer, size_t capacity) {
+    w->data = (unsigned char *)buffer;
+    w->len = 0;
+    w->capacity = capacity;
+    w->overflow = false;
+}
+
+static unsigned char *writer_reserve(ProtoWriter *w, size_t len) {
+    if (w->overflow || w->capacity - w->len < len) {
+        w->overflow = true;
+        return NULL;
+    }
+    unsigned char *p = w->data + w->len;
+    w->len += len;
+    return p;
+}
+
+void proto_put_u8(ProtoWriter *w, uint8_t value) {
+    unsigned char *p = writer_reserve(w, 1);
+    if (p) {
+        *p = value;
+    }
+}
+
+void proto_put_u16(ProtoWriter *w, uint16_t value) {
+    unsigned char *p = writer_reserve(w, 2);
+    if (p) {
+        store_be(p, value, 2);
+    }
+}
+
+void proto_put_u32(ProtoWriter *w, uint32_t value) {
+    unsigned char *p = writer_reserve(w, 4);
+    if (p) {
+        store_be(p, value, 4);
+    }
+}
+
+void proto_put_u64(ProtoWriter *w, uint64_t value) {
+    unsigned char *p = writer_reserve(w, 8);
+    if (p) {
+        store_be(p, value, 8);
+    }
+}
+
+// Length-prefixed string, no terminator on the wire
+void proto_put_str(ProtoWriter *w, const char *s) {
+    size_t len = strlen(s);
+    if (len > PROTO_MAX_STRING) {
+        w->overflow = true;
+        return;
+    }
+    proto_put_u16(w, (uint16_t)len);
+    proto_put_bytes(w, s, len);
+}
+
+void proto_put_bytes(ProtoWriter *w, const void *data, size_t len) {
+    unsigned char *p = writer_reserve(w, len);
+    if (p) {
+        memcpy(p, data, len);
+    }
+}
+
+void proto_reader_init(ProtoReader *r, const void *payload, size_t len) {
+    r->data = (const unsigned char *)payload;
+    r->len = len;
+    r->pos = 0;
+    r->error = false;
+}
+
+static const unsigned char *reader_take(ProtoReader *r, size_t len) {
+    if (r->error || r->len - r->pos < len) {
+        r->error = true;
+        return NULL;
+    }
+    const unsigned char *p = r->data + r->pos;
+    r->pos += len;
+    return p;
+}
+
+uint8_t proto_get_u8(ProtoReader *r) {
+    const unsigned char *p = reader_take(r, 1);
+    return p ? *p : 0;
+}
+
+uint16_t proto_get_u16(ProtoReader *r) {
+    const unsigned char *p = reader_take(r, 2);
+    return p ? (uint16_t)load_be(p, 2) : 0;
+}
+
+uint32_t proto_get_u32(ProtoReader *r) {
+    const unsigned char *p = reader_take(r, 4);
+    return p ? (uint32_t)load_be(p, 4) : 0;
+}
+
+uint64_t proto_get_u64(ProtoReader *r) {
+    const unsigned char *p = reader_take(r, 8);
+    return p ? load_be(p, 8) : 0;
+}
+
+// Copy a string field into out. Fails, leaving out empty, if it does not fit.
+bool proto_get_str(ProtoReader *r, char *out, size_t size) {
+    uint16_t len = proto_get_u16(r);
+    const unsigned char *p = reader_take(r, len);
+    if (!p || len >= size) {
+        r->error = true;
+        out[0] = '\0';
+        return false;
+    }
+    memcpy(out, p, len);
+    out[len] = '\0';
+    return true;
+}
+
+// Copy everything left as text, truncated to fit out. Returns the bytes copied.
+size_t proto_get_rest(ProtoReader *r, char *out, size_t size) {
+    size_t len = proto_remaining(r);
+    if (len >= size) {
+        len = size - 1;
+    }
+    memcpy(out, r->data + r->pos, len);
+    out[len] = '\0';
+    r->pos = r->len;
+    return len;
+}
+
+size_t proto_remaining(const ProtoReader *r) {
+    return r->error ? 0 : r->len - r->pos;
+}
+
+// Write all of iov, continuing after partial writes
+static int send_iov(int sock, struct iovec *iov, int count) {
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = count;
+    while (msg.msg_iovlen > 0) {
+        ssize_t sent = sendmsg(sock, &msg, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        while (msg.msg_iovlen > 0 && (size_t)sent >= msg.msg_iov->iov_len) {
+            sent -= msg.msg_iov->iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+        if (msg.msg_iovlen > 0) {
+            msg.msg_iov->iov_base = (char *)msg.msg_iov->iov_base + sent;
+            msg.msg_iov->iov_len -= sent;
+        }
+    }
+    return 0;
+}
+
+// Send header and payload with one system call in the common case
+int proto_send_frame(int sock, uint8_t opcode, uint8_t flags, uint64_t request_id,
+                     const void *payload, size_t length) {
+    if (length > PROTO_MAX_PAYLOAD) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    FrameHeader header = {opcode, flags, (uint32_t)length, request_id};
+    unsigned char header_bytes[PROTO_HEADER_SIZE];
+    proto_encode_header(&header, header_bytes);
+
+    struct iovec iov[2];
+    iov[0].iov_base = header_bytes;
+    iov[0].iov_len = PROTO_HEADER_SIZE;
+    iov[1].iov_base = (void *)payload;
+    iov[1].iov_len = length;
+    return send_iov(sock, iov, length > 0 ? 2 : 1);
+}
+
+// Send a status followed by message text, the layout of OP_RESULT, OP_END and similar replies
+int proto_send_result(int sock, uint8_t opcode, uint8_t flags, uint64_t request_id,
+                      uint16_t status, const char *text) {
+    size_t text_len = text ? strlen(text) : 0;
+    if (text_len + 2 > PROTO_MAX_PAYLOAD) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    FrameHeader header = {opcode, flags, (uint32_t)(text_len + 2), request_id};
+    unsigned char header_bytes[PROTO_HEADER_SIZE + 2];
+    proto_encode_header(&header, header_bytes);
+    store_be(header_bytes + PROTO_HEADER_SIZE, status, 2);
+
+    struct iovec iov[2];
+    iov[0].iov_base = header_bytes;
+    iov[0].iov_len = sizeof(header_bytes);
+    iov[1].iov_base = (void *)text;
+    iov[1].iov_len = text_len;
+    return send_iov(sock, iov, text_len > 0 ? 2 : 1);
+}
+
+// Read exactly length bytes. Returns 0, or -1 on error or if the peer closed first.
+int proto_recv_exact(int sock, void *buffer, size_t length) {
+    size_t have = 0;
+    while (have < length) {
+        ssize_t n = recv(sock, (char *)buffer + have, length - have, 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        have += n;
+    }
+    return 0;
+}
+
+// Receive one whole frame. The payload is NUL terminated when there is room.
+// Returns the payload length, or -1 if the connection failed or the frame was
+// malformed or larger than capacity (it is skipped in that case).
+int proto_recv_frame(int sock, FrameHeader *header, void *payload, size_t capacity) {
+    unsigned char header_bytes[PROTO_HEADER_SIZE];
+    if (proto_recv_exact(sock, header_bytes, PROTO_HEADER_SIZE) < 0) {
+        return -1;
+    }
+    if (proto_decode_header(header_bytes, header) < 0) {
+        errno = EPROTO;
+        return -1;
+    }
+    if (header->length > capacity) {
+        char discard[4096];
+        size_t left = header->length;
+        while (left > 0) {
+            size_t chunk = left < sizeof(discard) ? left : sizeof(discard);
+            if (proto_recv_exact(sock, discard, chunk) < 0) {
+                return -1;
+            }
+            left -= chunk;
+        }
+        errno = EMSGSIZE;
+        return -1;
+    }
+    if (proto_recv_exact(sock, payload, header->length) < 0) {
+        return -1;
+    }
+    if (header->length < capacity) {
+        ((char *)payload)[header->length] = '\0';
+    }
+    return (int)header->length;
+}
+
+// Consume the text banner a storage server greets every connection with
+int proto_expect_banner(int sock) {
+    char banner[sizeof(PROTO_SS_BANNER)];
+    size_t len = strlen(PROTO_SS_BANNER);
+    if (proto_recv_exact(sock, banner, len) < 0 || memcmp(banner, PROTO_SS_BANNER, len) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+void proto_assembler_init(FrameAssembler *a) {
+    a->have = 0;
+    a->payload = NULL;
+    a->capacity = 0;
+}
+
+// Read whatever part of the current frame is available without blocking.
+// Returns 1 once the frame is complete (payload NUL terminated), 0 if more data
+// is needed, -1 if the peer closed (errno 0) or the read or the frame was bad.
+int proto_assembler_feed(FrameAssembler *a, int sock) {
+    while (1) {
+        size_t want;
+        char *dest;
+        if (a->have < PROTO_HEADER_SIZE) {
+            want = PROTO_HEADER_SIZE - a->have;
+            dest = (char *)a->header_bytes + a->have;
+        } else {
+            size_t got = a->have - PROTO_HEADER_SIZE;
+            if (got == a->header.length) {
+                a->payload[got] = '\0';
+                return 1;
+            }
+            want = a->header.length - got;
+            dest = a->payload + got;
+        }
+
+        ssize_t n = recv(sock, dest, want, MSG_DONTWAIT);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 0;
+        }
+        if (n == 0) {
+            errno = 0;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        a->have += n;
+
+        if (a->have == PROTO_HEADER_SIZE) {
+            if (proto_decode_header(a->header_bytes, &a->header) < 0) {
+                errno = EPROTO;
+                return -1;
+            }
+            if (a->header.length + 1 > a->capacity) {
+                char *grown = (char *)realloc(a->payload, a->header.length + 1);
+                if (!grown) {
+                    return -1;
+                }
+                a->payload = grown;
+                a->capacity = a->header.length + 1;
+            }
+        }
+    }
+}
+
+// Start on the next frame, keeping the payload buffer
+void proto_assembler_reset(FrameAssembler *a) {
+    a->have = 0;
+}
+
+void proto_assembler_free(FrameAssembler *a) {
+    free(a->payload);
+    a->payload = NULL;
+    a->capacity = 0;
+}
+
+// Translate a message of the text protocol into the equivalent frame.
+// Anything not recognized is a command, a lone character is a connection hello.
+int proto_text_to_frame(const char *text, FrameHeader *header, ProtoWriter *payload) {
+    char first[256];
+    char second[256];
+    unsigned long long number;
+    int port;
+
+    header->flags = 0;
+    header->request_id = 0;
+    if (sscanf(text, "ACK:%llu", &number) == 1) {
+        header->opcode = OP_ACK;
+        proto_put_u64(payload, number);
+    } else if (sscanf(text, "Storage Server IP: %255[^,], Port: %d", first, &port) == 2) {
+        header->opcode = OP_SS_LOCATION;
+        proto_put_str(payload, first);
+        proto_put_u16(payload, (uint16_t)port);
+    } else if (sscanf(text, "ASYNCWRITE_COMPLETE %255s %*s %*d %255[^\n]", first, second) == 2) {
+        header->opcode = OP_ASYNC_COMPLETE;
+        bool ok = strncmp(second, "ASYNC WRITE SUCCESS", 19) == 0;
+        proto_put_u16(payload, ok ? PROTO_STATUS_OK : PROTO_STATUS_FAILED);
+        proto_put_str(payload, first);
+        proto_put_bytes(payload, second, strlen(second));
+    } else if (sscanf(text, "Async write completed for file: %255s", first) == 1) {
+        header->opcode = OP_ASYNC_COMPLETE;
+        proto_put_u16(payload, PROTO_STATUS_OK);
+        proto_put_str(payload, first);
+    } else if (sscanf(text, "Metadata: %255[^,], Client Port: %d", first, &port) == 2) {
+        header->opcode = OP_REGISTER;
+        proto_put_u16(payload, (uint16_t)port);
+        proto_put_str(payload, first);
+        const char *paths = strstr(text, "Paths:");
+        if (paths) {
+            paths += 6;
+            while (*paths) {
+                size_t skip = strspn(paths, " ");
+                size_t len = strcspn(paths + skip, " ");
+                if (len == 0) {
+                    break;
+                }
+                proto_put_u16(payload, (uint16_t)len);
+                proto_put_bytes(payload, paths + skip, len);
+                paths += skip + len;
+            }
+        }
+    } else if (text[0] != '\0' && text[1] == '\0') {
+        header->opcode = OP_HELLO;
+        proto_put_u8(payload, (uint8_t)text[0]);
+    } else {
+        header->opcode = OP_COMMAND;
+        proto_put_bytes(payload, text, strlen(text));
+    }
+    header->length = (uint32_t)payload->len;
+    return payload->overflow ? -1 : 0;
+}
+
+// Render a frame the way the text protocol sent it. Returns the text length,
+// or -1 if the payload is malformed or the text does not fit.
+int proto_frame_to_text(const FrameHeader *header, const void *payload, char *text, size_t size) {
+    ProtoReader r;
+    char field[256];
+    int len = 0;
+    proto_reader_init(&r, payload, header->length);
+
+    switch (header->opcode) {
+    case OP_HELLO:
+        len = snprintf(text, size, "%c", proto_get_u8(&r));
+        break;
+    case OP_ACK:
+        len = snprintf(text, size, "ACK:%llu", (unsigned long long)proto_get_u64(&r));
+        break;
+    case OP_SS_LOCATION: {
+        proto_get_str(&r, field, sizeof(field));
+        int port = proto_get_u16(&r);
+        len = snprintf(text, size, "Storage Server IP: %s, Port: %d", field, port);
+        break;
+    }
+    case OP_RESULT:
+    case OP_END:
+        proto_get_u16(&r);
+        len = (int)proto_get_rest(&r, text, size);
+        break;
+    case OP_ASYNC_COMPLETE:
+        proto_get_u16(&r);
+        proto_get_str(&r, field, sizeof(field));
+        len = snprintf(text, size, "Async write completed for file: %s", field);
+        break;
+    case OP_REGISTER: {
+        int port = proto_get_u16(&r);
+        proto_get_str(&r, field, sizeof(field));
+        len = snprintf(text, size, "Metadata: %s, Client Port: %d, Paths:", field, port);
+        while (!r.error && proto_remaining(&r) > 0 && len >= 0 && (size_t)len < size) {
+            proto_get_str(&r, field, sizeof(field));
+            len += snprintf(text + len, size - len, " %s", field);
+        }
+        break;
+    }
+    case OP_COMMAND:
+    case OP_DATA:
+    default:
+        len = (int)proto_get_rest(&r, text, size);
+        break;
+    }
+    if (r.error || len < 0 || (size_t)len >= size) {
+        return -1;
+    }
+    return len;
+}
+
+// Send a frame to a framed peer, or its text rendering to a text protocol peer
+int proto_send_compat(int sock, bool framed, uint8_t opcode, uint8_t flags, uint64_t request_id,
+                      const void *payload, size_t length) {
+    if (framed) {
+        return proto_send_frame(sock, opcode, flags, request_id, payload, length);
+    }
+
+    char stack_text[4096];
+    char *text = stack_text;
+    size_t size = length + 128;
+    if (size > sizeof(stack_text)) {
+        text = (char *)malloc(size);
+        if (!text) {
+            return -1;
+        }
+    } else {
+        size = sizeof(stack_text);
+    }
+    FrameHeader header = {opcode, flags, (uint32_t)length, request_id};
+    int len = proto_frame_to_text(&header, payload, text, size);
+    struct iovec iov = {text, len > 0 ? (size_t)len : 0};
+    int result = len < 0 ? -1 : send_iov(sock, &iov, 1);
+    if (text != stack_text) {
+        free(text);
+    }
+    return result;
+}
+
+// Reply with a status and message: a frame for framed peers, the bare message otherwise
+int proto_reply(int sock, bool framed, uint8_t opcode, uint8_t flags, uint64_t request_id,
+                uint16_t status, const char *text) {
+    if (framed) {
+        return proto_send_result(sock, opcode, flags, request_id, status, text);
+    }
+    struct iovec iov = {(void *)text, strlen(text)};
+    return send_iov(sock, &iov, 1);
+}
@@ -0,0 +1,121 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Every message is a frame: a fixed 16 byte header followed by length bytes of payload.
+//   magic(1) version(1) opcode(1) flags(1) length(4) request_id(8), integers big-endian
+// The magic byte is never the first byte of a text message, so a receiver can tell
+// framed peers from ones still speaking the old text protocol by the first byte.
+#define PROTO_MAGIC 0xF5
+#define PROTO_VERSION 1
+#define PROTO_HEADER_SIZE 16
+#define PROTO_MAX_PAYLOAD (1 << 20)  // Largest payload accepted, registrations of big trees included
+#define PROTO_MAX_STRING 65535       // Strings inside payloads carry a 16 bit length
+
+// Sent as text by the storage server on every new connection, before it knows who connected
+#define PROTO_SS_BANNER "Handling client request"
+
+// Opcodes and their payloads
+enum ProtoOpcode {
+    OP_HELLO = 1,       // Client -> NS: u8 connection type ('C')
+    OP_ACK,             // NS -> client: u64 ACK number of the session
+    OP_COMMAND,         // Command line as typed by the user, the whole payload
+    OP_SS_LOCATION,     // NS -> client: str ip, u16 port of the storage server to contact
+    OP_RESULT,          // Reply: u16 status, then message text filling the rest
+    OP_DATA,            // Part of a file's contents, the whole payload
+    OP_END,             // Last frame of a multi-frame reply: u16 status
+    OP_REGISTER,        // SS -> NS: u16 client port, str metadata, then one str per path
+    OP_ASYNC_COMPLETE,  // SS -> NS -> client: u16 status, str filename, then result text
+    OP_FILE,            // SS -> client: u64 size, u64 offset, u64 file size, then exactly size raw bytes follow the frame
+    OP_UPLOAD,          // Client -> SS: str "WRITE <path>" or "APPEND <path>", u64 size, then size raw bytes
+    OP_ASYNC_ACCEPTED   // SS -> NS on its registered connection: str filename, the WRITE was queued
+};
+
+#define PROTO_FLAG_ASYNC 0x01  // WRITE accepted, the outcome follows as OP_ASYNC_COMPLETE
+// On the OP_COMMAND or OP_UPLOAD of a WRITE/APPEND: how durable the data must be before
+// the reply (or async completion) is sent. At most one is set, none keeps the server default.
+#define PROTO_FLAG_NO_SYNC 0x02       // Left in the page cache
+#define PROTO_FLAG_FDATASYNC 0x04     // fdatasync() before the file is closed
+#define PROTO_FLAG_GROUP_COMMIT 0x08  // Synced together with concurrent writers
+
+// Status carried by OP_RESULT, OP_END and OP_ASYNC_COMPLETE: 0 or one of the ERR_ codes
+#define PROTO_STATUS_OK 0
+#define PROTO_STATUS_FAILED 1  // Failure reported by a text peer, which gives no error code
+
+typedef struct {
+    uint8_t opcode;
+    uint8_t flags;
+    uint32_t length;             // Payload bytes following the header
+    uint64_t request_id;         // ID the naming server gave the command, 0 if none
+} FrameHeader;
+
+// Serializes typed fields into a caller provided buffer
+typedef struct {
+    unsigned char *data;
+    size_t len;
+    size_t capacity;
+    bool overflow;               // A field did not fit, the payload is unusable
+} ProtoWriter;
+
+// Parses typed fields out of a received payload
+typedef struct {
+    const unsigned char *data;
+    size_t len;
+    size_t pos;
+    bool error;                  // Ran past the end or a string did not fit
+} ProtoReader;
+
+// Incremental frame assembly for non-blocking sockets, one per connection
+typedef struct {
+    unsigned char header_bytes[PROTO_HEADER_SIZE];
+    size_t have;                 // Header plus payload bytes received so far
+    FrameHeader header;
+    char *payload;               // Grown as needed and reused for later frames
+    size_t capacity;
+} FrameAssembler;
+
+void proto_encode_header(const FrameHeader *header, unsigned char *out);
+int proto_decode_header(const unsigned char *in, FrameHeader *header);
+bool proto_is_frame_start(const void *data, size_t len);
+
+void proto_writer_init(ProtoWriter *w, void *buffer, size_t capacity);
+void proto_put_u8(ProtoWriter *w, uint8_t value);
+void proto_put_u16(ProtoWriter *w, uint16_t value);
+void proto_put_u32(ProtoWriter *w, uint32_t value);
+void proto_put_u64(ProtoWriter *w, uint64_t value);
+void proto_put_str(ProtoWriter *w, const char *s);
+void proto_put_bytes(ProtoWriter *w, const void *data, size_t len);
+
+void proto_reader_init(ProtoReader *r, const void *payload, size_t len);
+uint8_t proto_get_u8(ProtoReader *r);
+uint16_t proto_get_u16(ProtoReader *r);
+uint32_t proto_get_u32(ProtoReader *r);
+uint64_t proto_get_u64(ProtoReader *r);
+bool proto_get_str(ProtoReader *r, char *out, size_t size);
+size_t proto_get_rest(ProtoReader *r, char *out, size_t size);
+size_t proto_remaining(const ProtoReader *r);
+
+int proto_send_frame(int sock, uint8_t opcode, uint8_t flags, uint64_t request_id,
+                     const void *payload, size_t length);
+int proto_send_result(int sock, uint8_t opcode, uint8_t flags, uint64_t request_id,
+                      uint16_t status, const char *text);
+int proto_recv_frame(int sock, FrameHeader *header, void *payload, size_t capacity);
+int proto_recv_exact(int sock, void *buffer, size_t length);
+int proto_expect_banner(int sock);
+
+void proto_assembler_init(FrameAssembler *a);
+int proto_assembler_feed(FrameAssembler *a, int sock);
+void proto_assembler_reset(FrameAssembler *a);
+void proto_assembler_free(FrameAssembler *a);
+
+// Compatibility with peers that still speak the text protocol
+int proto_text_to_frame(const char *text, FrameHeader *header, ProtoWriter *payload);
+int proto_frame_to_text(const FrameHeader *header, const void *payload, char *text, size_t size);
+int proto_send_compat(int sock, bool framed, uint8_t opcode, uint8_t flags, uint64_t request_id,
+                      const void *payload, size_t length);
+int proto_reply(int sock, bool framed, uint8_t opcode, uint8_t flags, uint64_t request_id,
+                uint16_t status, const char *text);
+
+#endif
@@ -3,8 +3,8 @@
 
 char *NS_IP;
 int NS_port;
-int NS_sock;
-#define ACK_BUFFER_SIZE 512
+int NS_sock = -1;  // Connection the storage server registered on, -1 until then
+#define ACK_BUFFER_SIZE (BUFFER_SIZE + 512)  // Completion frame: status, file name and result
 // Function to check if path is a directory
 int is_directory(const char *path) {
     struct stat path_stat;
@@ -409,9 +409,10 @@ int is_file(const char* path){
     stat(path,&path_stat);
     return S_ISREG(path_stat.st_mode);
 }
-void send_file_info(int client_socket, const char *filename) {
+void send_file_info(int client_socket, const char *filename, bool framed, unsigned long long request_id) {
     struct stat st;
     char buffer[512];  // Buffer to store message
+    int status = PROTO_STATUS_OK;
 
     if (stat(filename, &st) == 0) {
         // File size
@@ -460,10 +461,11 @@ void send_file_info(int client_socket, const char *filename) {
                  size, permissions, file_type, mod_time);
     } else {
         snprintf(buffer, sizeof(buffer), "Error: Unable to get info for file %s\n", filename);
+        status = ERR_FILE_NOT_FOUND;
     }
 
     // Send the buffer to the client
-    send(client_socket, buffer, strlen(buffer), 0);
+    proto_reply(client_socket, framed, OP_RESULT, 0, request_id, status, buffer);
 }
 int count_files_in_directory(const char *directory_path) {
     int file_count = 0;
@@ -546,12 +548,12 @@ int delete_directory_contents(const char *directory_path) {
     closedir(dp);
     return 0;
 }
-// Function to handle the DELETE command
-void handle_delete_command(const char *path, char *response, int client_socket) {
+// Function to handle the DELETE command, returns the status to reply with
+int handle_delete_command(const char *path, char *response) {
+    int status = PROTO_STATUS_OK;
     if (!is_path_valid(path)) {
         snprintf(response, BUFFER_SIZE, "Error: Path '%s' does not exist.", path);
-        send(client_socket, response, strlen(response), 0);
-        return;
+        return ERR_PATH_NOT_FOUND;
     }
 
     if (is_file(path)) {
@@ -566,6 +568,7 @@ void handle_delete_command(const char *path, char *response, int client_socket)
                 snprintf(response, BUFFER_SIZE, "File '%s' deleted successfully.", path);
             } else {
                 snprintf(response, BUFFER_SIZE, "Error: Could not delete file '%s'.", path);
+                status = ERR_FAILED_TO_DELETE;
             }
        // } 
         // else {
@@ -576,8 +579,7 @@ void handle_delete_command(const char *path, char *response, int client_socket)
         int file_count = count_files_in_directory(path);
         if (file_count < 0) {
             snprintf(response, BUFFER_SIZE, "Error: Unable to access directory '%s'.", path);
-            send(client_socket, response, strlen(response), 0);
-            return;
+            return ERR_FAILED_TO_DELETE;
         }
         // snprintf(response, BUFFER_SIZE, "Directory '%s' contains %d items. Are you sure you want to delete it and all its contents? (yes/no)", path, file_count);
         // send(client_socket, response, strlen(response), 0);
@@ -591,6 +593,7 @@ void handle_delete_command(const char *path, char *response, int client_socket)
                     snprintf(response, BUFFER_SIZE, "Directory '%s' deleted successfully.", path);
                 } else {
                     snprintf(response, BUFFER_SIZE, "Error: Could not delete directory '%s'.", path);
+                    status = ERR_FAILED_TO_DELETE;
                 }
             } else {
                 // Delete all contents first, then delete the directory itself
@@ -598,6 +601,7 @@ void handle_delete_command(const char *path, char *response, int client_socket)
                     snprintf(response, BUFFER_SIZE, "Directory '%s' and all its contents deleted successfully.", path);
                 } else {
                     snprintf(response, BUFFER_SIZE, "Error: Could not delete directory '%s' or its contents.", path);
+                    status = ERR_FAILED_TO_DELETE;
                 }
             }
 
@@ -608,18 +612,17 @@ void handle_delete_command(const char *path, char *response, int client_socket)
         // }
     }
 printf("this is message:%s",response);
-    // Send the final response to the client
-    send(client_socket, response, strlen(response), 0);
+    return status;
 }
-// Function to handle the CREATE command
-void handle_create_command(const char *path, const char *name, const char type, char *response) {
+// Function to handle the CREATE command, returns the status to reply with
+int handle_create_command(const char *path, const char *name, const char type, char *response) {
     char full_path[BUFFER_SIZE];
     snprintf(full_path, sizeof(full_path), "%s/%s", path, name);
 
     // Check if the given path is a file
     if (is_file(path)) {
         snprintf(response, BUFFER_SIZE, "Error: The given path for create operation leads to a file.");
-        return;
+        return ERR_FAILED_TO_CREATE;
     }
 
     // Check if we need to create a file or directory
@@ -628,6 +631,7 @@ void handle_create_command(const char *path, const char *name, const char type,
         if (file == NULL) {
             printf("Error Failed to create file (ERROR CODE %d)\n",ERR_FAILED_TO_CREATE);
             snprintf(response, BUFFER_SIZE, "Error: Failed to create file at %s.", full_path);
+            return ERR_FAILED_TO_CREATE;
         } else {
             fclose(file);
             snprintf(response, BUFFER_SIZE, "Success in creating file at %s.", full_path);
@@ -636,20 +640,24 @@ void handle_create_command(const char *path, const char *name, const char type,
         if (mkdir(full_path, 0777) != 0) {
             printf("Error Failed to create directory (ERROR CODE %d)\n",ERR_FAILED_TO_CREATE);
             snprintf(response, BUFFER_SIZE, "Error: Failed to create directory at %s.", full_path);
+            return ERR_FAILED_TO_CREATE;
         } else {
             snprintf(response, BUFFER_SIZE, "Success in created at %s.", full_path);
         }
     } else {
         snprintf(response, BUFFER_SIZE, "Error: Invalid type. Use 'F' for file or 'D' for directory.");
+        return ERR_INVALID_COMMAND;
     }
-
+    return PROTO_STATUS_OK;
 }
 ////////////////////////////////////////////
 void send_completion_ack_to_ns(const char* filename, const char* client_ip, 
-                             int client_port, const char* result) {
+                             int client_port, unsigned long long request_id,
+                             int status, const char* result) {
     int ns_socket;
     struct sockaddr_in ns_addr;
     char ack_buffer[ACK_BUFFER_SIZE];
+    ProtoWriter ack;
     
     // Create socket for NS communication
     ns_socket = socket(AF_INET, SOCK_STREAM, 0);
@@ -676,75 +684,503 @@ void send_completion_ack_to_ns(const char* filename, const char* client_ip,
         return;
     }
     
-    // Prepare completion acknowledgment message
-    snprintf(ack_buffer, sizeof(ack_buffer), 
-             "ASYNCWRITE_COMPLETE %s %s %d %s", 
-             filename, client_ip, client_port, result);
+    // Prepare completion acknowledgment, the request ID lets the NS find the waiting client
+    proto_writer_init(&ack, ack_buffer, sizeof(ack_buffer));
+    proto_put_u16(&ack, status);
+    proto_put_str(&ack, filename);
+    proto_put_bytes(&ack, result, strlen(result));
     
     // Send acknowledgment to NS
-    send(ns_socket, ack_buffer, strlen(ack_buffer), 0);
+    if (ack.overflow || proto_send_frame(ns_socket, OP_ASYNC_COMPLETE, 0, request_id, ack.data, ack.len) < 0) {
+        printf("socket send error (ERROR CODE %d)\n",ERR_SOCK_SEND);
+        perror("Error sending completion to Naming Server");
+    }
     
     // Close NS connection
     close(ns_socket);
-    printf("Sent completion acknowledgment to NS for file: %s\n", filename);
+    printf("Sent completion acknowledgment to NS for file: %s (client %s:%d)\n", filename, client_ip, client_port);
 }
 
-void* async_write_task(void *arg) {
-    // Cast the argument to the correct structure type
-    char buffer1[BUFFER_SIZE];
-    WriteTaskArgs *task_args = (WriteTaskArgs*)arg;
+static int write_fully(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t written = write(fd, data, len);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written < 0) {
+            return -1;
+        }
+        data += written;
+        len -= written;
+    }
+    return 0;
+}
+
+// Run one async write and report it to the naming server. Returns its status.
+int async_write_task(WriteTaskArgs *task_args) {
     char *filename = task_args->filename;
     char *data = task_args->data;
     char result[BUFFER_SIZE];
+    int status = PROTO_STATUS_OK;
 
 
     printf("Asynchronous write task started for file: '%s'\n", filename);
     fflush(stdout);
 
-    // Open the file to write asynchronously
-    FILE *file = fopen(filename, "w");  // Open in append mode
-    if (file) {
-        // Simulate chunked writing (flush periodically)
-        int chunk_size = 1024;  // Adjust chunk size as needed
-        int data_len = strlen(data);
-        int written = 0;
-        while (written < data_len) {
-            int chunk = (data_len - written > chunk_size) ? chunk_size : (data_len - written);
-            fwrite(data + written, 1, chunk, file);
-            written += chunk;
-            fflush(file);  // Flush periodically to disk
-        }
-        fclose(file);
-
-        // After write is complete, you can optionally notify the Naming Server or client (if needed)
-        // printf("Asynchronous write completed for file: %s\n", filename);
-        snprintf(result, sizeof(result), "ASYNC WRITE SUCCESS, File written successfully");
-        printf("Asynchronous write completed for file: %s client\n", task_args->filename);
-        // Notify NS of the write completion
-        
-        // snprintf(buffer1, sizeof(buffer1), "Async Success: Data written Asynchronously to %s\n", filename);
-        // send()
-    } else {
+    // One write() for the whole buffer, then as much syncing as the request asked for
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
         snprintf(result, sizeof(result), "ERROR Failed to write file");
+        status = ERR_FAILED_TO_WRITE;
         printf("Error Failed to open file (ERROR CODE %d)\n",ERR_OPENING);
         perror("Failed to open file for asynchronous writing");
+    } else if (write_fully(fd, data, task_args->data_len) < 0 || make_durable(fd, task_args->durability) < 0) {
+        snprintf(result, sizeof(result), "ERROR Failed to write file");
+        status = ERR_FAILED_TO_WRITE;
+        printf("Error Failed to write to file (ERROR CODE %d)\n",ERR_FAILED_TO_WRITE);
+        perror("Asynchronous write failed");
+    } else {
+        snprintf(result, sizeof(result), "ASYNC WRITE SUCCESS, File written successfully");
+        printf("Asynchronous write completed for file: %s client\n", task_args->filename);
+    }
+    if (fd >= 0) {
+        close(fd);
     }
 
     send_completion_ack_to_ns(task_args->filename, 
                             task_args->client_ip,
                             task_args->client_port,
+                            task_args->request_id,
+                            status,
                             result);
 
     // Free the allocated memory for task_args
-    // free(task_args->filename);
-    // free(task_args->data);
-    // free(task_args->client_ip);
-    // free(task_args->client_port);
+    free(task_args->filename);
+    free(task_args->data);
     free(task_args);
+    return status;
+}
+
+AsyncWriteExecutor async_executor;
+
+static long monotonic_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+static unsigned int lane_bucket(const char *filename) {
+    unsigned int hash = 5381;
+    while (*filename) {
+        hash = hash * 33 + (unsigned char)*filename++;
+    }
+    return hash % ASYNC_WRITE_LANE_BUCKETS;
+}
+
+// Caller holds async_executor.lock
+static void push_ready_lane(WriteLane *lane) {
+    lane->queued = true;
+    lane->ready_next = NULL;
+    if (async_executor.ready_tail) {
+        async_executor.ready_tail->ready_next = lane;
+    } else {
+        async_executor.ready_head = lane;
+    }
+    async_executor.ready_tail = lane;
+    pthread_cond_signal(&async_executor.ready);
+}
+
+void init_async_write_executor() {
+    memset(&async_executor, 0, sizeof(async_executor));
+    pthread_mutex_init(&async_executor.lock, NULL);
+    pthread_cond_init(&async_executor.ready, NULL);
+    for (int i = 0; i < ASYNC_WRITE_WORKERS; i++) {
+        pthread_t thread_id;
+        if (pthread_create(&thread_id, NULL, async_write_worker, NULL) != 0) {
+            perror("Error creating thread");
+            continue;
+        }
+        pthread_detach(thread_id);
+    }
+}
+
+// Queue a write behind earlier ones to the same file. Returns -1, leaving the task
+// to the caller, when the executor already holds its limit of writes or bytes.
+int submit_async_write(WriteTaskArgs *task) {
+    unsigned int bucket = lane_bucket(task->filename);
+    task->next = NULL;
+    task->submitted_us = monotonic_us();
+
+    pthread_mutex_lock(&async_executor.lock);
+    if (async_executor.depth >= ASYNC_WRITE_QUEUE_LIMIT ||
+        async_executor.bytes + task->data_len > ASYNC_WRITE_MAX_BYTES) {
+        async_executor.rejected++;
+        pthread_mutex_unlock(&async_executor.lock);
+        return -1;
+    }
+
+    WriteLane *lane = async_executor.lanes[bucket];
+    while (lane && strcmp(lane->filename, task->filename) != 0) {
+        lane = lane->chain_next;
+    }
+    if (!lane) {
+        lane = calloc(1, sizeof(WriteLane));
+        lane->filename = strdup(task->filename);
+        lane->chain_next = async_executor.lanes[bucket];
+        async_executor.lanes[bucket] = lane;
+    }
+    if (lane->tail) {
+        lane->tail->next = task;
+    } else {
+        lane->head = task;
+    }
+    lane->tail = task;
+
+    async_executor.depth++;
+    if (async_executor.depth > async_executor.peak_depth) {
+        async_executor.peak_depth = async_executor.depth;
+    }
+    async_executor.bytes += task->data_len;
+    async_executor.submitted++;
+    if (!lane->running && !lane->queued) {
+        push_ready_lane(lane);
+    }
+    pthread_mutex_unlock(&async_executor.lock);
+    return 0;
+}
+
+// Take a file with writes waiting, run its oldest write, then put the file back
+// on the ready list if more arrived meanwhile
+void *async_write_worker(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&async_executor.lock);
+    while (1) {
+        while (!async_executor.ready_head) {
+            pthread_cond_wait(&async_executor.ready, &async_executor.lock);
+        }
+        WriteLane *lane = async_executor.ready_head;
+        async_executor.ready_head = lane->ready_next;
+        if (!async_executor.ready_head) {
+            async_executor.ready_tail = NULL;
+        }
+        lane->queued = false;
+        lane->running = true;
+        WriteTaskArgs *task = lane->head;
+        lane->head = task->next;
+        if (!lane->head) {
+            lane->tail = NULL;
+        }
+        pthread_mutex_unlock(&async_executor.lock);
+
+        size_t data_len = task->data_len;
+        long submitted_us = task->submitted_us;
+        int status = async_write_task(task);
+        long latency = monotonic_us() - submitted_us;
+
+        pthread_mutex_lock(&async_executor.lock);
+        async_executor.depth--;
+        async_executor.bytes -= data_len;
+        async_executor.completed++;
+        if (status != PROTO_STATUS_OK) {
+            async_executor.failed++;
+        }
+        async_executor.latency_us += latency;
+        int slot = 0;
+        for (long limit = 1000; slot < ASYNC_LATENCY_BUCKETS - 1 && latency >= limit; limit *= 10) {
+            slot++;
+        }
+        async_executor.latency[slot]++;
+
+        lane->running = false;
+        if (lane->head) {
+            push_ready_lane(lane);
+        } else {
+            // Drained, forget the file until it is written again
+            WriteLane **link = &async_executor.lanes[lane_bucket(lane->filename)];
+            while (*link != lane) {
+                link = &(*link)->chain_next;
+            }
+            *link = lane->chain_next;
+            free(lane->filename);
+            free(lane);
+        }
+    }
     return NULL;
 }
+
+Durability default_durability = DURABILITY_NONE;
+GroupCommit group_commits = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .done = PTHREAD_COND_INITIALIZER
+};
+
+// Queue depth, refusals and completion latency of the async writes, and group commits, for STATS
+void format_async_write_stats(char *report, size_t size) {
+    pthread_mutex_lock(&async_executor.lock);
+    unsigned long completed = async_executor.completed;
+    snprintf(report, size,
+             "Async write queue: %d (peak %d, limit %d), %zu bytes queued\n"
+             "Async writes accepted: %lu, refused: %lu, completed: %lu, failed: %lu\n"
+             "Async write latency: avg %luus, <1ms %lu, <10ms %lu, <100ms %lu, <1s %lu, <10s %lu, >=10s %lu",
+             async_executor.depth, async_executor.peak_depth, ASYNC_WRITE_QUEUE_LIMIT, async_executor.bytes,
+             async_executor.submitted, async_executor.rejected, completed, async_executor.failed,
+             completed ? async_executor.latency_us / completed : 0,
+             async_executor.latency[0], async_executor.latency[1], async_executor.latency[2],
+             async_executor.latency[3], async_executor.latency[4], async_executor.latency[5]);
+    pthread_mutex_unlock(&async_executor.lock);
+
+    size_t used = strlen(report);
+    pthread_mutex_lock(&group_commits.lock);
+    snprintf(report + used, size - used, "\nWrite durability: default %s, %lu group commits for %lu writes",
+             durability_name(default_durability), group_commits.batches, group_commits.writers);
+    pthread_mutex_unlock(&group_commits.lock);
+}
+
+// Returns the Durability called name (none, fdatasync or group), -1 if there is none
+int parse_durability(const char *name) {
+    if (strcmp(name, "none") == 0) {
+        return DURABILITY_NONE;
+    }
+    if (strcmp(name, "fdatasync") == 0) {
+        return DURABILITY_FDATASYNC;
+    }
+    if (strcmp(name, "group") == 0) {
+        return DURABILITY_GROUP;
+    }
+    return -1;
+}
+
+const char *durability_name(Durability mode) {
+    return mode == DURABILITY_FDATASYNC ? "fdatasync" : mode == DURABILITY_GROUP ? "group" : "none";
+}
+
+// The durability a framed WRITE/APPEND asked for, the server default if it did not
+Durability durability_from_flags(uint8_t flags) {
+    if (flags & PROTO_FLAG_GROUP_COMMIT) {
+        return DURABILITY_GROUP;
+    }
+    if (flags & PROTO_FLAG_FDATASYNC) {
+        return DURABILITY_FDATASYNC;
+    }
+    if (flags & PROTO_FLAG_NO_SYNC) {
+        return DURABILITY_NONE;
+    }
+    return default_durability;
+}
+
+// Make the data written to fd as durable as mode asks. Returns -1 with errno set if a sync failed.
+int make_durable(int fd, Durability mode) {
+    if (mode == DURABILITY_FDATASYNC) {
+        return fdatasync(fd);
+    }
+    if (mode == DURABILITY_GROUP) {
+        return group_commit(fd);
+    }
+    return 0;
+}
+
+// Writers waiting to sync share one batch. Whoever finds no batch being started leads
+// one for everybody queued so far; writers arriving meanwhile join the next. When the
+// last batch showed concurrent writers, the leader first waits GROUP_COMMIT_WINDOW_US
+// so more of them can join. The leader starts writeback on every file of the batch,
+// then all of them fdatasync() their own file at once, so the syncs overlap and share
+// journal commits while each writer sees the writeback errors of its own file only.
+int group_commit(int fd) {
+    CommitWaiter self = { .fd = fd };
+
+    pthread_mutex_lock(&group_commits.lock);
+    self.next = group_commits.pending;
+    group_commits.pending = &self;
+    while (group_commits.syncing && !self.done) {
+        pthread_cond_wait(&group_commits.done, &group_commits.lock);
+    }
+    if (self.done) {
+        pthread_mutex_unlock(&group_commits.lock);
+        return fdatasync(fd);
+    }
+    group_commits.syncing = true;
+    if (group_commits.last_batch > 1) {
+        pthread_mutex_unlock(&group_commits.lock);
+        usleep(GROUP_COMMIT_WINDOW_US);
+        pthread_mutex_lock(&group_commits.lock);
+    }
+    CommitWaiter *batch = group_commits.pending;
+    group_commits.pending = NULL;
+    pthread_mutex_unlock(&group_commits.lock);
+
+    // Followers stay blocked until done is set, so their entries are safe to use here.
+    // Only a hint, fdatasync() below reports any error.
+    unsigned long writers = 0;
+    for (CommitWaiter *w = batch; w; w = w->next) {
+        sync_file_range(w->fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+        writers++;
+    }
+
+    pthread_mutex_lock(&group_commits.lock);
+    for (CommitWaiter *w = batch; w; w = w->next) {
+        w->done = true;
+    }
+    group_commits.batches++;
+    group_commits.writers += writers;
+    group_commits.last_batch = writers;
+    group_commits.syncing = false;
+    pthread_cond_broadcast(&group_commits.done);
+    pthread_mutex_unlock(&group_commits.lock);
+
+    return fdatasync(fd);
+}
 /////////////////////////////////////////////////////////////////////
-void handle_client_request(char* buffer, char*command, char*filename, int client_socket) {
+// Send part of a READ reply: an OP_DATA frame to framed peers, the bare bytes otherwise
+static int send_read_data(int client_socket, bool framed, unsigned long long request_id,
+                          const char *data, size_t len) {
+    if (framed) {
+        return proto_send_frame(client_socket, OP_DATA, 0, request_id, data, len);
+    }
+    return send(client_socket, data, len, 0) < 0 ? -1 : 0;
+}
+
+// Send length bytes of a regular file from offset: to framed peers an OP_FILE header
+// carrying the range, then the bytes through the file I/O engine (sendfile() by default),
+// then OP_END. Returns -1 if the reply was cut short and the connection can no longer be used.
+static int send_file_contents(int client_socket, int fd, off_t offset, off_t length, off_t file_size,
+                              bool framed, unsigned long long request_id) {
+    unsigned char range_fields[24];
+    ProtoWriter header;
+    int cork = 1;
+
+    // Hold back partial segments so the header, data and OP_END share packets
+    setsockopt(client_socket, IPPROTO_TCP, TCP_CORK, &cork, sizeof(cork));
+    if (framed) {
+        proto_writer_init(&header, range_fields, sizeof(range_fields));
+        proto_put_u64(&header, length);
+        proto_put_u64(&header, offset);
+        proto_put_u64(&header, file_size);
+        if (proto_send_frame(client_socket, OP_FILE, 0, request_id, header.data, header.len) < 0) {
+            return -1;
+        }
+    }
+
+    if (io_engine_send_file(client_socket, fd, offset, length) < 0) {
+        // Error, or the file shrank after the size went out
+        printf("socket send error (ERROR CODE %d)\n",ERR_SOCK_SEND);
+        perror("Error sending file");
+        return -1;
+    }
+
+    if (framed && proto_send_result(client_socket, OP_END, 0, request_id, PROTO_STATUS_OK, NULL) < 0) {
+        return -1;
+    }
+    cork = 0;
+    setsockopt(client_socket, IPPROTO_TCP, TCP_CORK, &cork, sizeof(cork));
+    return 0;
+}
+
+// Receive a streamed WRITE or APPEND. The OP_UPLOAD frame names the command and the
+// size, the raw bytes follow it and go to disk through the file I/O engine's fixed
+// buffers, so memory use does not grow with the file. Always synchronous, the reply is sent once
+// the last byte is written. Returns -1 if the connection can no longer be used.
+int handle_upload_request(int client_socket, const char *payload, size_t length,
+                          unsigned long long request_id, Durability durability) {
+    char command[BUFFER_SIZE];
+    char response[BUFFER_SIZE];
+    ProtoReader reader;
+    int status = PROTO_STATUS_OK;
+
+    proto_reader_init(&reader, payload, length);
+    proto_get_str(&reader, command, sizeof(command));
+    unsigned long long remaining = proto_get_u64(&reader);
+    if (reader.error) {
+        // Without the size there is no telling where the data ends
+        proto_reply(client_socket, true, OP_RESULT, 0, request_id, ERR_INVALID_COMMAND, "Malformed upload");
+        return -1;
+    }
+
+    char *save;
+    char *inst = strtok_r(command, " ", &save);
+    char *filename = strtok_r(NULL, " ", &save);
+    bool append = inst && strcmp(inst, "APPEND") == 0;
+    int fd = -1;
+    struct stat path_stat;
+    if (!inst || !filename || (!append && strcmp(inst, "WRITE") != 0)) {
+        snprintf(response, sizeof(response), "Error: Invalid upload command\n");
+        status = ERR_INVALID_COMMAND;
+    } else if (stat(filename, &path_stat) == 0 && S_ISDIR(path_stat.st_mode)) {
+        printf("Error Cannot perform %s on a directory (ERROR CODE %d)\n", inst, ERR_IS_DIRECTORY);
+        snprintf(response, sizeof(response), "Error: Cannot perform %s on a directory %s\n", inst, filename);
+        status = ERR_IS_DIRECTORY;
+    } else {
+        fd = open(filename, O_WRONLY | O_CREAT | (append ? O_APPEND : O_TRUNC), 0644);
+        if (fd < 0) {
+            status = append ? ERR_FAILED_TO_APPEND : ERR_FAILED_TO_WRITE;
+            printf("Error Failed to write to file (ERROR CODE %d)\n", status);
+            snprintf(response, sizeof(response), "Error: Unable to open file %s\n", filename);
+        }
+    }
+
+    // The data is read to its end even after a failure, so the connection stays usable
+    int write_error;
+    if (io_engine_recv_file(client_socket, fd, remaining, &write_error) < 0) {
+        printf("socket receive error (ERROR CODE %d)\n",ERR_SOCK_RECEIVE);
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    if (fd >= 0 && write_error) {
+        status = append ? ERR_FAILED_TO_APPEND : ERR_FAILED_TO_WRITE;
+        printf("Error Failed to write to file (ERROR CODE %d)\n", status);
+        snprintf(response, sizeof(response), "Error: Unable to write to file %s\n", filename);
+        close(fd);
+        fd = -1;
+    }
+    if (fd >= 0 && make_durable(fd, durability) < 0) {
+        status = append ? ERR_FAILED_TO_APPEND : ERR_FAILED_TO_WRITE;
+        printf("Error Failed to sync file (ERROR CODE %d)\n", status);
+        perror("Error syncing upload");
+        snprintf(response, sizeof(response), "Error: Unable to sync file %s\n", filename);
+        close(fd);
+        fd = -1;
+    }
+
+    if (fd >= 0) {
+        close(fd);
+        snprintf(response, sizeof(response), "Success: %llu bytes %s %s\n", remaining,
+                 append ? "appended to" : "written to", filename);
+    }
+    proto_reply(client_socket, true, OP_RESULT, 0, request_id, status, response);
+    return 0;
+}
+
+// READ <path> [<offset> [<length>]]: the byte range asked for. A negative offset counts
+// back from the end of the file, a missing length means up to the end.
+// Returns -1 if the range is malformed.
+static int parse_read_range(const char *command, long long *offset, long long *length) {
+    char copy[BUFFER_SIZE];
+    char *save;
+    long long *fields[2] = { offset, length };
+    *offset = 0;
+    *length = -1;
+    snprintf(copy, sizeof(copy), "%s", command);
+    strtok_r(copy, " ", &save);
+    strtok_r(NULL, " ", &save);
+    for (int i = 0; ; i++) {
+        char *token = strtok_r(NULL, " ", &save);
+        if (!token) {
+            return 0;
+        }
+        char *end;
+        errno = 0;
+        long long value = strtoll(token, &end, 10);
+        if (i == 2 || *end != '\0' || errno || (i == 1 && value < 0)) {
+            return -1;
+        }
+        *fields[i] = value;
+    }
+}
+
+// Returns -1 if the connection is left in an unusable state
+int handle_client_request(char* buffer, char*command, char*filename, int client_socket,
+                          bool framed, unsigned long long request_id, Durability durability) {
     char buffer1[BUFFER_SIZE];
     // memset(buffer, 0, sizeof(buffer));
     // recv(client_socket, buffer, sizeof(buffer), 0);
@@ -758,36 +1194,55 @@ void handle_client_request(char* buffer, char*command, char*filename, int client
     int is_directory = (stat(filename, &path_stat) == 0 && S_ISDIR(path_stat.st_mode));
 
     if (strcmp(command, "READ") == 0) {
+        // Framed peers get the contents as OP_DATA frames closed by OP_END,
+        // text peers as a byte stream that ends when the connection closes
         if (is_directory) {
             // If the path is a directory, list contents
             DIR *dir = opendir(filename);
             if (dir) {
                 struct dirent *entry;
                 snprintf(buffer1, sizeof(buffer1), "Directory contents of %s:\n", filename);
-                send(client_socket, buffer1, strlen(buffer1), 0);
+                send_read_data(client_socket, framed, request_id, buffer1, strlen(buffer1));
                 
                 while ((entry = readdir(dir)) != NULL) {
-                    snprintf(buffer, sizeof(buffer), "%s\n", entry->d_name);
-                    send(client_socket, buffer, strlen(buffer), 0);
+                    snprintf(buffer1, sizeof(buffer1), "%s\n", entry->d_name);
+                    send_read_data(client_socket, framed, request_id, buffer1, strlen(buffer1));
                 }
                 closedir(dir);
+                if (framed) {
+                    proto_send_result(client_socket, OP_END, 0, request_id, PROTO_STATUS_OK, NULL);
+                }
             } else {
                 printf("Error Failed to read directory (ERROR CODE %d)\n",ERR_FAILED_TO_WRITE);
-                snprintf(buffer, sizeof(buffer), "Error: Unable to open directory %s\n", filename);
-                send(client_socket, buffer, strlen(buffer), 0);
+                snprintf(buffer1, sizeof(buffer1), "Error: Unable to open directory %s\n", filename);
+                proto_reply(client_socket, framed, OP_END, 0, request_id, ERR_FAILED_TO_READ, buffer1);
             }
         } else {
-            // Read file and send contents to client
-            FILE *file = fopen(filename, "r");
-            if (file) {
-                while (fgets(buffer, sizeof(buffer), file)) {
-                    send(client_socket, buffer, strlen(buffer), 0);
-                }
-                fclose(file);
+            // Send file contents to client without copying them through user space,
+            // only the range asked for so the cost follows the bytes requested
+            long long offset, length;
+            int fd = -1;
+            struct stat file_stat;
+            if (parse_read_range(buffer, &offset, &length) < 0) {
+                printf("Error Invalid READ range (ERROR CODE %d)\n",ERR_INVALID_COMMAND);
+                snprintf(buffer1, sizeof(buffer1), "Error: Invalid range, use READ <path> [<offset> [<length>]]\n");
+                proto_reply(client_socket, framed, OP_END, 0, request_id, ERR_INVALID_COMMAND, buffer1);
+            } else if ((fd = open(filename, O_RDONLY)) >= 0 && fstat(fd, &file_stat) == 0 &&
+                       S_ISREG(file_stat.st_mode)) {
+                // Clamp the range to the file, a range past its end is empty
+                off_t size = file_stat.st_size;
+                off_t start = offset < 0 ? (offset > -size ? size + offset : 0) : (offset < size ? offset : size);
+                off_t count = length >= 0 && length < size - start ? length : size - start;
+                int result = send_file_contents(client_socket, fd, start, count, size, framed, request_id);
+                close(fd);
+                return result;
             } else {
+                if (fd >= 0) {
+                    close(fd);
+                }
                 printf("Error Failed to read file (ERROR CODE %d)\n",ERR_FAILED_TO_READ);
-                snprintf(buffer, sizeof(buffer), "Error: Unable to read file %s\n", filename);
-                send(client_socket, buffer, strlen(buffer), 0);
+                snprintf(buffer1, sizeof(buffer1), "Error: Unable to read file %s\n", filename);
+                proto_reply(client_socket, framed, OP_END, 0, request_id, ERR_FAILED_TO_READ, buffer1);
             }
         }
     }else if (strcmp(command, "WRITE") == 0) {
@@ -795,8 +1250,9 @@ void handle_client_request(char* buffer, char*command, char*filename, int client
             // printf(RED "Cannot perform WRITE on a directory (ERROR CODE %d)\n",ERR_IS_DIRECTORY);
             printf("Error Cannot perform WRITE on a directory (ERROR CODE %d)\n",ERR_IS_DIRECTORY);
             snprintf(buffer1, sizeof(buffer1), "Error: Cannot perform WRITE on a directory %s\n", filename);
-            send(client_socket, buffer1, strlen(buffer1), 0);
+            proto_reply(client_socket, framed, OP_RESULT, 0, request_id, ERR_IS_DIRECTORY, buffer1);
         } else {
+            int status = PROTO_STATUS_OK;
             // Extract filename and data
             char *data = strchr(buffer, ' ') + 1;  // Move to the filename part
             char *filename = data;
@@ -819,17 +1275,14 @@ void handle_client_request(char* buffer, char*command, char*filename, int client
                     
                 }
                 if (sync_flag == 2) {
-                    // Handle asynchronous write (immediate acknowledgment)
-                    char ack_msg[] = "Asynchronous write request accepted.";
-                    send(client_socket, ack_msg, strlen(ack_msg), 0);
-
-                    // Start the asynchronous write in the background
-                    pthread_t async_write_thread;
-
-                    // Prepare arguments for the thread
+                    // Handle asynchronous write (immediate acknowledgment), the flag tells
+                    // a framed client to wait for the completion from the naming server
                     WriteTaskArgs *args = malloc(sizeof(WriteTaskArgs));
                     args->filename = strdup(filename);  // Copy the filename
                     args->data = strdup(data);          // Copy the data
+                    args->data_len = data_size;
+                    args->durability = durability;
+                    args->request_id = request_id;
 
                     // Get client IP and port from socket
                     struct sockaddr_in addr;
@@ -837,36 +1290,59 @@ void handle_client_request(char* buffer, char*command, char*filename, int client
                     getpeername(client_socket, (struct sockaddr*)&addr, &addr_len);
                     inet_ntop(AF_INET, &addr.sin_addr, args->client_ip, INET_ADDRSTRLEN);
                     args->client_port = ntohs(addr.sin_port);
-                
 
-                    pthread_create(&async_write_thread, NULL, async_write_task, (void *)args);
-                    pthread_detach(async_write_thread);  // Detach the thread to run independently
+                    // Queue it behind earlier writes to the same file
+                    if (submit_async_write(args) < 0) {
+                        // Backpressure: refuse now, and close the naming server's record of it
+                        printf("Async write queue full (ERROR CODE %d)\n", ERR_SERVER_BUSY);
+                        send_completion_ack_to_ns(filename, args->client_ip, args->client_port, request_id,
+                                                  ERR_SERVER_BUSY, "Storage server busy");
+                        free(args->filename);
+                        free(args->data);
+                        free(args);
+                        snprintf(buffer1, sizeof(buffer1), "Error: Storage server busy, retry the write later\n");
+                        proto_reply(client_socket, framed, OP_RESULT, 0, request_id, ERR_SERVER_BUSY, buffer1);
+                        return 0;
+                    }
+                    send_ns_async_accepted(request_id, filename);
+                    char ack_msg[] = "Asynchronous write request accepted.";
+                    proto_reply(client_socket, framed, OP_RESULT, PROTO_FLAG_ASYNC, request_id, PROTO_STATUS_OK, ack_msg);
+                    return 0;
                 }
                 else{
                     FILE *file = fopen(filename, "w");
                     if (file) {
                         fprintf(file, "%s", data);  // Write data to file
-                        fclose(file);
-                        snprintf(buffer1, sizeof(buffer1), "Success: Data written to %s\n", filename);
+                        bool synced = fflush(file) == 0 && make_durable(fileno(file), durability) == 0;
+                        if (fclose(file) == 0 && synced) {
+                            snprintf(buffer1, sizeof(buffer1), "Success: Data written to %s\n", filename);
+                        } else {
+                            printf("Error Failed to write to file (ERROR CODE %d)\n",ERR_FAILED_TO_WRITE);
+                            snprintf(buffer1, sizeof(buffer1), "Error: Unable to write to file %s\n", filename);
+                            status = ERR_FAILED_TO_WRITE;
+                        }
                     } else {
                         printf("Error Failed to write to file (ERROR CODE %d)\n",ERR_FAILED_TO_WRITE);
                         snprintf(buffer1, sizeof(buffer1), "Error: Unable to write to file %s\n", filename);
+                        status = ERR_FAILED_TO_WRITE;
                     }
                 }
                 
             } else {
                 
                 snprintf(buffer1, sizeof(buffer1), "Error: No data provided for WRITE command\n");
+                status = ERR_INVALID_COMMAND;
             }
-            send(client_socket, buffer1, strlen(buffer1), 0);
+            proto_reply(client_socket, framed, OP_RESULT, 0, request_id, status, buffer1);
         }
     } else if (strcmp(command, "APPEND") == 0) {
         // printf("hell0\n");
         if (is_directory) {
             printf("Error Cannot perform APPEND on a directory (ERROR CODE %d)\n",ERR_IS_DIRECTORY);
             snprintf(buffer1, sizeof(buffer1), "Error: Cannot perform APPEND on a directory %s\n", filename);
-            send(client_socket, buffer1, strlen(buffer1), 0);
+            proto_reply(client_socket, framed, OP_RESULT, 0, request_id, ERR_IS_DIRECTORY, buffer1);
         } else {
+            int status = PROTO_STATUS_OK;
             printf("entered file\n");
             // Extract filename and data
             char *data = strchr(buffer, ' ') + 1;  // Move to the filename part
@@ -883,24 +1359,33 @@ void handle_client_request(char* buffer, char*command, char*filename, int client
                 FILE *file = fopen(filename, "a");  // Open in append mode
                 if (file) {
                     fprintf(file, "%s", data);  // Append data to file
-                    fclose(file);
-                    snprintf(buffer1, sizeof(buffer1), "Success: Data appended to %s\n", filename);
-                    printf("written\n");
+                    bool synced = fflush(file) == 0 && make_durable(fileno(file), durability) == 0;
+                    if (fclose(file) == 0 && synced) {
+                        snprintf(buffer1, sizeof(buffer1), "Success: Data appended to %s\n", filename);
+                        printf("written\n");
+                    } else {
+                        printf("Error Failed to APPEND to file (ERROR CODE %d)\n",ERR_FAILED_TO_APPEND);
+                        snprintf(buffer1, sizeof(buffer1), "Error: Unable to append to file %s\n", filename);
+                        status = ERR_FAILED_TO_APPEND;
+                    }
                 } else {
                     printf("Error Failed to APPEND to file (ERROR CODE %d)\n",ERR_FAILED_TO_APPEND);
                     snprintf(buffer1, sizeof(buffer1), "Error: Unable to append to file %s\n", filename);
+                    status = ERR_FAILED_TO_APPEND;
                 }
             } else {
                 snprintf(buffer1, sizeof(buffer1), "Error: No data provided for APPEND command\n");
+                status = ERR_INVALID_COMMAND;
             }
-            send(client_socket, buffer1, strlen(buffer1), 0);
+            proto_reply(client_socket, framed, OP_RESULT, 0, request_id, status, buffer1);
         }
     } else if (strcmp(command, "INFO") == 0) {
-                    send_file_info(client_socket, filename);
+                    send_file_info(client_socket, filename, framed, request_id);
             // Get file size and permissions
         // }
     } 
     //close(client_socket);
+    return 0;
 }
 
 int handle_audio_request(int client_sock, const char* filename) {
@@ -952,12 +1437,14 @@ int handle_audio_request(int client_sock, const char* filename) {
     return 0;
 }
 
-// Function to connect to the naming server and send metadata, client port, and accessible paths
-void connect_to_ns(const char *ns_ip, int ns_port, int client_port, const char *metadata, const char *paths[], int num_paths) {
+// Function to connect to the naming server and send metadata, client port, and accessible paths.
+// Returns the connection, which stays open to carry the naming server's commands.
+int connect_to_ns(const char *ns_ip, int ns_port, int client_port, const char *metadata, const char *paths[], int num_paths) {
     int sock;
     struct sockaddr_in ns_addr;
     char buffer[BUFFER_SIZE];
-    char message[BUFFER_SIZE];
+    FrameHeader header;
+    ProtoWriter message;
     
     // Create socket
     sock = socket(AF_INET, SOCK_STREAM, 0);
@@ -986,9 +1473,17 @@ void connect_to_ns(const char *ns_ip, int ns_port, int client_port, const char *
 
     printf("Connected to Naming Server at %s:%d\n", ns_ip, ns_port);
 
-    // Create a message with metadata, client port, and accessible paths
-    snprintf(message, sizeof(message), "Metadata: %s, Client Port: %d", metadata, client_port);
-    strcat(message, ", Paths:");
+    // Create a registration frame with client port, metadata, and accessible paths.
+    // Its size is only bounded by PROTO_MAX_PAYLOAD, so large trees register whole.
+    char *payload = malloc(PROTO_MAX_PAYLOAD);
+    if (!payload) {
+        perror("Error allocating registration message");
+        close(sock);
+        exit(EXIT_FAILURE);
+    }
+    proto_writer_init(&message, payload, PROTO_MAX_PAYLOAD);
+    proto_put_u16(&message, client_port);
+    proto_put_str(&message, metadata);
     int path_count = 0;
     for (int i = 0; i < num_paths; ++i) {
         struct stat statbuf;
@@ -996,11 +1491,10 @@ void connect_to_ns(const char *ns_ip, int ns_port, int client_port, const char *
             if (S_ISDIR(statbuf.st_mode)) {
                 printf("hello");
                 // If the path is a directory, add its contents (including the directory itself)
-                add_paths_recursive(paths[i], message, &path_count);
+                add_paths_recursive(paths[i], &message, &path_count);
             } else if (S_ISREG(statbuf.st_mode)) {
                 // If the path is a regular file, add it directly
-                strcat(message, " ");
-                strcat(message, paths[i]);
+                proto_put_str(&message, paths[i]);
                 path_count++;
             }
         } else {
@@ -1010,19 +1504,33 @@ void connect_to_ns(const char *ns_ip, int ns_port, int client_port, const char *
 
     printf("Total paths added: %d\n", path_count); // Print the total count of paths added
 
+    if (message.overflow) {
+        fprintf(stderr, "Registration message exceeds %d bytes\n", PROTO_MAX_PAYLOAD);
+        free(payload);
+        close(sock);
+        exit(EXIT_FAILURE);
+    }
+
     // Send the message to the naming server
-    send(sock, message, strlen(message), 0);
-    printf("Sent message: %s\n", message);
+    if (proto_send_frame(sock, OP_REGISTER, 0, 0, message.data, message.len) < 0) {
+        printf("socket send error (ERROR CODE %d)\n",ERR_SOCK_SEND);
+        perror("Error sending registration");
+    }
+    printf("Sent registration: %d paths in %zu bytes\n", path_count, message.len);
+    free(payload);
 
     //Receive acknowledgment from the naming server
     memset(buffer, 0, sizeof(buffer));
-    recv(sock, buffer, sizeof(buffer), 0);
-    printf("Received acknowledgment: %s\n", buffer);
-    char* check_msg = "Storage server listening on";
-    send(sock, check_msg, strlen(check_msg), 0);
+    if (proto_recv_frame(sock, &header, buffer, sizeof(buffer) - 1) >= 0 && header.opcode == OP_RESULT && header.length >= 2) {
+        printf("Received acknowledgment: %s\n", buffer + 2);
+    } else {
+        printf("socket receive error (ERROR CODE %d)\n",ERR_SOCK_RECEIVE);
+    }
+    proto_send_result(sock, OP_RESULT, 0, 0, PROTO_STATUS_OK, "Storage server listening on");
 
     // Close the connection
     //close(sock);
+    return sock;
 }
 // Function to establish a connection, send data, and receive data
 int connect_to_ss_and_func(const char *dest_ip, int dest_port, const char *message) {
@@ -1074,14 +1582,14 @@ int connect_to_ss_and_func(const char *dest_ip, int dest_port, const char *messa
     return 0; // Success
 }
 
-void copy_file(int client_socket, const char *src_path, const char *dest_path, 
-               const char *dest_ip, int dest_port)
+int copy_file(const char *src_path, const char *dest_path, const char *dest_ip, int dest_port,
+              char *response)
 {  printf("hello iam inside");
      FILE *src_file = fopen(src_path, "rb");
     if(!src_file) {
         printf("Error Failed to open source file (ERROR CODE %d)\n",ERR_OPENING);
-        send(client_socket, "Failed to open source file", 25, 0);
-        return;
+        strcpy(response, "Failed to open source file");
+        return ERR_FAILED_TO_COPY;
     }
 
     struct file_info fi;
@@ -1103,9 +1611,7 @@ void copy_file(int client_socket, const char *src_path, const char *dest_path,
     // }
 
    // Send create command to destination
-    char create_cmd[BUFFER_SIZE];
-    sprintf(create_cmd, "CREATE %s %s F", dest_path, fi.name);
-    send(client_socket, create_cmd, strlen(create_cmd), 0);
+    sprintf(response, "CREATE %s %s F", dest_path, fi.name);
 
     // // Wait for create confirmation
     // char response[BUFFER_SIZE];
@@ -1126,123 +1632,273 @@ void copy_file(int client_socket, const char *src_path, const char *dest_path,
     // fclose(src_file);
     // close(client_socket);
     // send(client_socket, "File copy completed successfully", 31, 0);
+    return PROTO_STATUS_OK;
 }
 
 // New functions for storage server
 
-// Function to handle client requests
-void* handle_client(void* arg) {
-    struct client_info* client = (struct client_info*)arg;
+// Run a COPY, CREATE, DELETE or STATS forwarded by the naming server.
+// Returns 0 or an error code, response gets the message for the naming server.
+int handle_metadata_command(char *buffer, char *response) {
+    char *save;  // Several of these run at once, plain strtok() would share its state
+    char *inst = strtok_r(buffer, " ", &save);
+    if (inst && strcmp(inst, "COPY") == 0) {
+        char *source_path = strtok_r(NULL, " ", &save);
+        char *dest_path = strtok_r(NULL, " ", &save);
+        char *dest_ip = strtok_r(NULL, " ", &save);
+        char *port = strtok_r(NULL, " ", &save);
+        if (!source_path || !dest_path) {
+            strcpy(response, "Invalid COPY command format");
+            return ERR_INVALID_COMMAND;
+        }
+        return copy_file(source_path, dest_path, dest_ip, port ? atoi(port) : 0, response);
+    }
+    if (inst && strcmp(inst, "CREATE") == 0) {
+        char *path = strtok_r(NULL, " ", &save);
+        char *name = strtok_r(NULL, " ", &save);
+        char *flag = strtok_r(NULL, " ", &save);
+        if (!path || !name || !flag) {
+            strcpy(response, "Invalid CREATE command format");
+            return ERR_INVALID_COMMAND;
+        }
+        return handle_create_command(path, name, *flag, response);
+    }
+    if (inst && strcmp(inst, "DELETE") == 0) {
+        char *path = strtok_r(NULL, " ", &save);
+        if (!path) {
+            strcpy(response, "Invalid DELETE command format");
+            return ERR_INVALID_COMMAND;
+        }
+        return handle_delete_command(path, response);
+    }
+    if (inst && strcmp(inst, "STATS") == 0) {
+        format_async_write_stats(response, BUFFER_SIZE);
+        return PROTO_STATUS_OK;
+    }
+    strcpy(response, "Unknown request");
+    return ERR_INVALID_COMMAND;
+}
+
+// Replies on the naming server connection come from several threads at once
+pthread_mutex_t ns_send_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void send_ns_reply(int ns_socket, unsigned long long request_id, int status, const char *text) {
+    pthread_mutex_lock(&ns_send_lock);
+    if (proto_send_result(ns_socket, OP_RESULT, 0, request_id, status, text) < 0) {
+        printf("socket send error (ERROR CODE %d)\n",ERR_SOCK_SEND);
+        perror("Error replying to naming server");
+    }
+    pthread_mutex_unlock(&ns_send_lock);
+}
+
+// Tell the naming server an async write was queued, from then on it counts as outstanding
+void send_ns_async_accepted(unsigned long long request_id, const char *filename) {
+    unsigned char payload[BUFFER_SIZE];
+    ProtoWriter notice;
+
+    if (NS_sock < 0 || request_id == 0) {
+        return;  // Nothing the naming server could match it to
+    }
+    proto_writer_init(&notice, payload, sizeof(payload));
+    proto_put_str(&notice, filename);
+    pthread_mutex_lock(&ns_send_lock);
+    if (notice.overflow || proto_send_frame(NS_sock, OP_ASYNC_ACCEPTED, 0, request_id, notice.data, notice.len) < 0) {
+        printf("socket send error (ERROR CODE %d)\n",ERR_SOCK_SEND);
+        perror("Error confirming async write to naming server");
+    }
+    pthread_mutex_unlock(&ns_send_lock);
+}
+
+void* ns_command_task(void *arg) {
+    NSCommandArgs *args = (NSCommandArgs *)arg;
+    char response[8000];
+
+    printf("Received request %llu from naming server: %s\n", args->request_id, args->command);
+    int status = handle_metadata_command(args->command, response);
+    send_ns_reply(args->ns_socket, args->request_id, status, response);
+    free(args);
+    return NULL;
+}
+
+// Commands the naming server sends over the connection it was registered on.
+// Each runs on its own thread and its reply carries the command's request ID,
+// so the naming server can have several in flight and get them back in any order.
+void handle_ns_commands(int ns_socket) {
+    char *payload = malloc(BUFFER_SIZE);
+    FrameHeader header;
+
+    while (1) {
+        int length = proto_recv_frame(ns_socket, &header, payload, BUFFER_SIZE - 1);
+        if (length < 0 && errno == EMSGSIZE) {
+            send_ns_reply(ns_socket, header.request_id, ERR_INVALID_COMMAND, "Command too long");
+            continue;
+        }
+        if (length < 0) {
+            break;
+        }
+        if (header.opcode != OP_COMMAND) {
+            continue;  // Acknowledgments, nothing to answer
+        }
+
+        NSCommandArgs *args = malloc(sizeof(NSCommandArgs));
+        args->ns_socket = ns_socket;
+        args->request_id = header.request_id;
+        memcpy(args->command, payload, length + 1);
+
+        pthread_t thread_id;
+        if (pthread_create(&thread_id, NULL, ns_command_task, args) != 0) {
+            perror("Error creating thread");
+            send_ns_reply(ns_socket, header.request_id, ERR_PIPE, "Storage server busy");
+            free(args);
+            continue;
+        }
+        pthread_detach(thread_id);
+    }
+
+    printf("Naming server connection closed\n");
+    free(payload);
+}
+
+void* ns_connection_thread(void *arg) {
+    struct ns_connection *conn = (struct ns_connection *)arg;
+    handle_ns_commands(conn->socket);
+    conn->running = 0;
+    return NULL;
+}
+
+ClientQueue client_queue;
+int client_epoll_fd = -1;
+
+// Serve one request from a connection the epoll loop found readable.
+// Returns 1 if the connection stays open for further requests, 0 if it should be closed.
+int serve_client_request(struct client_info *client) {
     char buffer[BUFFER_SIZE];
     char client_ip[INET_ADDRSTRLEN];
     
     // Get client IP address
     inet_ntop(AF_INET, &(client->address.sin_addr), client_ip, INET_ADDRSTRLEN);
-    printf("Handling client from %s:%d\n", client_ip, ntohs(client->address.sin_port));
-    char * handle_msg = "Handling client request";
-    send(client->socket, handle_msg, strlen(handle_msg), 0);
     // char received_msg[100];
     // recv(client->socket, received_msg, sizeof(received_msg), 0);
     // printf("Received message: %s\n", received_msg);
 
-    while (1) {
-        // Clear buffer
-        memset(buffer, 0, BUFFER_SIZE);
-        
-        // Receive request
-        ssize_t bytes_received = recv(client->socket, buffer, BUFFER_SIZE - 1, 0);
-        //printf("Received request from %s:%d: %s\n", client_ip, ntohs(client->address.sin_port), buffer);
-        if (bytes_received <= 0) {
-            // Client disconnected or error
-            break;
+    // Clear buffer
+    memset(buffer, 0, BUFFER_SIZE);
+    
+    // Receive request. Framed peers start it with the protocol's magic byte,
+    // text peers send the bare command line.
+    bool framed = false;
+    unsigned long long request_id = 0;
+    Durability durability = default_durability;
+    errno = 0;  // Tells a timeout apart from the peer closing
+    ssize_t bytes_received = recv(client->socket, buffer, 1, MSG_PEEK);
+    if (bytes_received > 0 && proto_is_frame_start(buffer, bytes_received)) {
+        FrameHeader header;
+        framed = true;
+        bytes_received = proto_recv_frame(client->socket, &header, buffer, BUFFER_SIZE - 1);
+        durability = durability_from_flags(header.flags);
+        if (bytes_received >= 0 && header.opcode == OP_UPLOAD) {
+            printf("Received upload from %s:%d\n", client_ip, ntohs(client->address.sin_port));
+            return handle_upload_request(client->socket, buffer, bytes_received, header.request_id,
+                                         durability) == 0;
         }
-        printf("Received request from %s:%d: %s\n", 
-               client_ip, ntohs(client->address.sin_port), buffer);
-        if(strncmp(buffer, "COPY", 4) == 0){
-            char * inst = strtok(buffer, " ");
-            char * source_path = strtok(NULL, " ");
-            char* dest_path = strtok(NULL, " ");
-            char * dest_ip = strtok(NULL,  " " );
-            int dest_port = strtok(NULL, " ");
-            char message[8000];
-            snprintf(message, sizeof(message), "%s %s %s", inst, source_path, dest_path);
-            printf("mmmmmm %s\n",message);
-            // if(!source_path || !dest_path || !dest_ip || !dest_port) {
-            //     send(client->socket, "Invalid COPY command format", 26, 0);
-            //     break;
-            // }
-            printf("checking\n");
-            //int succ= connect_to_ss_and_func(dest_ip, dest_port, message);
-            copy_file(client->socket, source_path, dest_path, dest_ip, dest_port);
-               // send(client->socket, "Success", 7,0);
-            
-            break;
-            
+        if (bytes_received >= 0 && header.opcode != OP_COMMAND) {
+            proto_reply(client->socket, framed, OP_RESULT, 0, header.request_id, ERR_INVALID_COMMAND, "Unknown request");
+            return 0;
         }
-        if(strncmp(buffer, "CREATE", 6) == 0){
-            char * inst = strtok(buffer, " ");
-            char *path = strtok(NULL, " ");
-            char* name = strtok(NULL, " ");
-            char *flag = strtok(NULL,  " " );
-           
-            char message[8000];
-            // snprintf(message, sizeof(message), "%s %s %s %s", inst, path, name, flag);
-            // printf("mmmmmm %s\n",message);
-            handle_create_command(path, name, *flag, message);
-            send(client->socket, message, strlen(message), 0);
-            break;
-            
-        }
-        // printf("hey\n");
-        printf("%s\n", buffer);
-        if(strncmp(buffer, " DELETE", 6) == 0){
-            printf("hey\n");
-
-            char * inst = strtok(buffer, " ");
-            char *path = strtok(NULL, " ");
-            printf("delete me");
-            char message[8000];
-            // snprintf(message, sizeof(message), "%s %s %s %s", inst, path);
-             //printf("mmmmmm %s\n",message);
-            handle_delete_command(path,message,client->socket);
-           // send(client->socket, message, strlen(message), 0);
-            break;
-            
+        request_id = header.request_id;
+    } else if (bytes_received > 0) {
+        bytes_received = recv(client->socket, buffer, BUFFER_SIZE - 1, 0);
+    }
+    //printf("Received request from %s:%d: %s\n", client_ip, ntohs(client->address.sin_port), buffer);
+    if (bytes_received <= 0) {
+        // Client disconnected, errored or stalled past SS_CLIENT_TIMEOUT_S
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            printf("Client %s:%d timed out mid-request (ERROR CODE %d)\n",
+                   client_ip, ntohs(client->address.sin_port), ERR_SOCK_CONNECT);
         }
-        
-        // Parse request
-        if (strncmp(buffer, "STREAM", 6) == 0) {
-            // Audio streaming request
-            //printf("Received audio streaming request\n");
-            char * inst = strtok(buffer, " ");
-            char * filename = strtok(NULL, " ");
-            handle_audio_request(client->socket, filename);
-            break;
-        }else if (strncmp(buffer, "READ", 4 )== 0 || strncmp(buffer, "APPEND", 6)==0 || strncmp(buffer, "WRITE", 5)==0 || strncmp(buffer, "INFO",4)==0){
-            char buffer2[strlen(buffer) + 1] ;
-            strcpy(buffer2, buffer);
-            char * inst = strtok(buffer, " ");
-            char * filename = strtok(NULL, " ");
-            handle_client_request(buffer2, inst,filename,client->socket);
-            break;
-        } 
-        else if (strncmp(buffer, "STOP", 4) == 0) {
-            // Client wants to disconnect
-            break;
-        } 
-        else {
-            // Unknown request
-            char error_msg[] = "Unknown request";
-            send(client->socket, error_msg, strlen(error_msg), 0);
-            break;
+        return 0;
+    }
+    printf("Received request from %s:%d: %s\n", 
+           client_ip, ntohs(client->address.sin_port), buffer);
+    if (strncmp(buffer, "COPY", 4) == 0 || strncmp(buffer, "CREATE", 6) == 0 || strncmp(buffer, " DELETE", 6) == 0) {
+        char message[8000];
+        int status = handle_metadata_command(buffer, message);
+        proto_reply(client->socket, framed, OP_RESULT, 0, request_id, status, message);
+    }
+    // Parse request
+    else if (strncmp(buffer, "STREAM", 6) == 0) {
+        // Audio streaming request
+        //printf("Received audio streaming request\n");
+        char *save;
+        strtok_r(buffer, " ", &save);
+        char * filename = strtok_r(NULL, " ", &save);
+        handle_audio_request(client->socket, filename);
+        return 0;  // Raw audio bytes, nothing marks where they end
+    }else if (strncmp(buffer, "READ", 4 )== 0 || strncmp(buffer, "APPEND", 6)==0 || strncmp(buffer, "WRITE", 5)==0 || strncmp(buffer, "INFO",4)==0){
+        char buffer2[strlen(buffer) + 1] ;
+        strcpy(buffer2, buffer);
+        char *save;
+        char * inst = strtok_r(buffer, " ", &save);
+        char * filename = strtok_r(NULL, " ", &save);
+        if (handle_client_request(buffer2, inst,filename,client->socket, framed, request_id, durability) < 0) {
+            return 0;
         }
+    } 
+    else if (strncmp(buffer, "STOP", 4) == 0) {
+        // Client wants to disconnect
+        return 0;
+    } 
+    else {
+        // Unknown request
+        char error_msg[] = "Unknown request";
+        proto_reply(client->socket, framed, OP_RESULT, 0, request_id, ERR_INVALID_COMMAND, error_msg);
     }
 
+    // Framed replies mark their own end, so the client can send its next
+    // command on this connection. Text clients get one request each.
+    return framed;
+}
+
+void close_client(struct client_info *client) {
+    char client_ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &(client->address.sin_addr), client_ip, INET_ADDRSTRLEN);
     printf("Client %s:%d disconnected\n", client_ip, ntohs(client->address.sin_port));
-    close(client->socket);
+    close(client->socket);  // Also removes it from the epoll set
     free(client);
+
+    pthread_mutex_lock(&client_queue.lock);
+    client_queue.connections--;
+    pthread_mutex_unlock(&client_queue.lock);
+}
+
+// Workers take readable connections off the queue, serve one request each and hand
+// the connection back to epoll, so idle connections hold no thread
+void *client_worker(void *arg) {
+    (void)arg;
+    while (1) {
+        pthread_mutex_lock(&client_queue.lock);
+        while (client_queue.count == 0) {
+            pthread_cond_wait(&client_queue.not_empty, &client_queue.lock);
+        }
+        struct client_info *client = client_queue.items[client_queue.head];
+        client_queue.head = (client_queue.head + 1) % SS_MAX_CLIENTS;
+        client_queue.count--;
+        pthread_mutex_unlock(&client_queue.lock);
+
+        if (serve_client_request(client)) {
+            struct epoll_event event;
+            event.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+            event.data.ptr = client;
+            if (epoll_ctl(client_epoll_fd, EPOLL_CTL_MOD, client->socket, &event) == 0) {
+                continue;
+            }
+            perror("Error re-arming client connection");
+        }
+        close_client(client);
+    }
     return NULL;
 }
+
 void connect_to_client(int storage_port, char* storage_ip) {
     int server_socket = socket(AF_INET, SOCK_STREAM, 0);
     if (server_socket < 0) {
@@ -1276,42 +1932,114 @@ void connect_to_client(int storage_port, char* storage_ip) {
     }
 
     // Start listening
-    if (listen(server_socket, 10) < 0) {
+    if (listen(server_socket, SOMAXCONN) < 0) {
         printf("socket error (ERROR CODE %d)\n",ERR_SOCK);
         perror("Error listening on socket");
         close(server_socket);
         return;
     }
 
-    printf("Storage server listening on %s:%d\n", storage_ip, storage_port);
-
-    // Accept and handle client connections
-    while (1) {
-        struct client_info* client = malloc(sizeof(struct client_info));
-        socklen_t client_len = sizeof(client->address);
-
-        // Accept new connection
-        client->socket = accept(server_socket, (struct sockaddr*)&client->address, &client_len);
-        if (client->socket < 0) {
-            printf("socket error (ERROR CODE %d)\n",ERR_SOCK);
-            perror("Error accepting client connection");
-            free(client);
-            continue;
-        }
-
-        // Create thread to handle this client
+    client_epoll_fd = epoll_create1(0);
+    if (client_epoll_fd < 0) {
+        perror("Error creating epoll instance");
+        close(server_socket);
+        return;
+    }
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = NULL;  // NULL marks the listening socket
+    epoll_ctl(client_epoll_fd, EPOLL_CTL_ADD, server_socket, &event);
+
+    // Fixed pool of workers, sized for blocking file I/O rather than for the connection count
+    memset(&client_queue, 0, sizeof(client_queue));
+    pthread_mutex_init(&client_queue.lock, NULL);
+    pthread_cond_init(&client_queue.not_empty, NULL);
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int num_workers = cpus > 0 && cpus * 2 > SS_MIN_WORKERS ? (int)cpus * 2 : SS_MIN_WORKERS;
+    for (int i = 0; i < num_workers; i++) {
         pthread_t thread_id;
-        if (pthread_create(&thread_id, NULL, handle_client, client) != 0) {
+        if (pthread_create(&thread_id, NULL, client_worker, NULL) != 0) {
             perror("Error creating thread");
-            close(client->socket);
-            free(client);
             continue;
         }
-
-        // Detach thread to allow it to clean up automatically
         pthread_detach(thread_id);
     }
 
+    printf("Storage server listening on %s:%d with %d workers\n", storage_ip, storage_port, num_workers);
+
+    // Accept connections and queue the ones with a request waiting
+    struct epoll_event events[SS_MAX_EVENTS];
+    while (1) {
+        int ready = epoll_wait(client_epoll_fd, events, SS_MAX_EVENTS, -1);
+        if (ready < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("Error waiting for client connections");
+            break;
+        }
+
+        for (int i = 0; i < ready; i++) {
+            struct client_info *client = events[i].data.ptr;
+            if (client) {
+                pthread_mutex_lock(&client_queue.lock);
+                client_queue.items[(client_queue.head + client_queue.count) % SS_MAX_CLIENTS] = client;
+                client_queue.count++;
+                pthread_cond_signal(&client_queue.not_empty);
+                pthread_mutex_unlock(&client_queue.lock);
+                continue;
+            }
+
+            client = malloc(sizeof(struct client_info));
+            socklen_t client_len = sizeof(client->address);
+
+            // Accept new connection
+            client->socket = accept(server_socket, (struct sockaddr*)&client->address, &client_len);
+            if (client->socket < 0) {
+                printf("socket error (ERROR CODE %d)\n",ERR_SOCK);
+                perror("Error accepting client connection");
+                free(client);
+                continue;
+            }
+
+            // Admission control: past SS_MAX_CLIENTS the connection is closed before the banner
+            pthread_mutex_lock(&client_queue.lock);
+            bool admitted = client_queue.connections < SS_MAX_CLIENTS;
+            if (admitted) {
+                client_queue.connections++;
+            } else {
+                client_queue.rejected++;
+            }
+            pthread_mutex_unlock(&client_queue.lock);
+            if (!admitted) {
+                printf("Rejected client, %d connections already open (ERROR CODE %d)\n", SS_MAX_CLIENTS, ERR_SOCK_CONNECT);
+                close(client->socket);
+                free(client);
+                continue;
+            }
+
+            // Workers block on the socket once a request starts arriving, so a peer that
+            // stops sending or reading part way through must not hold one forever
+            struct timeval timeout = { SS_CLIENT_TIMEOUT_S, 0 };
+            setsockopt(client->socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+            setsockopt(client->socket, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+            char client_ip[INET_ADDRSTRLEN];
+            inet_ntop(AF_INET, &(client->address.sin_addr), client_ip, INET_ADDRSTRLEN);
+            printf("Handling client from %s:%d\n", client_ip, ntohs(client->address.sin_port));
+            char * handle_msg = "Handling client request";
+            send(client->socket, handle_msg, strlen(handle_msg), MSG_NOSIGNAL);
+
+            event.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+            event.data.ptr = client;
+            if (epoll_ctl(client_epoll_fd, EPOLL_CTL_ADD, client->socket, &event) < 0) {
+                perror("Error watching client connection");
+                close_client(client);
+            }
+        }
+    }
+
+    close(client_epoll_fd);
     close(server_socket);
 }
 void find_ss_ip(char *ip) {
@@ -1378,12 +2106,35 @@ int main(int argc, char *argv[]) {
      char ss_id[32];
     snprintf(ss_id, sizeof(ss_id), "SS_%s_%d", ip, client_port);
 
+    // Durability of writes that do not ask for one
+    const char *durability = getenv("SS_DURABILITY");
+    if (durability && parse_durability(durability) < 0) {
+        printf("Unknown SS_DURABILITY %s, use none, fdatasync or group (ERROR CODE %d)\n",
+               durability, ERR_INVALID_COMMAND);
+    } else if (durability) {
+        default_durability = parse_durability(durability);
+    }
+    printf("Write durability: %s\n", durability_name(default_durability));
+
+    io_engine_init();
+    init_async_write_executor();
     send_backup_to_server(backup_ip, backup_port, ss_id, paths, num_paths);
-    connect_to_ns(ns_ip, ns_port, client_port, metadata, paths, num_paths);
+    static struct ns_connection ns_conn;
+    ns_conn.socket = connect_to_ns(ns_ip, ns_port, client_port, metadata, paths, num_paths);
+    NS_sock = ns_conn.socket;
+    ns_conn.ns_ip = ns_ip;
+    ns_conn.ns_port = ns_port;
+    ns_conn.running = 1;
+    pthread_t ns_thread;
+    if (pthread_create(&ns_thread, NULL, ns_connection_thread, &ns_conn) != 0) {
+        perror("Error creating thread");
+    } else {
+        pthread_detach(ns_thread);
+    }
     connect_to_client(client_port, ip);
     return 0;
 }
-void add_paths_recursive(const char *base_path, char *message, int *path_count) {
+void add_paths_recursive(const char *base_path, ProtoWriter *message, int *path_count) {
     struct dirent *entry;
     struct stat statbuf;
     char full_path[BUFFER_SIZE];
@@ -1396,8 +2147,7 @@ void add_paths_recursive(const char *base_path, char *message, int *path_count)
     }
 
     // Add the directory itself to the message
-    strcat(message, " ");
-    strcat(message, base_path);
+    proto_put_str(message, base_path);
     (*path_count)++;
 
     while ((entry = readdir(dir)) != NULL) {
@@ -1415,8 +2165,7 @@ void add_paths_recursive(const char *base_path, char *message, int *path_count)
                 add_paths_recursive(full_path, message, path_count);
             } else if (S_ISREG(statbuf.st_mode)) {
                 // Add the file path to the message
-                strcat(message, " ");
-                strcat(message, full_path);
+                proto_put_str(message, full_path);
                 (*path_count)++;
             }
         }
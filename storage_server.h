@@ -1,5 +1,6 @@
 #ifndef STORAGE_SERVER_H
 #define STORAGE_SERVER_H
+#define _GNU_SOURCE  // sync_file_range()
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -13,8 +14,14 @@
 #include <dirent.h>
 #include <time.h>
 #include <sys/select.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <netinet/tcp.h>
+#include <fcntl.h>
 #include <errno.h>
 #include <libgen.h>
+#include "protocol.h"
+#include "io_engine.h"
 // File structure to hold metadata
 #define BUFFER_SIZE 4096
 struct file_info {
@@ -46,6 +53,13 @@ struct dir_info {
 #define NS_BUFFER_SIZE 1024
 #define NS_COMMAND_SIZE 128
 #define ASYNC_THRESHOLD 1024
+// How far a WRITE/APPEND's data must get before it is reported done
+typedef enum {
+    DURABILITY_NONE,        // Page cache only, the kernel writes it back later
+    DURABILITY_FDATASYNC,   // fdatasync() before the file is closed
+    DURABILITY_GROUP        // fdatasync() after writeback started for all writers waiting at the time
+} Durability;
+
 // Structure to hold NS connection info
 struct ns_connection {
     int socket;
@@ -99,6 +113,23 @@ struct client_info {
     int socket;
     struct sockaddr_in address;
 };
+
+#define SS_MAX_CLIENTS 1024  // Client connections admitted at once, later ones are turned away
+#define SS_MIN_WORKERS 4     // Client worker threads, at least this many or two per CPU
+#define SS_MAX_EVENTS 64     // Events handled per epoll_wait in the accept loop
+#define SS_CLIENT_TIMEOUT_S 10  // A client stalled this long mid-request is dropped, freeing its worker
+
+// Connections with a request waiting, handed from the epoll loop to the workers.
+// EPOLLONESHOT queues a connection at most once, so SS_MAX_CLIENTS slots never overflow.
+typedef struct {
+    struct client_info *items[SS_MAX_CLIENTS];
+    int head;
+    int count;
+    int connections;          // Admitted connections, queued, being served or idle
+    unsigned long rejected;   // Connections turned away at SS_MAX_CLIENTS
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+} ClientQueue;
 // Structure for audio file metadata
 struct audio_metadata {
     char filename[MAX_FILENAME];
@@ -116,12 +147,57 @@ void handle_copy_request(int client_socket, const char *src_path, const char *de
 
 // Add these function prototypes to your header file
 void handle_ns_commands(int ns_socket);
+void* ns_connection_thread(void *arg);
+void* ns_command_task(void *arg);
+void send_ns_reply(int ns_socket, unsigned long long request_id, int status, const char *text);
+void send_ns_async_accepted(unsigned long long request_id, const char *filename);
+int handle_metadata_command(char *buffer, char *response);
+void send_completion_ack_to_ns(const char* filename, const char* client_ip, int client_port,
+                               unsigned long long request_id, int status, const char* result);
+int serve_client_request(struct client_info *client);
+int handle_client_request(char* buffer, char*command, char*filename, int client_socket,
+                          bool framed, unsigned long long request_id, Durability durability);
+int handle_upload_request(int client_socket, const char *payload, size_t length,
+                          unsigned long long request_id, Durability durability);
+void *client_worker(void *arg);
+void close_client(struct client_info *client);
+int copy_file(const char *src_path, const char *dest_path, const char *dest_ip, int dest_port,
+              char *response);
+int connect_to_ns(const char *ns_ip, int ns_port, int client_port, const char *metadata,
+                  const char *paths[], int num_paths);
 //int copy_file(const char* source_path, const char* dest_ip, int dest_port, const char* dest_path);
 //void send_file(const char* file_path, int dest_socket);
 //void receive_file(const char* file_path, int source_socket);
- void handle_create_command(const char *path, const char *name, const char type, char *response);
+ int handle_create_command(const char *path, const char *name, const char type, char *response);
+int handle_delete_command(const char *path, char *response);
+void add_paths_recursive(const char *base_path, ProtoWriter *message, int *path_count);
+
+#define ASYNC_WRITE_WORKERS 4          // Threads running queued async writes
+#define ASYNC_WRITE_QUEUE_LIMIT 256    // Accepted writes not yet finished, past it writes are refused
+#define ASYNC_WRITE_MAX_BYTES (64 * 1024 * 1024)  // Data those writes may hold, past it writes are refused
+#define ASYNC_WRITE_LANE_BUCKETS 64    // Hash chains of the per-file lanes
+#define ASYNC_LATENCY_BUCKETS 6        // <1ms, <10ms, <100ms, <1s, <10s, >=10s
+
+#define GROUP_COMMIT_WINDOW_US 200     // How long a group commit leader waits for others to join
+
+// A writer waiting for its group commit, lives on that writer's stack
+typedef struct CommitWaiter {
+    int fd;
+    bool done;                      // Writeback started, the writer may fdatasync() now
+    struct CommitWaiter *next;
+} CommitWaiter;
 
 typedef struct {
+    CommitWaiter *pending;          // Writers waiting for the next batch
+    bool syncing;                   // A leader is collecting a batch or starting its writeback
+    unsigned long last_batch;       // Writers in the latest batch
+    unsigned long batches;          // Batches started by a leader
+    unsigned long writers;          // Writers those calls covered
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+} GroupCommit;
+
+typedef struct WriteTaskArgs {
     char *filename;
     char *data;
     // char *ns_ip;
@@ -130,8 +206,61 @@ typedef struct {
     // char *client_ip_addr;
     char client_ip[INET_ADDRSTRLEN];
     int client_port;
+    unsigned long long request_id;  // Naming server's ID for the WRITE, echoed in the completion
+    size_t data_len;
+    Durability durability;
+    long submitted_us;              // Monotonic time the write was accepted
+    struct WriteTaskArgs *next;     // Next write queued for the same file
 } WriteTaskArgs;
 
+// Async writes to one file, run in the order they were accepted and by one worker at a time
+typedef struct WriteLane {
+    char *filename;
+    WriteTaskArgs *head;
+    WriteTaskArgs *tail;
+    bool running;                   // A worker is writing this file right now
+    bool queued;                    // On the executor's ready list
+    struct WriteLane *chain_next;   // Next lane in the same hash bucket
+    struct WriteLane *ready_next;   // Next lane on the ready list
+} WriteLane;
+
+// Fixed pool of writer threads fed by per-file lanes. Submissions beyond the
+// depth or byte limit are refused, so a burst cannot grow threads or memory.
+typedef struct {
+    WriteLane *lanes[ASYNC_WRITE_LANE_BUCKETS];
+    WriteLane *ready_head;          // Lanes with writes waiting and no worker on them
+    WriteLane *ready_tail;
+    int depth;                      // Accepted writes not finished yet
+    int peak_depth;
+    size_t bytes;                   // Data held by those writes
+    unsigned long submitted;
+    unsigned long rejected;
+    unsigned long completed;
+    unsigned long failed;
+    unsigned long latency_us;       // Total time from acceptance to completion
+    unsigned long latency[ASYNC_LATENCY_BUCKETS]; // Completed writes by that time
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+} AsyncWriteExecutor;
+
+int async_write_task(WriteTaskArgs *task_args);
+void init_async_write_executor();
+int submit_async_write(WriteTaskArgs *task);
+void *async_write_worker(void *arg);
+void format_async_write_stats(char *report, size_t size);
+int parse_durability(const char *name);
+const char *durability_name(Durability mode);
+Durability durability_from_flags(uint8_t flags);
+int make_durable(int fd, Durability mode);
+int group_commit(int fd);
+
+// COPY, CREATE or DELETE received on the naming server connection
+typedef struct {
+    int ns_socket;
+    unsigned long long request_id;  // Echoed in the reply so the naming server can match it
+    char command[BUFFER_SIZE];
+} NSCommandArgs;
+
 enum Errorcodes {
     ERR_FILE_NOT_FOUND = 300,
     ERR_FAILED_TO_READ = 301,
@@ -150,6 +279,7 @@ enum Errorcodes {
     ERR_MAX_SS_REACHED = 314,
     ERR_OPENING = 315,
     ERR_PIPE = 316,
-    ERR_INVALID_COMMAND = 317
+    ERR_INVALID_COMMAND = 317,
+    ERR_SERVER_BUSY = 318
 };
 #endif
\ No newline at end of file
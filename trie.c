@@ -0,0 +1,420 @@
+#include "trie.h"
+
+// Strip leading, trailing and repeated '/' so "/a//b/" becomes "a/b"
+static void normalize_path(const char* path, char* out, size_t size) {
+    size_t len = 0;
+    while (*path && len + 1 < size) {
+        if (*path == '/') {
+            while (*path == '/') {
+                path++;
+            }
+            if (*path && len > 0) {
+                out[len++] = '/';
+            }
+            continue;
+        }
+        out[len++] = *path++;
+    }
+    out[len] = '\0';
+}
+
+// Write path in the form trie_visit_fn reports it, so "a//b/" becomes "/a/b" and "" becomes "/"
+void trie_canonical_path(const char* path, char* out, size_t size) {
+    if (size < 2) {
+        if (size > 0) {
+            out[0] = '\0';
+        }
+        return;
+    }
+    out[0] = '/';
+    normalize_path(path, out + 1, size - 1);
+}
+
+// Length of the first path component of s
+static size_t component_len(const char* s) {
+    return strcspn(s, "/");
+}
+
+// Compare the first path components of a and b
+static int compare_first_component(const char* a, const char* b) {
+    size_t len_a = component_len(a);
+    size_t len_b = component_len(b);
+    int cmp = strncmp(a, b, len_a < len_b ? len_a : len_b);
+    if (cmp != 0) {
+        return cmp;
+    }
+    return (len_a > len_b) - (len_a < len_b);
+}
+
+// Length of the longest common prefix of a and b that ends on a component boundary
+static size_t common_components(const char* a, const char* b) {
+    size_t n = 0;
+    size_t boundary = 0;
+    while (1) {
+        bool a_end = (a[n] == '\0' || a[n] == '/');
+        bool b_end = (b[n] == '\0' || b[n] == '/');
+        if (a_end && b_end) {
+            boundary = n;
+            if (a[n] == '\0' || b[n] == '\0') {
+                break;
+            }
+        } else if (a[n] != b[n]) {
+            break;
+        }
+        n++;
+    }
+    return boundary;
+}
+
+// Create a node whose label is the first len characters of label, owned by owner unless it is -1
+static TrieNode* create_trie_node(const char* label, size_t len, int owner) {
+    TrieNode* node = (TrieNode*)malloc(sizeof(TrieNode));
+    node->label = (char*)malloc(len + 1);
+    memcpy(node->label, label, len);
+    node->label[len] = '\0';
+    node->num_owners = 0;
+    if (owner != -1) {
+        node->owners[node->num_owners++] = owner;
+    }
+    node->children = NULL;
+    node->num_children = 0;
+    node->children_capacity = 0;
+    return node;
+}
+
+// Binary search the children for the one sharing rest's first component.
+// Returns its position, or the position to insert at if there is none.
+static int find_child(const TrieNode* node, const char* rest, bool* found) {
+    int lo = 0;
+    int hi = node->num_children;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        int cmp = compare_first_component(node->children[mid]->label, rest);
+        if (cmp == 0) {
+            *found = true;
+            return mid;
+        }
+        if (cmp < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    *found = false;
+    return lo;
+}
+
+static void insert_child(TrieNode* node, int pos, TrieNode* child) {
+    if (node->num_children == node->children_capacity) {
+        node->children_capacity = node->children_capacity ? node->children_capacity * 2 : 4;
+        node->children = (TrieNode**)realloc(node->children,
+                                             sizeof(TrieNode*) * node->children_capacity);
+    }
+    memmove(&node->children[pos + 1], &node->children[pos],
+            sizeof(TrieNode*) * (node->num_children - pos));
+    node->children[pos] = child;
+    node->num_children++;
+}
+
+static void remove_child(TrieNode* node, int pos) {
+    memmove(&node->children[pos], &node->children[pos + 1],
+            sizeof(TrieNode*) * (node->num_children - pos - 1));
+    node->num_children--;
+}
+
+static void free_trie_node(TrieNode* node) {
+    free(node->label);
+    free(node->children);
+    free(node);
+}
+
+static void free_subtree(TrieNode* node) {
+    for (int i = 0; i < node->num_children; i++) {
+        free_subtree(node->children[i]);
+    }
+    free_trie_node(node);
+}
+
+// First owner of node, or -1 if it has none
+static int first_owner(const TrieNode* node) {
+    return node->num_owners > 0 ? node->owners[0] : -1;
+}
+
+// Drop owner from node's owner set, returns whether it was there
+static bool remove_owner(TrieNode* node, int owner) {
+    for (int i = 0; i < node->num_owners; i++) {
+        if (node->owners[i] == owner) {
+            node->owners[i] = node->owners[--node->num_owners];
+            return true;
+        }
+    }
+    return false;
+}
+
+// Drop a child left without an owner or children, or merge it into its only child
+static void compact_child(TrieNode* parent, int pos) {
+    TrieNode* child = parent->children[pos];
+    if (child->num_owners > 0) {
+        return;
+    }
+
+    if (child->num_children == 0) {
+        remove_child(parent, pos);
+        free_trie_node(child);
+    } else if (child->num_children == 1) {
+        TrieNode* only = child->children[0];
+        size_t len = strlen(child->label) + strlen(only->label) + 2;
+        char* label = (char*)malloc(len);
+        snprintf(label, len, "%s/%s", child->label, only->label);
+        free(only->label);
+        only->label = label;
+        parent->children[pos] = only;
+        free_trie_node(child);
+    }
+}
+
+// State of one trie_remove_subtree walk
+typedef struct {
+    int owner;          // Server whose registrations are removed
+    trie_visit_fn fn;
+    void* arg;
+    int removed;        // Paths owner was dropped from
+    int emptied;        // Of those, paths left with no owner
+} RemoveWalk;
+
+// Drop walk->owner from node and everything below it, freeing or merging
+// nodes left empty. path holds node's full path of length len.
+static void drop_owner(TrieNode* node, char* path, size_t len, RemoveWalk* walk) {
+    if (remove_owner(node, walk->owner)) {
+        walk->removed++;
+        if (node->num_owners == 0) {
+            walk->emptied++;
+        }
+        if (walk->fn) {
+            walk->fn(len ? path : "/", walk->owner, walk->arg);
+        }
+    }
+    // Back to front, compacting a child only moves those after it
+    for (int i = node->num_children - 1; i >= 0; i--) {
+        snprintf(path + len, TRIE_MAX_PATH - len, "/%s", node->children[i]->label);
+        drop_owner(node->children[i], path, strlen(path), walk);
+        path[len] = '\0';
+        compact_child(node, i);
+    }
+}
+
+// Drop walk->owner from the subtree at rest below node. path holds node's full path of length len.
+static bool remove_below(TrieNode* node, const char* rest, char* path, size_t len, RemoveWalk* walk) {
+    bool found;
+    int pos = find_child(node, rest, &found);
+    if (!found) {
+        return false;
+    }
+
+    TrieNode* child = node->children[pos];
+    size_t n = common_components(child->label, rest);
+    if (rest[n] != '\0' && child->label[n] != '\0') {
+        return false; // Path leaves the trie inside this label
+    }
+
+    snprintf(path + len, TRIE_MAX_PATH - len, "/%s", child->label);
+    bool result = true;
+    if (rest[n] == '\0') {
+        // The path ends at or inside this child's label, so all of it is below path
+        drop_owner(child, path, strlen(path), walk);
+    } else {
+        result = remove_below(child, rest + n + 1, path, strlen(path), walk);
+    }
+    path[len] = '\0';
+    if (result) {
+        compact_child(node, pos);
+    }
+    return result;
+}
+
+// Initialize an empty namespace trie
+NamespaceTrie* init_namespace_trie() {
+    NamespaceTrie* trie = (NamespaceTrie*)malloc(sizeof(NamespaceTrie));
+    trie->root = create_trie_node("", 0, -1);
+    trie->num_paths = 0;
+    pthread_rwlock_init(&trie->lock, NULL);
+    return trie;
+}
+
+// Register owner for path, splitting labels where the path diverges from them
+void trie_insert(NamespaceTrie* trie, const char* path, int owner) {
+    char normalized[TRIE_MAX_PATH];
+    normalize_path(path, normalized, sizeof(normalized));
+
+    pthread_rwlock_wrlock(&trie->lock);
+
+    TrieNode* node = trie->root;
+    const char* rest = normalized;
+    while (*rest) {
+        bool found;
+        int pos = find_child(node, rest, &found);
+        if (!found) {
+            insert_child(node, pos, create_trie_node(rest, strlen(rest), owner));
+            trie->num_paths++;
+            pthread_rwlock_unlock(&trie->lock);
+            return;
+        }
+
+        TrieNode* child = node->children[pos];
+        size_t n = common_components(child->label, rest);
+        if (child->label[n] != '\0') {
+            // Split the label where the new path stops following it
+            TrieNode* mid = create_trie_node(child->label, n, -1);
+            char* tail = strdup(child->label + n + 1);
+            free(child->label);
+            child->label = tail;
+            insert_child(mid, 0, child);
+            node->children[pos] = mid;
+            child = mid;
+        }
+
+        node = child;
+        rest += n;
+        if (*rest == '/') {
+            rest++;
+        }
+    }
+
+    bool known = false;
+    for (int i = 0; i < node->num_owners; i++) {
+        known |= (node->owners[i] == owner);
+    }
+    if (!known && node->num_owners < TRIE_MAX_OWNERS) {
+        if (node->num_owners == 0) {
+            trie->num_paths++;
+        }
+        node->owners[node->num_owners++] = owner;
+    }
+
+    pthread_rwlock_unlock(&trie->lock);
+}
+
+// Owner of the longest registered prefix of path, or -1 if no prefix is registered
+int trie_resolve(NamespaceTrie* trie, const char* path) {
+    char normalized[TRIE_MAX_PATH];
+    normalize_path(path, normalized, sizeof(normalized));
+
+    pthread_rwlock_rdlock(&trie->lock);
+
+    TrieNode* node = trie->root;
+    int best = first_owner(node);
+    const char* rest = normalized;
+    while (*rest) {
+        bool found;
+        int pos = find_child(node, rest, &found);
+        if (!found) {
+            break;
+        }
+        TrieNode* child = node->children[pos];
+        size_t n = common_components(child->label, rest);
+        if (child->label[n] != '\0') {
+            break; // Path ends or diverges inside this label
+        }
+        node = child;
+        if (node->num_owners > 0) {
+            best = first_owner(node);
+        }
+        rest += n;
+        if (*rest == '/') {
+            rest++;
+        }
+    }
+
+    pthread_rwlock_unlock(&trie->lock);
+    return best;
+}
+
+// Call fn with the name of each entry directly under path, and its first owner.
+// Entries that are only intermediate directories are reported with owner -1.
+// Returns the number of entries, or -1 if path is not in the namespace.
+int trie_list_directory(NamespaceTrie* trie, const char* path, trie_visit_fn fn, void* arg) {
+    char normalized[TRIE_MAX_PATH];
+    char name[TRIE_MAX_PATH];
+    int count = -1;
+    normalize_path(path, normalized, sizeof(normalized));
+
+    pthread_rwlock_rdlock(&trie->lock);
+
+    TrieNode* node = trie->root;
+    const char* rest = normalized;
+    while (*rest) {
+        bool found;
+        int pos = find_child(node, rest, &found);
+        if (!found) {
+            goto done;
+        }
+        TrieNode* child = node->children[pos];
+        size_t n = common_components(child->label, rest);
+        if (rest[n] == '\0' && child->label[n] == '/') {
+            // Path ends inside this label, so its only entry is the next component
+            const char* next = child->label + n + 1;
+            size_t len = component_len(next);
+            memcpy(name, next, len);
+            name[len] = '\0';
+            fn(name, next[len] == '\0' ? first_owner(child) : -1, arg);
+            count = 1;
+            goto done;
+        }
+        if (child->label[n] != '\0') {
+            goto done;
+        }
+        node = child;
+        rest += n;
+        if (*rest == '/') {
+            rest++;
+        }
+    }
+
+    count = 0;
+    for (int i = 0; i < node->num_children; i++) {
+        const char* label = node->children[i]->label;
+        size_t len = component_len(label);
+        memcpy(name, label, len);
+        name[len] = '\0';
+        fn(name, label[len] == '\0' ? first_owner(node->children[i]) : -1, arg);
+        count++;
+    }
+
+done:
+    pthread_rwlock_unlock(&trie->lock);
+    return count;
+}
+
+// Remove owner's registration of path and of everything below it, calling fn with
+// each path dropped. Paths other servers also registered stay in the namespace.
+// Returns the number of paths dropped, or -1 if path is not in the namespace.
+int trie_remove_subtree(NamespaceTrie* trie, const char* path, int owner, trie_visit_fn fn, void* arg) {
+    char normalized[TRIE_MAX_PATH];
+    char full_path[TRIE_MAX_PATH] = "";
+    RemoveWalk walk = { owner, fn, arg, 0, 0 };
+    bool found = true;
+    normalize_path(path, normalized, sizeof(normalized));
+
+    pthread_rwlock_wrlock(&trie->lock);
+
+    if (normalized[0] == '\0') {
+        // Removing "/" walks the whole namespace
+        drop_owner(trie->root, full_path, 0, &walk);
+    } else {
+        found = remove_below(trie->root, normalized, full_path, 0, &walk);
+    }
+    trie->num_paths -= walk.emptied;
+
+    pthread_rwlock_unlock(&trie->lock);
+    return found ? walk.removed : -1;
+}
+
+// Clean up the trie
+void free_namespace_trie(NamespaceTrie* trie) {
+    pthread_rwlock_wrlock(&trie->lock);
+    free_subtree(trie->root);
+    pthread_rwlock_unlock(&trie->lock);
+
+    pthread_rwlock_destroy(&trie->lock);
+    free(trie);
+}
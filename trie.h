@@ -0,0 +1,39 @@
+#ifndef TRIE_H
+#define TRIE_H
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#define TRIE_MAX_PATH 1024  // Longest path rebuilt while walking a subtree
+#define TRIE_MAX_OWNERS 4   // Storage servers that may register the same path, as MAX_PATH_OWNERS
+
+// Node of the compressed namespace trie. A label holds one or more path
+// components joined by '/', so chains of single-child directories share a node.
+typedef struct TrieNode {
+    char* label;                 // Components covered by this node, no leading '/'
+    int owners[TRIE_MAX_OWNERS]; // Storage servers registered for exactly this path
+    int num_owners;
+    struct TrieNode** children;  // Children sorted by their first component
+    int num_children;
+    int children_capacity;
+} TrieNode;
+
+typedef struct {
+    TrieNode* root;              // Represents "/"
+    int num_paths;               // Paths with an owner
+    pthread_rwlock_t lock;       // Readers share, inserts and removals write
+} NamespaceTrie;
+
+// Called with the full path (and its owner) of each node visited
+typedef void (*trie_visit_fn)(const char* path, int owner, void* arg);
+
+void trie_canonical_path(const char* path, char* out, size_t size);
+NamespaceTrie* init_namespace_trie();
+void trie_insert(NamespaceTrie* trie, const char* path, int owner);
+int trie_resolve(NamespaceTrie* trie, const char* path);
+int trie_list_directory(NamespaceTrie* trie, const char* path, trie_visit_fn fn, void* arg);
+int trie_remove_subtree(NamespaceTrie* trie, const char* path, int owner, trie_visit_fn fn, void* arg);
+void free_namespace_trie(NamespaceTrie* trie);
+#endif